@@ -152,6 +152,141 @@ bool parse(std::istream& istr, Sam::VM& vm, Error_State& err)
         }
         else vm.load(addr_tok.value);
       }
+      else if(tok.str_value == "addi")
+      {
+        Token next_tok = get_tok(istr);
+        if(next_tok.type != Token::TOK_INT && next_tok.type != Token::TOK_CHAR)
+        {
+          err.err_msg = "Expected integer or char. Found: ";
+          err.err_msg += next_tok.str_value;
+          return false;
+        }
+        else vm.addi(next_tok.value);
+      }
+      else if(tok.str_value == "subi")
+      {
+        Token next_tok = get_tok(istr);
+        if(next_tok.type != Token::TOK_INT && next_tok.type != Token::TOK_CHAR)
+        {
+          err.err_msg = "Expected integer or char. Found: ";
+          err.err_msg += next_tok.str_value;
+          return false;
+        }
+        else vm.subi(next_tok.value);
+      }
+      else if(tok.str_value == "muli")
+      {
+        Token next_tok = get_tok(istr);
+        if(next_tok.type != Token::TOK_INT && next_tok.type != Token::TOK_CHAR)
+        {
+          err.err_msg = "Expected integer or char. Found: ";
+          err.err_msg += next_tok.str_value;
+          return false;
+        }
+        else vm.muli(next_tok.value);
+      }
+      else if(tok.str_value == "divi")
+      {
+        Token next_tok = get_tok(istr);
+        if(next_tok.type != Token::TOK_INT && next_tok.type != Token::TOK_CHAR)
+        {
+          err.err_msg = "Expected integer or char. Found: ";
+          err.err_msg += next_tok.str_value;
+          return false;
+        }
+        else vm.divi(next_tok.value);
+      }
+      else if(tok.str_value == "modi")
+      {
+        Token next_tok = get_tok(istr);
+        if(next_tok.type != Token::TOK_INT && next_tok.type != Token::TOK_CHAR)
+        {
+          err.err_msg = "Expected integer or char. Found: ";
+          err.err_msg += next_tok.str_value;
+          return false;
+        }
+        else vm.modi(next_tok.value);
+      }
+      else if(tok.str_value == "incm")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.incm(addr_tok.value);
+      }
+      else if(tok.str_value == "decm")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.decm(addr_tok.value);
+      }
+      else if(tok.str_value == "jsge")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.jsge(addr_tok.value);
+      }
+      else if(tok.str_value == "jsgt")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.jsgt(addr_tok.value);
+      }
+      else if(tok.str_value == "jsle")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.jsle(addr_tok.value);
+      }
+      else if(tok.str_value == "jslt")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.jslt(addr_tok.value);
+      }
+      else if(tok.str_value == "jseq")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.jseq(addr_tok.value);
+      }
+      else if(tok.str_value == "jsne")
+      {
+        Token addr_tok = get_tok(istr);
+        if(addr_tok.type != Token::TOK_INT)
+        {
+          err.err_msg = "Argument must be an integer.";
+          return false;
+        }
+        else vm.jsne(addr_tok.value);
+      }
       else if(tok.str_value == "pop")
         vm.pop();
       else if(tok.str_value == "add")
@@ -178,6 +313,24 @@ bool parse(std::istream& istr, Sam::VM& vm, Error_State& err)
         vm.sstore();
       else if(tok.str_value == "halt")
         vm.halt();
+      else if(tok.str_value == "outs")
+        vm.outs();
+      else if(tok.str_value == "memcpy")
+        vm.memcopy();
+      else if(tok.str_value == "memset")
+        vm.memfill();
+      else if(tok.str_value == "memcmp")
+        vm.memcompare();
+      else if(tok.str_value == "vadd")
+        vm.vadd();
+      else if(tok.str_value == "vsub")
+        vm.vsub();
+      else if(tok.str_value == "vmul")
+        vm.vmul();
+      else if(tok.str_value == "vsum")
+        vm.vsum();
+      else if(tok.str_value == "vcount")
+        vm.vcount();
     }
     else if(tok.type == Token::TOK_UNKNOWN)
     {
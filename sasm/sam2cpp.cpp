@@ -0,0 +1,354 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <set>
+
+#include "../vm.h"
+
+#define SAM2CPP_VER 0.1
+
+using namespace std;
+
+void print_help();
+void translate(const vector<uint>& code, const string& source, ostream& out);
+
+int main(int argc, char** argv)
+{
+  string in_file, out_file;
+
+  for(int i = 1; i < argc; i++)
+  {
+    string arg(argv[i]);
+    if(arg == "--help" || arg == "-h")
+    {
+      print_help();
+      return 0;
+    }
+    else if(arg == "-o" && i + 1 < argc) out_file = argv[++i];
+    else in_file = arg;
+  }
+
+  if(in_file.empty())
+  {
+    print_help();
+    return 1;
+  }
+
+  Sam::VM vm;
+  if(!vm.load(in_file))
+  {
+    cout << "Unable to load " << in_file << "." << endl;
+    return 1;
+  }
+
+  if(out_file.empty())
+  {
+    translate(vm.get_code(), in_file, cout);
+    return 0;
+  }
+
+  ofstream outfile(out_file);
+  if(!outfile)
+  {
+    cout << "Unable to open " << out_file << "." << endl;
+    return 1;
+  }
+  translate(vm.get_code(), in_file, outfile);
+
+  return 0;
+}
+
+/*
+ * Code run by the generated program for the instructions that talk to the outside world. It is copied
+ * from the VM so that the output is byte-for-byte what sasm-run prints, and IN lays the string out in
+ * memory the same way, including the null integer after it.
+ */
+static const char* runtime =
+  "#include <iostream>\n"
+  "#include <string>\n"
+  "#include <vector>\n"
+  "\n"
+  "namespace\n"
+  "{\n"
+  "inline void out(unsigned int uint_chars)\n"
+  "{\n"
+  "  for(int shift = sizeof(unsigned int) * 8 - 8; shift >= 0; shift -= 8)\n"
+  "  {\n"
+  "    char ascii = (char)(uint_chars >> shift);\n"
+  "    if(ascii) std::cout << ascii;\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "inline void outs(const std::vector<unsigned int>& memory, unsigned int addr)\n"
+  "{\n"
+  "  for(unsigned int at = addr; at < memory.size() && memory[at]; at++)\n"
+  "  {\n"
+  "    out(memory[at]);\n"
+  "    if(at + 1 == addr) break;\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "inline void dbg(unsigned int val)\n"
+  "{\n"
+  "  std::cout << std::hex << val << std::dec << std::endl;\n"
+  "}\n"
+  "\n"
+  "inline unsigned int read(const std::vector<unsigned int>& memory, unsigned int addr)\n"
+  "{\n"
+  "  return addr < memory.size() ? memory[addr] : 0;\n"
+  "}\n"
+  "\n"
+  "inline void write(std::vector<unsigned int>& memory, unsigned int addr, unsigned int val)\n"
+  "{\n"
+  "  if(memory.size() <= addr) memory.resize(addr + 1);\n"
+  "  memory[addr] = val;\n"
+  "}\n"
+  "\n"
+  "// Words that would be written as 0 past the end of memory are left out, as they read as 0 anyway\n"
+  "inline void memcopy(std::vector<unsigned int>& memory, unsigned int src, unsigned int dst, unsigned int len)\n"
+  "{\n"
+  "  bool backward = (unsigned int)(dst - src) < len;\n"
+  "  for(unsigned int n = 0; n < len; n++)\n"
+  "  {\n"
+  "    unsigned int i = backward ? len - 1 - n : n;\n"
+  "    unsigned int val = read(memory, src + i);\n"
+  "    if(val || dst + i < memory.size()) write(memory, dst + i, val);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "inline void memfill(std::vector<unsigned int>& memory, unsigned int val, unsigned int dst, unsigned int len)\n"
+  "{\n"
+  "  for(unsigned int i = 0; i < len; i++)\n"
+  "    if(val || dst + i < memory.size()) write(memory, dst + i, val);\n"
+  "}\n"
+  "\n"
+  "inline unsigned int memcompare(const std::vector<unsigned int>& memory, unsigned int a, unsigned int b, unsigned int len)\n"
+  "{\n"
+  "  for(unsigned int i = 0; i < len; i++)\n"
+  "  {\n"
+  "    unsigned int x = read(memory, a + i), y = read(memory, b + i);\n"
+  "    if(x != y) return x < y ? 1 : 2;\n"
+  "  }\n"
+  "  return 0;\n"
+  "}\n"
+  "\n"
+  "// VADD, VSUB and VMUL: op is '+', '-' or '*'\n"
+  "inline void vecop(std::vector<unsigned int>& memory, char op, unsigned int src, unsigned int dst, unsigned int len)\n"
+  "{\n"
+  "  bool backward = src != dst && (unsigned int)(dst - src) < len;\n"
+  "  for(unsigned int n = 0; n < len; n++)\n"
+  "  {\n"
+  "    unsigned int i = backward ? len - 1 - n : n;\n"
+  "    unsigned int a = read(memory, dst + i), b = read(memory, src + i);\n"
+  "    unsigned int val = (op == '+') ? a + b : (op == '-') ? a - b : a * b;\n"
+  "    if(val || dst + i < memory.size()) write(memory, dst + i, val);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "inline unsigned int vsum(const std::vector<unsigned int>& memory, unsigned int addr, unsigned int len)\n"
+  "{\n"
+  "  unsigned int sum = 0;\n"
+  "  for(unsigned int i = 0; i < len; i++) sum += read(memory, addr + i);\n"
+  "  return sum;\n"
+  "}\n"
+  "\n"
+  "inline unsigned int vcount(const std::vector<unsigned int>& memory, unsigned int val, unsigned int addr, unsigned int len)\n"
+  "{\n"
+  "  unsigned int found = 0;\n"
+  "  for(unsigned int i = 0; i < len; i++) found += read(memory, addr + i) == val;\n"
+  "  return found;\n"
+  "}\n"
+  "\n"
+  "inline void in(std::vector<unsigned int>& memory, unsigned int size, unsigned int addr)\n"
+  "{\n"
+  "  std::string str;\n"
+  "  getline(std::cin, str);\n"
+  "\n"
+  "  int shift = sizeof(unsigned int) * 8;\n"
+  "  std::string::iterator it = str.begin();\n"
+  "  std::vector<unsigned int> packed;\n"
+  "  unsigned int int_chars = 0;\n"
+  "  while(shift > 0 && it != str.end())\n"
+  "  {\n"
+  "    shift -= 8;\n"
+  "    int_chars = int_chars | ((unsigned int)(unsigned char)*it << shift);\n"
+  "    it++;\n"
+  "    if(shift == 0 || it == str.end())\n"
+  "    {\n"
+  "      shift = sizeof(unsigned int) * 8;\n"
+  "      packed.push_back(int_chars);\n"
+  "      int_chars = 0;\n"
+  "    }\n"
+  "  }\n"
+  "\n"
+  "  write(memory, addr + size, 0);\n"
+  "  for(unsigned int i = 0; i < size && i < packed.size(); i++) memory[addr + i] = packed[i];\n"
+  "}\n"
+  "}\n"
+  "\n";
+
+/*
+ * Write a C++ program that does what executing 'code' in a fresh VM does. Every instruction reachable
+ * from address 0 becomes a block of C++, in address order, with a label when something jumps to it.
+ * Jumps into the middle of an instruction just decode differently from there, so they get their own
+ * blocks. The stack checks the VM makes on every instruction are only emitted where the depth is not
+ * already known within the straight-line run, and a failed check stops the program like a stack error
+ * stops the VM.
+ */
+void translate(const vector<uint>& code, const string& source, ostream& out)
+{
+  uint size = code.size();
+  auto word = [&](uint addr) { return addr < size ? code[addr] : 0; };
+  auto length = [&](uint addr) { uint op = code[addr]; return 1 + ((op != 0 && op < Sam::OPCODE_END) ? Sam::op_operands[op] : 0); };
+  auto is_jump = [](uint op) { return Sam::is_jump(op); };
+  auto target = [&](uint addr) { return word(addr + 1 + Sam::target_operand(code[addr])); };
+
+  // Find every instruction execution can reach
+  set<uint> reached;
+  vector<uint> work(1, 0);
+  while(!work.empty())
+  {
+    uint addr = work.back();
+    work.pop_back();
+    if(addr >= size || !reached.insert(addr).second) continue;
+
+    uint op = code[addr];
+    if(is_jump(op)) work.push_back(target(addr));
+    if(op != Sam::JMP && op != Sam::HALT) work.push_back(addr + length(addr));
+  }
+
+  // Label the instructions that are jumped to, or that are not emitted right after the one falling into them
+  set<uint> labels;
+  for(auto it = reached.begin(); it != reached.end(); it++)
+  {
+    uint op = code[*it];
+    uint next = *it + length(*it);
+    auto following = it;
+    following++;
+
+    if(is_jump(op) && target(*it) < size) labels.insert(target(*it));
+    if(op != Sam::JMP && op != Sam::HALT && next < size && (following == reached.end() || *following != next))
+      labels.insert(next);
+  }
+
+  out << "// Generated by sam2cpp " << SAM2CPP_VER << " from " << source << ". It behaves like `sasm-run "
+      << source << "`.\n" << runtime;
+  out << "int main()\n"
+      "{\n"
+      "  const unsigned int stack_cap = " << SAM_STACK_SIZE << ";\n"
+      "  unsigned int stack[stack_cap + 1] = { 0 };\n"
+      "  std::vector<unsigned int> memory;\n"
+      "  unsigned int sp = 0, val, addr;\n"
+      "  (void)val; (void)addr;\n\n";
+
+  // What the code emitted so far guarantees about the stack: at least 'known' values on it, and room for 'room' more
+  uint known = 0, room = 0;
+  for(auto it = reached.begin(); it != reached.end(); it++)
+  {
+    uint at = *it;
+    uint op = code[at];
+    uint next = at + length(at);
+    auto following = it;
+    following++;
+
+    if(labels.count(at))
+    {
+      out << "L" << at << ":\n";
+      known = room = 0;
+    }
+
+    out << "  // " << at << ": " << ((op != 0 && op < Sam::OPCODE_END) ? Sam::op_names[op] : "nop") << "\n";
+    if(op != 0 && op < Sam::OPCODE_END)
+    {
+      if(known < Sam::stack_need[op])
+      {
+        out << "  if(sp < " << (uint)Sam::stack_need[op] << ") goto done;\n";
+        known = Sam::stack_need[op];
+      }
+      if(Sam::stack_effect[op] > 0 && room < 1)
+      {
+        out << "  if(sp >= stack_cap) goto done;\n";
+        room = 1;
+      }
+      known += Sam::stack_effect[op];
+      room -= Sam::stack_effect[op];
+    }
+
+    string jump_to = (is_jump(op) && target(at) < size) ? "L" + to_string(target(at)) : "done";
+    switch(op)
+    {
+    case Sam::PUSH: out << "  stack[++sp] = " << word(at + 1) << "u;\n"; break;
+    case Sam::POP: out << "  sp--;\n"; break;
+    case Sam::ADD: out << "  val = stack[sp--]; val += stack[sp]; stack[sp] = val;\n"; break;
+    case Sam::SUB: out << "  val = stack[sp--]; val -= stack[sp]; stack[sp] = val;\n"; break;
+    case Sam::MUL: out << "  val = stack[sp--]; val *= stack[sp]; stack[sp] = val;\n"; break;
+    case Sam::DIV: out << "  val = stack[sp--]; val /= stack[sp]; stack[sp] = val;\n"; break;
+    case Sam::MOD: out << "  val = stack[sp--]; val %= stack[sp]; stack[sp] = val;\n"; break;
+    case Sam::INC: out << "  stack[sp]++;\n"; break;
+    case Sam::DEC: out << "  stack[sp]--;\n"; break;
+    case Sam::JGE: out << "  if(stack[sp] >= " << word(at + 1) << "u) goto " << jump_to << ";\n"; break;
+    case Sam::JGT: out << "  if(stack[sp] > " << word(at + 1) << "u) goto " << jump_to << ";\n"; break;
+    case Sam::JLE: out << "  if(stack[sp] <= " << word(at + 1) << "u) goto " << jump_to << ";\n"; break;
+    case Sam::JLT: out << "  if(stack[sp] < " << word(at + 1) << "u) goto " << jump_to << ";\n"; break;
+    case Sam::JEQ: out << "  if(stack[sp] == " << word(at + 1) << "u) goto " << jump_to << ";\n"; break;
+    case Sam::JMP: out << "  goto " << jump_to << ";\n"; break;
+    case Sam::OUT: out << "  out(stack[sp]);\n"; break;
+    case Sam::IN: out << "  in(memory, " << word(at + 1) << "u, " << word(at + 2) << "u);\n"; break;
+    case Sam::DBG: out << "  dbg(stack[sp]);\n"; break;
+    case Sam::STORE: out << "  write(memory, " << word(at + 1) << "u, stack[sp--]);\n"; break;
+    case Sam::LOAD: out << "  stack[++sp] = read(memory, " << word(at + 1) << "u);\n"; break;
+    case Sam::SSTORE: out << "  addr = stack[sp--]; val = stack[sp--]; write(memory, addr, val);\n"; break;
+    case Sam::SLOAD: out << "  stack[sp] = read(memory, stack[sp]);\n"; break;
+    case Sam::HALT: out << "  goto done;\n"; break;
+    case Sam::OUTS: out << "  outs(memory, stack[sp]);\n"; break;
+    case Sam::MEMCPY: out << "  val = stack[sp--]; addr = stack[sp--]; memcopy(memory, stack[sp--], addr, val);\n"; break;
+    case Sam::MEMSET: out << "  val = stack[sp--]; addr = stack[sp--]; memfill(memory, stack[sp--], addr, val);\n"; break;
+    case Sam::MEMCMP:
+      out << "  val = stack[sp--]; addr = stack[sp--]; stack[sp] = memcompare(memory, stack[sp], addr, val);\n";
+      break;
+    case Sam::VADD: out << "  val = stack[sp--]; addr = stack[sp--]; vecop(memory, '+', stack[sp--], addr, val);\n"; break;
+    case Sam::VSUB: out << "  val = stack[sp--]; addr = stack[sp--]; vecop(memory, '-', stack[sp--], addr, val);\n"; break;
+    case Sam::VMUL: out << "  val = stack[sp--]; addr = stack[sp--]; vecop(memory, '*', stack[sp--], addr, val);\n"; break;
+    case Sam::VSUM: out << "  val = stack[sp--]; stack[sp] = vsum(memory, stack[sp], val);\n"; break;
+    case Sam::VCOUNT:
+      out << "  val = stack[sp--]; addr = stack[sp--]; stack[sp] = vcount(memory, stack[sp], addr, val);\n";
+      break;
+    case Sam::ADDI: out << "  stack[sp] += " << word(at + 1) << "u;\n"; break;
+    case Sam::SUBI: out << "  stack[sp] -= " << word(at + 1) << "u;\n"; break;
+    case Sam::MULI: out << "  stack[sp] *= " << word(at + 1) << "u;\n"; break;
+    case Sam::DIVI: out << "  stack[sp] /= " << word(at + 1) << "u;\n"; break;
+    case Sam::MODI: out << "  stack[sp] %= " << word(at + 1) << "u;\n"; break;
+    case Sam::INCM: out << "  write(memory, " << word(at + 1) << "u, read(memory, " << word(at + 1) << "u) + 1);\n"; break;
+    case Sam::DECM: out << "  write(memory, " << word(at + 1) << "u, read(memory, " << word(at + 1) << "u) - 1);\n"; break;
+    case Sam::JSGE: out << "  sp -= 2; if(stack[sp + 2] >= stack[sp + 1]) goto " << jump_to << ";\n"; break;
+    case Sam::JSGT: out << "  sp -= 2; if(stack[sp + 2] > stack[sp + 1]) goto " << jump_to << ";\n"; break;
+    case Sam::JSLE: out << "  sp -= 2; if(stack[sp + 2] <= stack[sp + 1]) goto " << jump_to << ";\n"; break;
+    case Sam::JSLT: out << "  sp -= 2; if(stack[sp + 2] < stack[sp + 1]) goto " << jump_to << ";\n"; break;
+    case Sam::JSEQ: out << "  sp -= 2; if(stack[sp + 2] == stack[sp + 1]) goto " << jump_to << ";\n"; break;
+    case Sam::JSNE: out << "  sp -= 2; if(stack[sp + 2] != stack[sp + 1]) goto " << jump_to << ";\n"; break;
+    }
+
+    // Continue at the next instruction when it is not the next one emitted
+    if(op == Sam::JMP || op == Sam::HALT) continue;
+    if(next >= size)
+    {
+      if(following != reached.end()) out << "  goto done;\n";
+    }
+    else if(following == reached.end() || *following != next) out << "  goto L" << next << ";\n";
+  }
+
+  out << "\ndone:\n"
+      "  return 0;\n"
+      "}\n";
+}
+
+void print_help()
+{
+  cout << "Sam2cpp " << SAM2CPP_VER << "\n"
+       "Translate a sasm-assembled binary into a standalone C++ program that runs like sasm-run.\n"
+       "Usage: sam2cpp [options] <filename>\n\n"
+       "Options: \n"
+       "-h, --help\t\tPrint this help screen.\n"
+       "-o <file>\t\tWrite the C++ source to <file> instead of standard out.\n";
+}
@@ -0,0 +1,132 @@
+#include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "../vm.h"
+
+#define SASM_STAT_VER 0.1
+
+using namespace std;
+
+void print_help();
+void count_ngrams(const vector<uint>& code, size_t max_len, vector<map<string, size_t> >& counts);
+
+int main(int argc, char** argv)
+{
+  size_t max_len = 3;
+  size_t show = 20;
+  vector<string> files;
+
+  for(int i = 1; i < argc; i++)
+  {
+    string arg(argv[i]);
+    if(arg == "--help" || arg == "-h")
+    {
+      print_help();
+      return 0;
+    }
+    else if(arg == "-n" && i + 1 < argc) max_len = atoi(argv[++i]);
+    else if(arg == "-t" && i + 1 < argc) show = atoi(argv[++i]);
+    else files.push_back(arg);
+  }
+
+  if(files.empty() || max_len < 2)
+  {
+    print_help();
+    return 1;
+  }
+
+  // counts[n] holds the sequences of n instructions
+  vector<map<string, size_t> > counts(max_len + 1);
+
+  for(auto& file : files)
+  {
+    Sam::VM vm;
+    if(!vm.load(file))
+    {
+      cout << "Unable to load " << file << "." << endl;
+      return 1;
+    }
+    count_ngrams(vm.get_code(), max_len, counts);
+  }
+
+  for(size_t n = 2; n <= max_len; n++)
+  {
+    size_t total = 0;
+    vector<pair<size_t, string> > sorted;
+    for(auto& it : counts[n])
+    {
+      total += it.second;
+      sorted.push_back(make_pair(it.second, it.first));
+    }
+    sort(sorted.rbegin(), sorted.rend());
+
+    cout << n << "-instruction sequences (" << total << " total):\n";
+    for(size_t i = 0; i < sorted.size() && i < show; i++)
+      cout << "  " << sorted[i].first << "\t" << (100.0 * sorted[i].first / total) << "%\t" << sorted[i].second << "\n";
+    cout << "\n";
+  }
+
+  return 0;
+}
+
+/*
+ * Count every run of 2 to max_len consecutive instructions. Like the VM's superinstruction fusion,
+ * a run may start at a jump target but never contain one after its first instruction. Runs also
+ * stop after JMP and HALT, and at unknown opcodes, since those never fall through to the next
+ * instruction.
+ */
+void count_ngrams(const vector<uint>& code, size_t max_len, vector<map<string, size_t> >& counts)
+{
+  vector<uint> ops;
+  vector<size_t> addrs;
+  vector<bool> is_target(code.size() + 1, false);
+
+  // Split the code into instructions
+  for(size_t at = 0; at < code.size();)
+  {
+    uint op = code[at];
+    size_t size = 1 + ((op != 0 && op < Sam::OPCODE_END) ? Sam::op_operands[op] : 0);
+    if(at + size > code.size()) break;
+
+    if(Sam::is_jump(op))
+    {
+      uint addr = code[at + 1 + Sam::target_operand(op)];
+      if(addr <= code.size()) is_target[addr] = true;
+    }
+
+    ops.push_back(op);
+    addrs.push_back(at);
+    at += size;
+  }
+
+  for(size_t i = 0; i < ops.size(); i++)
+  {
+    string seq;
+    for(size_t n = 1; n <= max_len && i + n <= ops.size(); n++)
+    {
+      uint op = ops[i + n - 1];
+      if(op == 0 || op >= Sam::OPCODE_END) break;
+      if(n > 1 && is_target[addrs[i + n - 1]]) break;
+
+      if(n > 1) seq += " / ";
+      seq += Sam::op_names[op];
+      if(n > 1) counts[n][seq]++;
+
+      if(op == Sam::JMP || op == Sam::HALT) break;
+    }
+  }
+}
+
+void print_help()
+{
+  cout << "Sasm-stat " << SASM_STAT_VER << "\n"
+       "Count instruction sequences in sasm-assembled binaries, to find candidates for superinstructions.\n"
+       "Usage: sasm-stat [options] <filename>...\n\n"
+       "Options: \n"
+       "-h, --help\t\tPrint this help screen.\n"
+       "-n <len>\t\tCount sequences of up to <len> instructions. Default: 3.\n"
+       "-t <count>\t\tShow the <count> most common sequences of each length. Default: 20.\n";
+}
@@ -17,6 +17,14 @@ int main(int argc, char** argv)
   string out_file = "";
   Sam::VM vm;
   Error_State err;
+  bool optimize = false;
+
+  if(argc > 2 && string(argv[1]) == "-O")   // Optimize, then carry on with the other options
+  {
+    optimize = true;
+    argc--;
+    argv++;
+  }
 
   if(argc < 2 || string(argv[1]) == "--help" || string(argv[1]) == "-h")
   {
@@ -52,6 +60,8 @@ int main(int argc, char** argv)
     return 1;
   }
 
+  if(optimize) vm.optimize();
+
   if(!out_file.empty())            // If they elected to save it as a file.
   {
     vm.save(out_file);
@@ -71,6 +81,7 @@ void print_help()
        "Parse and execute a Sam assembler file to output readable binary.\n\n"
        "Options: \n"
        "-h, --help\t\tPrint this help screen.\n"
+       "-O\t\t\tOptimize the program first. Goes before the other options.\n"
        "-r <file>\t\tAssemble and run the sasm file.\n"
        "-o <file>\t\tAssemble the Sasm file and output a binary file.\n"
        "-b\t\t\tLoad and run a binary file.\n";
@@ -0,0 +1,283 @@
+#ifndef SAM_SCHEDULER_H
+#define SAM_SCHEDULER_H
+
+#include <thread>
+#include <deque>
+#include <set>
+#include <chrono>
+#include "vm.h"
+
+namespace Sam
+{
+
+/*
+ * Runs any number of VMs on a pool of worker threads, one per core by default. Each worker has its own
+ * run queue. It takes VMs from the front of it, runs each one for a time slice with VM::execute(fuel), and
+ * puts it back on the end if it isn't finished. A worker whose queue is empty steals from the back of
+ * another's, and sleeps if there is nothing to steal.
+ *
+ * A VM that stops at an IN for want of input (see QueueSource) is parked, and taken off the queues until
+ * its input source says there is a line, when it goes back on one. A VM that halts or fails is dropped;
+ * its state, output and error_state are as execute() leaves them. VMs still queued or parked when the
+ * scheduler is destroyed are dropped too.
+ *
+ * A VM must not be touched by anything else while the scheduler has it, and VMs in one scheduler should
+ * have their own output sinks: the default, std::cout, is written to from several threads at once.
+ */
+class Scheduler
+{
+public:
+  struct Stats
+  {
+    uint64_t slices;            // Calls to VM::execute(fuel)
+    uint64_t finished;          // VMs that halted or failed
+    uint64_t steals;            // Slices run by a worker that took the VM from another's queue
+    uint64_t parks;             // Times a VM stopped to wait for input
+    double seconds;             // Since the scheduler started
+    double mean_latency;        // Average seconds between a VM being queued and its slice starting
+    double max_latency;
+  };
+
+  explicit Scheduler(unsigned workers = 0, uint64_t slice = 1000);     // 0 workers is one per core
+  ~Scheduler();                 // Stops the workers. VMs not finished are left where they got to.
+
+  void add(std::shared_ptr<VM> vm);             // Run a VM, from wherever its ip is
+  void wait();                                  // Wait until every VM added has halted or failed. Never
+                                                // returns while a VM is parked on input that never comes.
+  Stats stats();
+  unsigned workers();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Task
+  {
+    std::shared_ptr<VM> vm;
+    Clock::time_point queued;
+  };
+
+  struct Queue
+  {
+    std::mutex lock;
+    std::deque<Task*> tasks;
+  };
+
+  // Counted by each worker by itself, and only added up by stats()
+  struct Counters
+  {
+    std::atomic<uint64_t> slices, finished, steals, parks;
+    std::atomic<uint64_t> latency, max_latency;   // Nanoseconds
+  };
+
+  // Everything the workers share. Parked VMs hold on to it, in case they wake after the scheduler is gone.
+  struct State
+  {
+    uint64_t slice;
+    Clock::time_point start;
+    std::vector<Queue> queues;
+    std::vector<Counters> counters;
+    std::atomic<size_t> queued;                 // Tasks on all the queues
+    std::atomic<unsigned> next;                 // Queue for the next VM added or woken, round robin
+    std::atomic<bool> stopping;
+
+    std::mutex idle_lock;                       // Workers with nothing to do sleep on 'idle'
+    std::condition_variable idle;
+    std::mutex done_lock;                       // wait() sleeps on 'done' until 'live' is 0
+    std::condition_variable done;
+    size_t live;                                // VMs added and not finished
+
+    std::mutex parked_lock;                     // Tasks waiting for input, owned here until woken
+    std::set<Task*> parked;
+
+    State(unsigned workers, uint64_t slice)
+      : slice(slice), start(Clock::now()), queues(workers), counters(workers), queued(0), next(0),
+        stopping(false), live(0)
+    {
+      for(Counters& c : counters)
+        c.slices = c.finished = c.steals = c.parks = c.latency = c.max_latency = 0;
+    }
+  };
+
+  static void push(const std::shared_ptr<State>& state, Task* task, unsigned queue);
+  static void wake(const std::shared_ptr<State>& state, Task* task);
+  static Task* take(State& state, unsigned worker, bool& stolen);
+  static void work(std::shared_ptr<State> state, unsigned worker);
+
+  std::shared_ptr<State> state;
+  std::vector<std::thread> threads;
+};
+
+
+Scheduler::Scheduler(unsigned workers, uint64_t slice)
+{
+  if(workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+  state = std::make_shared<State>(workers, std::max<uint64_t>(slice, 1));
+  for(unsigned i = 0; i < workers; i++)
+    threads.push_back(std::thread(&Scheduler::work, state, i));
+}
+
+Scheduler::~Scheduler()
+{
+  {
+    std::lock_guard<std::mutex> parking(state->parked_lock);
+    std::lock_guard<std::mutex> hold(state->idle_lock);
+    state->stopping = true;
+  }
+  state->idle.notify_all();
+  for(std::thread& thread : threads) thread.join();
+
+  for(Queue& queue : state->queues)
+    for(Task* task : queue.tasks) delete task;
+
+  // Parked tasks are only deleted out here: dropping a VM may wait for its input source to stop a wake()
+  std::set<Task*> parked;
+  {
+    std::lock_guard<std::mutex> hold(state->parked_lock);
+    parked.swap(state->parked);
+  }
+  for(Task* task : parked) delete task;
+}
+
+void Scheduler::add(std::shared_ptr<VM> vm)
+{
+  {
+    std::lock_guard<std::mutex> hold(state->done_lock);
+    state->live++;
+  }
+  push(state, new Task{ vm, Clock::now() }, state->next++ % state->queues.size());
+}
+
+void Scheduler::wait()
+{
+  std::unique_lock<std::mutex> hold(state->done_lock);
+  state->done.wait(hold, [this] { return state->live == 0; });
+}
+
+Scheduler::Stats Scheduler::stats()
+{
+  Stats stats = Stats();
+  uint64_t latency = 0, max_latency = 0;
+  for(Counters& c : state->counters)
+  {
+    stats.slices += c.slices;
+    stats.finished += c.finished;
+    stats.steals += c.steals;
+    stats.parks += c.parks;
+    latency += c.latency;
+    max_latency = std::max<uint64_t>(max_latency, c.max_latency);
+  }
+  stats.seconds = std::chrono::duration<double>(Clock::now() - state->start).count();
+  stats.mean_latency = stats.slices ? latency / 1e9 / stats.slices : 0;
+  stats.max_latency = max_latency / 1e9;
+  return stats;
+}
+
+unsigned Scheduler::workers()
+{
+  return state->queues.size();
+}
+
+// Put a task on the end of a queue, and wake a worker to run it
+void Scheduler::push(const std::shared_ptr<State>& state, Task* task, unsigned queue)
+{
+  task->queued = Clock::now();
+  {
+    std::lock_guard<std::mutex> hold(state->queues[queue].lock);
+    state->queues[queue].tasks.push_back(task);
+  }
+  state->queued++;
+  {
+    std::lock_guard<std::mutex> hold(state->idle_lock);          // So a worker about to sleep sees it
+  }
+  state->idle.notify_one();
+}
+
+// A parked task's input is ready: queue it again, unless the scheduler is stopping and it is being freed
+void Scheduler::wake(const std::shared_ptr<State>& state, Task* task)
+{
+  std::lock_guard<std::mutex> hold(state->parked_lock);       // So the task is queued before the workers stop
+  if(state->stopping || !state->parked.erase(task)) return;
+  push(state, task, state->next++ % state->queues.size());
+}
+
+// The next task for 'worker': the front of its own queue, or else the back of another's
+Scheduler::Task* Scheduler::take(State& state, unsigned worker, bool& stolen)
+{
+  const unsigned count = state.queues.size();
+  for(unsigned i = 0; i < count; i++)
+  {
+    Queue& queue = state.queues[(worker + i) % count];
+    std::lock_guard<std::mutex> hold(queue.lock);
+    if(queue.tasks.empty()) continue;
+
+    Task* task;
+    if(i == 0)
+    {
+      task = queue.tasks.front();
+      queue.tasks.pop_front();
+    }
+    else
+    {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+    }
+    state.queued--;
+    stolen = i != 0;
+    return task;
+  }
+  return nullptr;
+}
+
+void Scheduler::work(std::shared_ptr<State> state, unsigned worker)
+{
+  Counters& counters = state->counters[worker];
+  std::weak_ptr<State> weak = state;
+
+  while(!state->stopping)
+  {
+    bool stolen = false;
+    Task* task = take(*state, worker, stolen);
+    if(!task)
+    {
+      std::unique_lock<std::mutex> hold(state->idle_lock);
+      state->idle.wait(hold, [&] { return state->queued > 0 || state->stopping; });
+      continue;
+    }
+
+    uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - task->queued).count();
+    counters.latency += latency;
+    if(latency > counters.max_latency) counters.max_latency = latency;
+    counters.slices++;
+    if(stolen) counters.steals++;
+
+    VM::RunState run = task->vm->execute(state->slice);
+    if(run == VM::RUN_OUT_OF_FUEL)
+    {
+      push(state, task, worker);
+    }
+    else if(run == VM::RUN_WAITING)
+    {
+      counters.parks++;
+      {
+        std::lock_guard<std::mutex> hold(state->parked_lock);
+        state->parked.insert(task);
+      }
+      task->vm->input->when_ready([weak, task]
+      {
+        std::shared_ptr<State> state = weak.lock();
+        if(state) wake(state, task);            // Once the scheduler is gone, so is the task
+      });
+    }
+    else
+    {
+      delete task;
+      counters.finished++;
+      std::lock_guard<std::mutex> hold(state->done_lock);
+      if(--state->live == 0) state->done.notify_all();
+    }
+  }
+}
+
+}
+
+#endif
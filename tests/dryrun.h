@@ -16,6 +16,7 @@
 #define END_TEST() dry_run(argc, argv, suite); dry_run_benchmarks(argc, argv, benchmarks); return 0; }
 #define TEST(desc, func) suite.add_test(desc, func)
 #define BENCHMARK(desc, reps, func)  benchmarks.add_benchmark(desc, reps, func)
+#define BENCHMARK_BYTES(desc, reps, bytes, func)  benchmarks.add_benchmark(desc, reps, func, bytes)
 #define BEFORE(func) suite.before(func)
 #define BEFORE_EACH(func) suite.before_each(func)
 #define AFTER(func) suite.after(func)
@@ -142,18 +143,21 @@ struct test_suite
 // Much like the test_case class, this represents a runnable benchmark.
 // Along with the string description, it also uses a function object (which
 // return void) and an integer reps that describes the number of times to
-// repeat the benchmark.
+// repeat the benchmark. If bytes is set, each repetition processes that many
+// bytes, and the throughput is shown as well.
 struct bench_case
 {
   std::string desc;
   std::function<void ()> test;
   int reps;
+  double bytes;
 
-  bench_case(std::string Desc, int Reps, std::function<void ()> Test)
+  bench_case(std::string Desc, int Reps, std::function<void ()> Test, double Bytes = 0)
   {
     desc = Desc;
     reps = Reps;
     test = Test;
+    bytes = Bytes;
   }
 };
 
@@ -165,9 +169,9 @@ struct bench_suite
 {
   std::vector<bench_case> bench_list;
 
-  void add_benchmark(std::string desc, int reps, std::function<void ()> test)
+  void add_benchmark(std::string desc, int reps, std::function<void ()> test, double bytes = 0)
   {
-    bench_list.push_back(bench_case(desc, reps, test));
+    bench_list.push_back(bench_case(desc, reps, test, bytes));
   }
 };
 
@@ -343,6 +347,7 @@ void dry_run_benchmarks(int argc, char** argv, bench_suite& benchmarks)
 
     if(colors) std::cout << COLOR_GREEN;
     std::cout << elapsed_seconds.count() << "s";
+    if(i.bytes > 0) std::cout << " " << (int)(i.bytes * i.reps / elapsed_seconds.count() / 1e6) << " MB/s";
     if(colors) std::cout << COLOR_OFF;
     std::cout << "\t\t" << i.reps << "\t\t" << i.desc << std::endl;
   }
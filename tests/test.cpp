@@ -1,13 +1,306 @@
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <set>
+#include <thread>
 using namespace std;
 #include "../vm.h"
+#include "../scheduler.h"
 #include "dryrun.h"
 
+// Run a VM and return everything it wrote to stdout
+std::string run_captured(Sam::VM& m)
+{
+  std::ostringstream out;
+  std::streambuf* old = std::cout.rdbuf(out.rdbuf());
+  m.execute();
+  std::cout.rdbuf(old);
+  return out.str();
+}
+
+// Pop everything off a VM's stack, top first. The VM's error_state is left as it was, so stacks of runs that
+// stopped on an error can be compared too.
+std::vector<uint> drain_stack(Sam::VM& m)
+{
+  const Sam::VM::ErrorState error = m.error_state;
+  std::vector<uint> values;
+  while(m.get_stack_depth())
+  {
+    values.push_back(m.peek());
+    m.stack_pop();
+  }
+  m.error_state = error;
+  return values;
+}
+
+/*
+ * Build a random program that always terminates: every jump goes forward, to the start of an instruction,
+ * past the end, or into the operand of a PUSH INC so that the INC runs. Division is always by a value pushed
+ * just before, and SSTORE and the block memory ops only touch small addresses; nothing jumps into the middle of
+ * those sequences.
+ * Programs may still underflow the stack.
+ */
+void random_program(Sam::VM& m, unsigned seed)
+{
+  std::mt19937 rng(seed);
+  std::vector<std::vector<uint> > ins;          // Opcode followed by its operands
+  std::vector<bool> targetable;                 // Whether a jump may land on each instruction
+  auto pick = [&](uint n) { return (uint)(rng() % n); };
+  auto add = [&](std::vector<uint> in, bool can_target)
+  {
+    ins.push_back(in);
+    targetable.push_back(can_target);
+  };
+
+  uint count = 20 + pick(60);
+  for(uint i = 0; i < count; i++)
+  {
+    switch(pick(20))
+    {
+    case 0:
+    case 1: add({ Sam::PUSH, pick(4) ? pick(100) : (uint)rng() }, true); break;
+    case 2: add({ Sam::POP }, true); break;
+    case 3: add({ Sam::ADD + pick(3) }, true); break;                 // ADD, SUB or MUL
+    case 4:
+      add({ Sam::PUSH, 1 + pick(50) }, true);
+      add({ Sam::PUSH, (uint)rng() }, false);
+      add({ pick(2) ? Sam::DIV : Sam::MOD }, false);
+      break;
+    case 5: add({ pick(2) ? Sam::INC : Sam::DEC }, true); break;
+    case 6:
+    case 7: add({ Sam::JGE + pick(5), pick(100), 0 }, true); break;   // Targets are filled in below
+    case 8: add({ Sam::JMP, 0 }, true); break;
+    case 9: add({ pick(2) ? Sam::OUT : Sam::DBG }, true); break;
+    case 10: add({ Sam::STORE, pick(16) }, true); break;
+    case 11: add({ Sam::LOAD, pick(32) }, true); break;
+    case 12:
+      add({ Sam::PUSH, pick(16) }, true);
+      add({ Sam::SSTORE }, false);
+      break;
+    case 13: add({ Sam::SLOAD }, true); break;
+    case 14: if(pick(4) == 0) add({ Sam::HALT }, true); break;
+    case 15: add({ Sam::PUSH, Sam::INC }, true); break;
+    case 16:
+      add({ Sam::PUSH, pick(32) }, true);
+      add({ Sam::PUSH, pick(32) }, false);
+      add({ Sam::PUSH, pick(24) }, false);
+      add({ Sam::MEMCPY + pick(8) }, false);                            // MEMCPY ... VCOUNT
+      break;
+    case 17: add({ Sam::ADDI + pick(5), 1 + pick(50) }, true); break;    // ADDI ... MODI, never by 0
+    case 18: add({ pick(2) ? Sam::INCM : Sam::DECM, pick(16) }, true); break;
+    case 19: add({ Sam::JSGE + pick(6), 0 }, true); break;
+    }
+  }
+
+  std::vector<uint> addrs;
+  std::vector<uint> targets;                    // Addresses a jump may go to
+  uint addr = 0;
+  for(size_t i = 0; i < ins.size(); i++)
+  {
+    addrs.push_back(addr);
+    if(targetable[i]) targets.push_back(addr);
+    if(ins[i][0] == Sam::PUSH && ins[i][1] == Sam::INC) targets.push_back(addr + 1);
+    addr += ins[i].size();
+  }
+  targets.push_back(addr);
+  targets.push_back(addr + 3);
+
+  for(size_t i = 0; i < ins.size(); i++)
+  {
+    uint op = ins[i][0];
+    if(!Sam::is_jump(op)) continue;
+
+    auto first = std::upper_bound(targets.begin(), targets.end(), addrs[i]);
+    ins[i].back() = first[pick(targets.end() - first)];
+  }
+
+  for(auto& in : ins)
+  {
+    switch(in[0])
+    {
+    case Sam::PUSH: m.push(in[1]); break;
+    case Sam::POP: m.pop(); break;
+    case Sam::ADD: m.add(); break;
+    case Sam::SUB: m.sub(); break;
+    case Sam::MUL: m.mul(); break;
+    case Sam::DIV: m.div(); break;
+    case Sam::MOD: m.mod(); break;
+    case Sam::INC: m.inc(); break;
+    case Sam::DEC: m.dec(); break;
+    case Sam::JGE: m.jge(in[1], in[2]); break;
+    case Sam::JGT: m.jgt(in[1], in[2]); break;
+    case Sam::JLE: m.jle(in[1], in[2]); break;
+    case Sam::JLT: m.jlt(in[1], in[2]); break;
+    case Sam::JEQ: m.jeq(in[1], in[2]); break;
+    case Sam::JMP: m.jmp(in[1]); break;
+    case Sam::OUT: m.out(); break;
+    case Sam::DBG: m.dbg(); break;
+    case Sam::STORE: m.store(in[1]); break;
+    case Sam::LOAD: m.load(in[1]); break;
+    case Sam::SSTORE: m.sstore(); break;
+    case Sam::SLOAD: m.sload(); break;
+    case Sam::HALT: m.halt(); break;
+    case Sam::MEMCPY: m.memcopy(); break;
+    case Sam::MEMSET: m.memfill(); break;
+    case Sam::MEMCMP: m.memcompare(); break;
+    case Sam::VADD: m.vadd(); break;
+    case Sam::VSUB: m.vsub(); break;
+    case Sam::VMUL: m.vmul(); break;
+    case Sam::VSUM: m.vsum(); break;
+    case Sam::VCOUNT: m.vcount(); break;
+    case Sam::ADDI: m.addi(in[1]); break;
+    case Sam::SUBI: m.subi(in[1]); break;
+    case Sam::MULI: m.muli(in[1]); break;
+    case Sam::DIVI: m.divi(in[1]); break;
+    case Sam::MODI: m.modi(in[1]); break;
+    case Sam::INCM: m.incm(in[1]); break;
+    case Sam::DECM: m.decm(in[1]); break;
+    case Sam::JSGE: m.jsge(in[1]); break;
+    case Sam::JSGT: m.jsgt(in[1]); break;
+    case Sam::JSLE: m.jsle(in[1]); break;
+    case Sam::JSLT: m.jslt(in[1]); break;
+    case Sam::JSEQ: m.jseq(in[1]); break;
+    case Sam::JSNE: m.jsne(in[1]); break;
+    }
+  }
+}
+
+// Run the same program on ENGINE_SWITCH and 'engine', and compare output, stack, ip and error state
+bool same_as_switch(Sam::VM::Engine engine, std::function<void (Sam::VM&)> build)
+{
+  Sam::VM sw(64);
+  Sam::VM other(64);
+  build(sw);
+  build(other);
+  sw.engine = Sam::VM::ENGINE_SWITCH;
+  other.engine = engine;
+
+  std::string sw_out = run_captured(sw);
+  std::string other_out = run_captured(other);
+  uint sw_ip = sw.get_ip();
+  uint other_ip = other.get_ip();
+  auto sw_error = sw.error_state;
+  auto other_error = other.error_state;
+
+  // Run both again from where they stopped, to check they can resume
+  sw.error_state = other.error_state = Sam::VM::ERR_NONE;
+  sw_out += run_captured(sw);
+  other_out += run_captured(other);
+
+  return sw_out == other_out && sw_ip == other_ip && sw_error == other_error && sw.get_ip() == other.get_ip()
+         && drain_stack(sw) == drain_stack(other);
+}
+
+// Run a program to the end on ENGINE_SWITCH, and on 'engine' with execute(fuel) over and over, and compare
+// output, stack, ip and error state
+bool sliced_same_as_switch(Sam::VM::Engine engine, uint64_t fuel, std::function<void (Sam::VM&)> build)
+{
+  Sam::VM sw(64);
+  Sam::VM sliced(64);
+  build(sw);
+  build(sliced);
+  sw.engine = Sam::VM::ENGINE_SWITCH;
+  sliced.engine = engine;
+
+  std::string sw_out = run_captured(sw);
+  std::ostringstream out;
+  std::streambuf* old = std::cout.rdbuf(out.rdbuf());
+  Sam::VM::RunState state;
+  do state = sliced.execute(fuel); while(state == Sam::VM::RUN_OUT_OF_FUEL);
+  std::cout.rdbuf(old);
+
+  Sam::VM::RunState expect = sw.error_state != Sam::VM::ERR_NONE ? Sam::VM::RUN_ERROR : Sam::VM::RUN_HALTED;
+  return sw_out == out.str() && state == expect && sw.get_ip() == sliced.get_ip() &&
+         sw.error_state == sliced.error_state && drain_stack(sw) == drain_stack(sliced);
+}
+
+// A VM that reads 'lines' lines from 'input', counting to 2000 after each, and outputs 'done' at the end
+std::shared_ptr<Sam::VM> reader_vm(std::shared_ptr<Sam::QueueSource> input, uint lines)
+{
+  auto m = std::make_shared<Sam::VM>();
+  m->input = input;
+  m->output = std::make_shared<Sam::VectorSink>();
+  m->push(lines);             // 0, 1
+  m->store(0);                // 2, 3
+  m->in(4, 100);              // 4 - 6
+  m->push(0);                 // 7, 8
+  m->inc();                   // 9
+  m->jle(2000, 9);            // 10 - 12
+  m->pop();                   // 13
+  m->decm(0);                 // 14, 15
+  m->push(0);                 // 16, 17
+  m->load(0);                 // 18, 19
+  m->jsgt(4);                 // 20, 21: Another line while memory[0] > 0
+  m->push(100);               // 22, 23
+  m->outs();                  // 24:     The last line
+  m->halt();                  // 25
+  return m;
+}
+
+// What a VM wrote to its VectorSink
+std::string sink_text(Sam::VM& m)
+{
+  m.output->flush();
+  const std::vector<char>& bytes = static_cast<Sam::VectorSink&>(*m.output).bytes;
+  return std::string(bytes.begin(), bytes.end());
+}
+
+#ifdef SAM_COMPUTED_GOTO
+// The counting loop below, run by a hand-written direct-threaded interpreter that only has the three
+// instructions it needs and the same stack checks as CheckedPolicy. This is the baseline for how fast
+// execute<CheckedPolicy>() can be.
+uint hand_stripped_loop(uint n)
+{
+  struct Op
+  {
+    const void* handler;
+    uint a;
+    const Op* target;
+  };
+  uint stack[16];
+  uint* const base = stack;
+  uint* const full = stack + 15;
+  uint* top = base;
+  uint tos = 0;
+  Op prog[4] =
+  {
+    { &&push, 0, nullptr },
+    { &&inc, 0, nullptr },
+    { &&jle, n, &prog[1] },
+    { &&halt, 0, nullptr }
+  };
+  const Op* pc = prog;
+
+  goto *pc->handler;
+push:
+  if(top >= full) return 0;
+  *top++ = tos;
+  tos = pc->a;
+  pc++;
+  goto *pc->handler;
+inc:
+  if(top < base + 1) return 0;
+  tos++;
+  pc++;
+  goto *pc->handler;
+jle:
+  if(top < base + 1) return 0;
+  pc = (tos <= pc->a) ? pc->target : pc + 1;
+  goto *pc->handler;
+halt:
+  return tos;
+}
+#endif
+
 BEGIN_TEST();
 
 Sam::VM vm;
 
-BEFORE_EACH([&] { vm.clear(); });
+BEFORE_EACH([&] { vm.clear(); vm.engine = Sam::VM::ENGINE_THREADED; });
 
 TEST("push(5)", [&]
 {
@@ -86,5 +379,2179 @@ TEST("dec()", [&]
 });
 
 
+TEST("in() skips both operands", [&]
+{
+  std::istringstream input("hi\n");
+  std::streambuf* old = std::cin.rdbuf(input.rdbuf());
+  vm.in(1, 1);                // An address of 1 would be executed as PUSH if IN only skipped one operand
+  vm.push(7);
+  vm.execute();
+  std::cin.rdbuf(old);
+  return vm.peek() == 7 && vm.get_ip() == 5;
+});
+
+TEST("ENGINE_THREADED matches ENGINE_SWITCH", [&]
+{
+  // Sum 1..10 into memory location 3 and leave a loop counter on the stack
+  auto build = [](Sam::VM& m)
+  {
+    m.push(0);                // 0, 1
+    m.store(3);               // 2, 3
+    m.push(0);                // 4, 5
+    m.inc();                  // 6
+    m.store(4);               // 7, 8
+    m.load(4);                // 9, 10
+    m.load(3);                // 11, 12
+    m.add();                  // 13
+    m.store(3);               // 14, 15
+    m.load(4);                // 16, 17
+    m.jlt(10, 6);             // 18, 19, 20
+    m.push(3);                // 21, 22
+    m.sload();                // 23
+    m.halt();                 // 24
+    m.push(99);               // 25, 26 (never reached)
+  };
+  Sam::VM sw;
+  Sam::VM th;
+  build(sw);
+  build(th);
+  sw.engine = Sam::VM::ENGINE_SWITCH;
+  th.engine = Sam::VM::ENGINE_THREADED;
+  sw.execute();
+  th.execute();
+  return sw.peek() == 55 && th.peek() == 55 && sw.get_ip() == th.get_ip() && th.get_ip() == 25;
+});
+
+TEST("ENGINE_THREADED skips unknown opcodes", [&]
+{
+  Sam::VM sw;
+  std::ofstream("engine_test.sam", std::ios::binary).write("\x01\x04\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+      "\0\0\0\x01\0\0\0\x05\0\0\0\xff\0\0\0\x08", 34);
+  vm.load("engine_test.sam");
+  sw.load("engine_test.sam");
+  sw.engine = Sam::VM::ENGINE_SWITCH;
+  vm.execute();
+  sw.execute();
+  std::remove("engine_test.sam");
+  return vm.peek() == 6 && sw.peek() == 6;
+});
+
+TEST("stack overflow sets ERR_STACK_OVERFLOW", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    Sam::VM m(2);
+    m.engine = engine;
+    m.push(1);
+    m.push(2);
+    m.push(3);                // 4, 5: One more than the capacity
+    m.execute();
+    passed = passed && m.error_state == Sam::VM::ERR_STACK_OVERFLOW && m.get_ip() == 4 && m.peek() == 2;
+  }
+  return passed;
+});
+
+TEST("stack underflow sets ERR_POP_FAIL", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    Sam::VM m;
+    m.engine = engine;
+    m.push(1);
+    m.add();                  // 2: Needs two values
+    m.execute();
+    passed = passed && m.error_state == Sam::VM::ERR_POP_FAIL && m.get_ip() == 2 && m.peek() == 1;
+  }
+  return passed;
+});
+
+TEST("set_stack_size()", [&]
+{
+  vm.push(1);
+  vm.push(2);
+  vm.execute();
+  return !vm.set_stack_size(1) && vm.set_stack_size(2) && vm.get_stack_size() == 2 && vm.peek() == 2;
+});
+
+TEST("jump into an operand runs it as an opcode", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    Sam::VM m;
+    m.engine = engine;
+    m.push(5);                // 0, 1
+    m.jmp(5);                 // 2, 3
+    m.push(Sam::INC);         // 4, 5: The operand at 5 is executed as INC
+    m.halt();                 // 6
+    m.execute();
+    passed = passed && m.peek() == 6 && m.get_ip() == 7;
+  }
+  return passed;
+});
+
+TEST("jump past the end of code", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    Sam::VM m;
+    m.engine = engine;
+    m.push(1);
+    m.jmp(100);
+    m.execute();
+    passed = passed && m.peek() == 1 && m.get_ip() == 100;
+  }
+  return passed;
+});
+
+TEST("execute() again after adding code", [&]
+{
+  vm.push(1);
+  vm.execute();
+  vm.push(2);
+  vm.add();
+  vm.execute();
+  return vm.peek() == 3 && vm.get_ip() == 5;
+});
+
+TEST("superinstructions match unfused execution", [&]
+{
+  auto build = [](Sam::VM& m)
+  {
+    m.push('h');              // 0 - 3:   PUSH / OUT / POP
+    m.out();
+    m.pop();
+    m.push(0);                // 4, 5
+    m.store(7);               // 6, 7
+    m.load(7);                // 8 - 12:  LOAD / INC / STORE
+    m.inc();
+    m.store(7);
+    m.load(7);                // 13, 14
+    m.jlt(5, 8);              // 15 - 17
+    m.push(7);                // 18, 19
+    m.store(8);               // 20, 21
+    m.load(8);                // 22 - 24: LOAD / SLOAD
+    m.sload();
+    m.push(10);               // 25 - 27: PUSH / ADD
+    m.add();
+    m.halt();
+  };
+  Sam::VM sw;
+  Sam::VM th;
+  build(sw);
+  build(th);
+  sw.engine = Sam::VM::ENGINE_SWITCH;
+  return run_captured(sw) == "h" && run_captured(th) == "h" && sw.peek() == 15 && th.peek() == 15
+         && sw.get_ip() == th.get_ip();
+});
+
+TEST("no fusion across a jump target", [&]
+{
+  vm.push(1);                 // 0, 1
+  vm.push(2);                 // 2, 3
+  vm.add();                   // 4: Jump target, so PUSH 2 / ADD can't be fused
+  vm.jlt(10, 4);              // 5 - 7: Adds the 1 below until the top is 10 or more
+  vm.push(5);
+  vm.jmp(4);                  // Never reached
+  vm.execute();
+  return vm.peek() == 3 && vm.error_state == Sam::VM::ERR_POP_FAIL && vm.get_ip() == 4;
+});
+
+TEST("superinstruction faults like the unfused sequence", [&]
+{
+  vm.push(4);                 // 0, 1
+  vm.add();                   // 2: Only one value on the stack
+  vm.execute();
+  return vm.error_state == Sam::VM::ERR_POP_FAIL && vm.get_ip() == 2 && vm.peek() == 4;
+});
+
+TEST("threaded engine traces like ENGINE_SWITCH", [&]
+{
+  auto build = [](Sam::VM& m)
+  {
+    m.push('a');
+    m.out();
+    m.pop();
+    m.push(1);
+    m.inc();
+    m.jle(3, 4);
+    m.dbg();
+    m.halt();
+  };
+  Sam::VM sw;
+  Sam::VM th;
+  build(sw);
+  build(th);
+  sw.trace = th.trace = true;
+  sw.engine = Sam::VM::ENGINE_SWITCH;
+  std::string expected = run_captured(sw);
+  return expected == run_captured(th) && expected.find("\t: 16\tStack: 97\tOut: a") != std::string::npos;
+});
+
+TEST("profile counts each instruction", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    Sam::VM m;
+    m.engine = engine;
+    m.profile = true;
+    m.push(0);                // 0, 1
+    m.inc();                  // 2
+    m.jlt(5, 2);              // 3 - 5
+    m.halt();                 // 6
+    m.execute();
+    const std::vector<uint64_t>& counts = m.get_profile();
+    passed = passed && counts.size() == 7 && counts[0] == 1 && counts[2] == 5 && counts[3] == 5 && counts[6] == 1;
+  }
+  return passed;
+});
+
+TEST("Unchecked runs read memory past every page written as 0", [&]
+{
+  vm.push(1);
+  vm.store(3);
+  vm.load(0x40000000);
+  vm.push(0x7fffffff);
+  vm.sload();
+  vm.execute<Sam::UncheckedPolicy>();
+  bool policy = vm.peek() == 0 && vm.stack_pop() && vm.peek() == 0;
+
+  Sam::VM off;
+  off.bounds_checks = false;
+  off.load(0xffffffff);
+  off.execute();
+  return policy && off.peek() == 0 && off.error_state == Sam::VM::ERR_NONE;
+});
+
+TEST("execute<UncheckedPolicy>()", [&]
+{
+  vm.push(0);
+  vm.store(0);
+  vm.load(0);
+  vm.inc();
+  vm.store(0);
+  vm.load(0);
+  vm.jlt(10, 4);
+  vm.execute<Sam::UncheckedPolicy>();
+  return vm.peek() == 10 && vm.error_state == Sam::VM::ERR_NONE;
+});
+
+TEST("verify() accepts well-formed code", [&]
+{
+  vm.push(0);                 // 0, 1
+  vm.inc();                   // 2
+  vm.push(7);                 // 3, 4
+  vm.pop();                   // 5
+  vm.jlt(5, 2);               // 6 - 8
+  vm.halt();                  // 9
+  bool small = true;
+  {
+    Sam::VM m(1);
+    m.push(1);
+    m.push(2);
+    small = !m.verify() && m.error_state == Sam::VM::ERR_STACK_OVERFLOW;
+  }
+  return vm.verify() && vm.error_state == Sam::VM::ERR_NONE && small;
+});
+
+TEST("verify() rejects malformed code", [&]
+{
+  Sam::VM mid;                // Jump into the middle of an instruction
+  Sam::VM past;               // Jump past the end
+  mid.push(1);
+  mid.jmp(1);
+  past.push(1);
+  past.jeq(1, 6);
+  Sam::VM loaded;             // Unknown opcode
+  std::ofstream("verify_test.sam", std::ios::binary).write("\x01\x04\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+      "\0\0\0\x01\0\0\0\x05\0\0\0\xff", 30);
+  bool load_failed = loaded.load("verify_test.sam") && !loaded.verify();
+  std::remove("verify_test.sam");
+
+  std::ofstream("verify_test.sam", std::ios::binary).write("\x01\x04\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+      "\0\0\0\x01\0\0\0\x05\0\0\0\x0f", 30);
+  Sam::VM cut;                // JMP without its operand
+  bool cut_failed = cut.load("verify_test.sam") && !cut.verify() && cut.error_state == Sam::VM::ERR_INVALID_INS;
+  std::remove("verify_test.sam");
+
+  return !mid.verify() && mid.error_state == Sam::VM::ERR_INVALID_INS &&
+         !past.verify() && past.error_state == Sam::VM::ERR_INVALID_INS &&
+         load_failed && loaded.error_state == Sam::VM::ERR_INVALID_INS &&
+         loaded.get_code().size() == 3 && cut_failed;
+});
+
+TEST("load() accepts code the verifier rejects, and it runs with every check on", [&]
+{
+  // PUSH 5 / JMP 5 / PUSH INC / OUT / HALT: the JMP lands on the PUSH's operand, an INC
+  std::ofstream("verify_test.sam", std::ios::binary).write("\x01\x04\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+      "\0\0\0\x01\0\0\0\x05\0\0\0\x0f\0\0\0\x05\0\0\0\x01\0\0\0\x08\0\0\0\x10\0\0\0\x17", 50);
+  Sam::VM loaded;
+  loaded.output = std::make_shared<Sam::VectorSink>();
+  bool ok = loaded.load("verify_test.sam") && loaded.error_state == Sam::VM::ERR_NONE;
+  std::remove("verify_test.sam");
+  loaded.execute();
+  return ok && loaded.get_code().size() == 8 && loaded.error_state == Sam::VM::ERR_NONE &&
+         sink_text(loaded) == "\x06";
+});
+
+TEST("verify() rejects unproven stack depths", [&]
+{
+  Sam::VM grows;              // Pushes once per iteration
+  Sam::VM shrinks;            // Pops once per iteration
+  Sam::VM underflow;
+  grows.push(1);
+  grows.jlt(5, 0);
+  shrinks.push(1);
+  shrinks.push(1);
+  shrinks.pop();
+  shrinks.jmp(4);
+  underflow.push(1);
+  underflow.add();
+  return !grows.verify() && grows.error_state == Sam::VM::ERR_STACK_OVERFLOW &&
+         !shrinks.verify() && shrinks.error_state == Sam::VM::ERR_POP_FAIL &&
+         !underflow.verify() && underflow.error_state == Sam::VM::ERR_POP_FAIL;
+});
+
+TEST("save() and load() round trip the code exactly", [&]
+{
+  vm.push(1);
+  vm.jgt(0, 5);
+  vm.halt();
+  vm.save("verify_test.sam");
+  Sam::VM loaded;
+  bool ok = loaded.load("verify_test.sam");
+  std::remove("verify_test.sam");
+  return ok && loaded.get_code() == vm.get_code();
+});
+
+TEST("load() reads version 1 files, and version 2 files in either byte order", [&]
+{
+  // PUSH 0x01020304, in each layout
+  std::ofstream("layout_test.sam", std::ios::binary).write("\x01\x04\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+      "\0\0\0\x01\x01\x02\x03\x04", 26);
+  Sam::VM v1;
+  bool v1_ok = v1.load("layout_test.sam");
+
+  std::string header(64, '\0');
+  header[0] = 2;
+  header[1] = 4;
+  header[4] = 2;              // Two words
+  header[12] = 64;            // At offset 64
+  header[2] = 1;              // Little-endian
+  std::ofstream("layout_test.sam", std::ios::binary) << header << std::string("\x01\0\0\0\x04\x03\x02\x01", 8);
+  Sam::VM little;
+  bool little_ok = little.load("layout_test.sam");
+  header[2] = 2;              // Big-endian
+  std::ofstream("layout_test.sam", std::ios::binary) << header << std::string("\0\0\0\x01\x01\x02\x03\x04", 8);
+  Sam::VM big;
+  bool big_ok = big.load("layout_test.sam");
+  std::remove("layout_test.sam");
+
+  auto expected = (std::vector<uint>({ Sam::PUSH, 0x01020304 }));
+  return v1_ok && v1.get_code() == expected && little_ok && little.get_code() == expected &&
+         big_ok && big.get_code() == expected;
+});
+
+TEST("load() of a truncated file fails with ERR_READ_FAIL", [&]
+{
+  vm.push(1);
+  vm.push(2);
+  vm.save("layout_test.sam");
+  std::ifstream infile("layout_test.sam", std::ios::binary);
+  std::string bytes((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+  infile.close();
+  std::ofstream("layout_test.sam", std::ios::binary) << bytes.substr(0, bytes.size() - 1);
+  Sam::VM cut;
+  bool cut_failed = !cut.load("layout_test.sam") && cut.error_state == Sam::VM::ERR_READ_FAIL;
+  std::ofstream("layout_test.sam", std::ios::binary) << bytes.substr(0, 10);
+  Sam::VM header;
+  bool header_failed = !header.load("layout_test.sam") && header.error_state == Sam::VM::ERR_READ_FAIL;
+  std::remove("layout_test.sam");
+  return bytes.size() == SAM_CODE_OFFSET + 4 * sizeof(uint) && cut_failed && cut.get_code().empty() && header_failed;
+});
+
+TEST("version 1 files of any length are byte-swapped", [&]
+{
+  std::string bytes("\x01\x04\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 18);
+  std::vector<uint> expected;
+  for(uint i = 0; i < 11; i++)              // Not a whole number of SIMD blocks
+  {
+    uint word = 0x01020304 * (i + 1);
+    expected.push_back(word);
+    for(int shift = 24; shift >= 0; shift -= 8) bytes += (char)(word >> shift);
+  }
+  bytes += "\x05\x06";                      // And a partial last word
+  expected.push_back(0x05060000);
+  std::ofstream("layout_test.sam", std::ios::binary) << bytes;
+  Sam::VM v1;
+  v1.load("layout_test.sam");
+  std::remove("layout_test.sam");
+  return v1.get_code() == expected;
+});
+
+#ifdef __linux__
+TEST("save() reports write errors", [&]
+{
+  vm.push(1);
+  return !vm.save("/dev/full") && vm.error_state == Sam::VM::ERR_READ_FAIL;
+});
+#endif
+
+TEST("verified programs still fault when resumed elsewhere", [&]
+{
+  vm.push(1);                 // 0, 1
+  vm.pop();                   // 2
+  vm.halt();                  // 3
+  vm.pop();                   // 4: never reached from 0, so the verifier has no depth for it
+  vm.execute();
+  vm.execute();
+  return vm.error_state == Sam::VM::ERR_POP_FAIL && vm.get_ip() == 4;
+});
+
+TEST("load() of unwritten memory is 0", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    Sam::VM m;
+    m.engine = engine;
+    m.load(1000);
+    m.push(2000);
+    m.sload();
+    m.add();
+    m.execute();
+    passed = passed && m.peek() == 0 && m.error_state == Sam::VM::ERR_NONE;
+  }
+  return passed;
+});
+
+TEST("memory is paged across the whole address space", [&]
+{
+  auto build = [](Sam::VM& m)
+  {
+    auto addrs = (std::vector<uint>({ 0, 4095, 4096, 100000000, 0xFFFFFFFF }));
+    uint val = 1;
+    for(uint addr : addrs)
+    {
+      m.push(val++);
+      m.store(addr);          // STORE
+      m.push(val++);
+      m.push(addr + 1);
+      m.sstore();             // SSTORE to the address after, which wraps to 0 at the top, and is the next
+                              // address (4096) in one case
+    }
+    for(uint addr : addrs)
+    {
+      m.load(addr);
+      m.dbg();
+      m.push(addr + 1);
+      m.sload();
+      m.dbg();
+      m.push(addr + 2);       // Never written, except 1 after the wrap
+      m.sload();
+      m.dbg();
+    }
+    m.in(2, 0xFFFFFFF0);
+    m.load(0xFFFFFFF2);
+    m.dbg();
+  };
+  std::istringstream input("");
+  std::streambuf* old = std::cin.rdbuf(input.rdbuf());
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT })
+    passed = passed && same_as_switch(engine, build);
+
+  Sam::VM m;
+  build(m);
+  std::string out = run_captured(m);
+  std::cin.rdbuf(old);
+  return passed && out == "a\n2\n0\n3\n5\n6\n5\n6\n0\n7\n8\n0\n9\na\n2\n0\n";
+});
+
+TEST("copies of a VM have their own memory", [&]
+{
+  vm.push(1);
+  vm.store(5000);
+  vm.execute();
+  Sam::VM copy = vm;
+  copy.load(5000);
+  copy.inc();
+  copy.store(5000);
+  copy.load(5000);
+  copy.execute();
+  vm.load(5000);
+  vm.execute();
+  return copy.peek() == 2 && vm.peek() == 1;
+});
+
+#ifdef SAM_FLAT_MEMORY
+TEST("flat memory matches paged memory on random programs", [&]
+{
+  for(unsigned seed = 1; seed <= 200; seed++)
+  {
+    Sam::VM paged(64);
+    Sam::VM flat(64);
+    random_program(paged, seed);
+    random_program(flat, seed);
+    if(!flat.use_flat_memory((uint64_t)1 << 32)) return false;
+
+    std::string paged_out = run_captured(paged);
+    std::string flat_out = run_captured(flat);
+    if(paged_out != flat_out || paged.get_ip() != flat.get_ip() || paged.error_state != flat.error_state ||
+       drain_stack(paged) != drain_stack(flat)) return false;
+  }
+  return true;
+});
+
+TEST("flat memory stops out of range accesses on the instruction", [&]
+{
+  Sam::VM store;
+  Sam::VM sload;
+  Sam::VM in;
+  store.use_flat_memory(1024);
+  sload.use_flat_memory(1024);
+  in.use_flat_memory(1024);
+  store.push(7);
+  store.store(1023);
+  store.push(8);
+  store.store(70000);         // 6: past the end, and past the page the end is on
+  sload.push(5000);
+  sload.sload();              // 2
+  in.in(4, 1020);             // Its null integer goes at 1024
+
+  std::istringstream input("abcd");
+  std::streambuf* old = std::cin.rdbuf(input.rdbuf());
+  store.execute();
+  sload.execute();
+  in.execute();
+  std::cin.rdbuf(old);
+
+  bool stopped = store.error_state == Sam::VM::ERR_MEMORY_BOUNDS && store.get_ip() == 6 && store.peek() == 8 &&
+                 sload.error_state == Sam::VM::ERR_MEMORY_BOUNDS && sload.get_ip() == 2 && sload.peek() == 5000 &&
+                 in.error_state == Sam::VM::ERR_MEMORY_BOUNDS && in.get_ip() == 0;
+
+  store.error_state = Sam::VM::ERR_NONE;    // Resuming faults again, in the same place
+  store.execute();
+  bool again = store.error_state == Sam::VM::ERR_MEMORY_BOUNDS && store.get_ip() == 6;
+  store.error_state = Sam::VM::ERR_NONE;
+  return stopped && again && drain_stack(store) == (std::vector<uint>(1, 8));
+});
+
+TEST("flat memory covers the whole address space", [&]
+{
+  vm.use_flat_memory((uint64_t)1 << 32);
+  vm.push(9);
+  vm.store(0xFFFFFFFF);
+  vm.load(0xFFFFFFFF);
+  vm.execute();
+  return vm.error_state == Sam::VM::ERR_NONE && vm.peek() == 9 && !vm.use_flat_memory(((uint64_t)1 << 32) + 1);
+});
+
+TEST("copies of a VM have their own flat memory", [&]
+{
+  vm.use_flat_memory(8192);
+  vm.push(1);
+  vm.store(5000);
+  vm.execute();
+  Sam::VM copy = vm;
+  copy.load(5000);
+  copy.inc();
+  copy.store(5000);
+  copy.load(5000);
+  copy.execute();
+  vm.load(5000);
+  vm.execute();
+  return copy.peek() == 2 && vm.peek() == 1;
+});
+#endif
+
+TEST("OUT and DBG write to the output sink", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT })
+  {
+    Sam::VM m;
+    auto sink = std::make_shared<Sam::VectorSink>();
+    m.output = sink;
+    m.engine = engine;
+    m.push(0x48690000);       // "Hi"
+    m.out();
+    m.push(0xBEEF);
+    m.dbg();
+    m.push(0);
+    m.dbg();
+    m.execute();
+    passed = passed && std::string(sink->bytes.begin(), sink->bytes.end()) == "Hibeef\n0\n";
+  }
+  return passed;
+});
+
+// Counts the blocks an OutputSink hands over
+struct CountingSink : Sam::OutputSink
+{
+  int writes = 0;
+  size_t size = 0;
+  ~CountingSink() { flush(); }
+  void write(const char*, size_t n) { writes++; size += n; }
+};
+
+TEST("output is flushed in blocks, not per value", [&]
+{
+  auto sink = std::make_shared<CountingSink>();
+  vm.output = sink;
+  vm.push(0);                 // 0, 1
+  vm.dbg();                   // 2
+  vm.inc();                   // 3
+  vm.jlt(100000, 2);          // 4 - 6: 100000 DBGs, 530096 bytes: 8 full buffers and a bit
+  vm.execute();
+  return sink->writes == 9 && sink->size == 530096;
+});
+
+#ifdef SAM_POSIX
+TEST("FdSink writes to a file descriptor", [&]
+{
+  int fds[2];
+  if(pipe(fds) != 0) return false;
+  vm.output = std::make_shared<Sam::FdSink>(fds[1]);
+  vm.push(0x6f6b0a00);        // "ok\n"
+  vm.out();
+  vm.execute();
+  char got[8] = { 0 };
+  ssize_t n = read(fds[0], got, sizeof(got));
+  close(fds[0]);
+  close(fds[1]);
+  return n == 3 && std::string(got) == "ok\n";
+});
+#endif
+
+TEST("IN packs lines from the input source into memory", [&]
+{
+  std::string input = "Hello, world!\nxy\n" + std::string(70000, 'a') + "zz";
+  const uint long_at = 3 * Sam::PagedMemory::page_size - 5;      // Across several pages
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT })
+  {
+    Sam::VM m;
+    auto sink = std::make_shared<Sam::VectorSink>();
+    m.output = sink;
+    m.input = std::make_shared<Sam::BufferSource>(input);
+    m.engine = engine;
+    m.in(3, 100);             // Cut short at 3 words
+    m.in(2, 200);
+    m.in(20000, long_at);     // A line longer than the input buffer, with no newline at the end
+    m.in(1, 300);             // At the end of input: just the null
+    for(uint addr : { 100u, 101u, 102u, 103u, 200u, 201u, 202u, long_at, long_at + 17499, long_at + 17500,
+                      long_at + 17501, 300u, 301u })
+    {
+      m.load(addr);
+      m.dbg();
+      m.pop();
+    }
+    m.execute();
+    passed = passed && std::string(sink->bytes.begin(), sink->bytes.end()) ==
+             "48656c6c\n6f2c2077\n6f726c64\n0\n78790000\n0\n0\n61616161\n61616161\n7a7a0000\n0\n0\n0\n";
+  }
+  return passed;
+});
+
+TEST("IN packs bytes over 0x7f as they are", [&]
+{
+  vm.input = std::make_shared<Sam::BufferSource>("\xe9\xe9\xe9\xe9\xe9\xe9\n");
+  vm.output = std::make_shared<Sam::VectorSink>();
+  vm.in(2, 0);
+  vm.load(0);
+  vm.load(1);
+  vm.execute();
+  uint second = vm.peek();
+  vm.stack_pop();
+  return vm.peek() == 0xe9e9e9e9 && second == 0xe9e90000;
+});
+
+#ifdef SAM_POSIX
+TEST("FdSource reads from a file descriptor", [&]
+{
+  int fds[2];
+  if(pipe(fds) != 0) return false;
+  bool written = write(fds[1], "one\ntwo\n", 8) == 8;
+  close(fds[1]);
+  vm.input = std::make_shared<Sam::FdSource>(fds[0]);
+  vm.in(1, 0);
+  vm.in(1, 2);
+  vm.load(0);
+  vm.load(2);
+  vm.execute();
+  close(fds[0]);
+  uint two = vm.peek();
+  vm.stack_pop();
+  return written && two == 0x74776f00 && vm.peek() == 0x6f6e6500;
+});
+#endif
+
+TEST("OUTS writes the string at an address, up to a null word", [&]
+{
+  const uint across = 2 * Sam::PagedMemory::page_size - 3;   // Runs over a page boundary
+  auto build = [=](Sam::VM& m)
+  {
+    m.input = std::make_shared<Sam::BufferSource>("Hello, world!\n" + std::string(40, 'x') + "\n");
+    m.in(10, 100);
+    m.in(10, across);
+    m.push(100);
+    m.outs();
+    m.pop();
+    m.push(across);
+    m.outs();
+    m.push(5000000);          // Never written
+    m.outs();
+    m.push(0x21000000);       // "!"
+    m.out();
+  };
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT })
+    passed = passed && same_as_switch(engine, build);
+
+  Sam::VM m;
+  auto sink = std::make_shared<Sam::VectorSink>();
+  build(m);
+  m.output = sink;
+  m.execute();
+  return passed && std::string(sink->bytes.begin(), sink->bytes.end()) == "Hello, world!" + std::string(40, 'x') + "!" &&
+         m.get_ip() == m.get_code().size();
+});
+
+#ifdef SAM_FLAT_MEMORY
+TEST("OUTS stops at the end of flat memory", [&]
+{
+  auto sink = std::make_shared<Sam::VectorSink>();
+  vm.output = sink;
+  vm.use_flat_memory(1024);
+  vm.push(0x61626364);
+  vm.push(1023);
+  vm.sstore();                // A string with no null word before the end of memory
+  vm.push(1023);
+  vm.outs();                  // 7
+  vm.execute();
+  return vm.error_state == Sam::VM::ERR_MEMORY_BOUNDS && vm.get_ip() == 7 && vm.peek() == 1023;
+});
+#endif
+
+TEST("Block memory and vector instructions match a word by word model", [&]
+{
+  const uint page = Sam::PagedMemory::page_size;
+  std::mt19937 rng(16);
+  std::vector<uint> low(3 * page + 128);        // Memory the ops can reach, which is near 0 and at the very end
+  std::vector<uint> high(16);
+  std::set<uint> touched;
+  std::vector<uint> results;                    // What each MEMCMP, VSUM and VCOUNT pushes
+  auto word = [&](uint addr) -> uint& { return (addr >= 0xfffffff0u) ? high[addr - 0xfffffff0u] : low[addr]; };
+  auto read = [&](uint addr) { return word(addr); };
+  auto near_boundary = [&]() -> uint
+  {
+    if(rng() % 8 == 0) return 0xfffffff0u + rng() % 16;                 // Wraps round to 0
+    return page * (rng() % 3) + page - 24 + rng() % 48;
+  };
+
+  std::vector<std::vector<uint> > ops;
+  for(int i = 0; i < 500; i++)
+  {
+    uint op = Sam::MEMCPY + rng() % 8;
+    uint a = near_boundary();
+    uint b = near_boundary();
+    uint len = rng() % 64;
+    if(op == Sam::MEMSET) a = (rng() % 2) ? 0 : (uint)rng();
+    if(op == Sam::VCOUNT) a = (rng() % 2) ? 0 : read(a);
+    ops.push_back({ a, b, len, op });
+
+    std::vector<uint> from;                     // The words at 'a', as they were before the op
+    bool two_ranges = op != Sam::MEMSET && op != Sam::VSUM && op != Sam::VCOUNT;
+    for(uint n = 0; n < len && two_ranges; n++) from.push_back(read(a + n));
+    for(uint n = 0; n < len; n++) touched.insert(b + n);
+    uint result = 0;
+    for(uint n = 0; n < len; n++)
+    {
+      uint& to = word(b + n);
+      switch(op)
+      {
+      case Sam::MEMCPY: to = from[n]; break;
+      case Sam::MEMSET: to = a; break;
+      case Sam::MEMCMP: if(!result && from[n] != to) result = (from[n] < to) ? 1 : 2; break;
+      case Sam::VADD: to += from[n]; break;
+      case Sam::VSUB: to -= from[n]; break;
+      case Sam::VMUL: to *= from[n]; break;
+      case Sam::VSUM: result += to; break;
+      case Sam::VCOUNT: result += (to == a); break;
+      }
+    }
+    if(op == Sam::MEMCMP || op == Sam::VSUM || op == Sam::VCOUNT) results.push_back(result);
+  }
+
+  std::vector<uint> expected(touched.size());
+  std::transform(touched.rbegin(), touched.rend(), expected.begin(), read);
+  for(auto it = results.rbegin(); it != results.rend(); it++) expected.push_back(*it);
+
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT })
+  {
+    Sam::VM m(1 << 16);
+    m.engine = engine;
+    for(auto& op : ops)
+    {
+      if(op[3] != Sam::VSUM) m.push(op[0]);
+      m.push(op[1]);
+      m.push(op[2]);
+      switch(op[3])
+      {
+      case Sam::MEMCPY: m.memcopy(); break;
+      case Sam::MEMSET: m.memfill(); break;
+      case Sam::MEMCMP: m.memcompare(); break;
+      case Sam::VADD: m.vadd(); break;
+      case Sam::VSUB: m.vsub(); break;
+      case Sam::VMUL: m.vmul(); break;
+      case Sam::VSUM: m.vsum(); break;
+      case Sam::VCOUNT: m.vcount(); break;
+      }
+    }
+    for(uint addr : touched) m.load(addr);
+    m.execute();
+    if(m.error_state != Sam::VM::ERR_NONE || drain_stack(m) != expected) return false;
+  }
+  return true;
+});
+
+TEST("Vector kernels match scalar arithmetic", [&]
+{
+  std::mt19937 rng(17);
+  for(bool avx2 : { false, true })
+  {
+    const Sam::VectorKernels& kernels = Sam::vector_kernels(avx2);
+    for(size_t count = 0; count < 40; count++)
+    {
+      std::vector<uint> words(count + 1);
+      std::vector<uint> with(count + 1);
+      for(size_t i = 0; i <= count; i++)
+      {
+        words[i] = (rng() % 4) ? (uint)rng() : 7;
+        with[i] = (uint)rng();
+      }
+      uint sum = 0;
+      uint sevens = 0;
+      for(size_t i = 1; i <= count; i++)
+      {
+        sum += words[i];
+        sevens += words[i] == 7;
+      }
+      if(kernels.sum(words.data() + 1, count) != sum || kernels.count(words.data() + 1, count, 7) != sevens) return false;
+
+      std::vector<uint> added(words);
+      std::vector<uint> subbed(words);
+      std::vector<uint> mulled(words);
+      kernels.add(added.data() + 1, with.data() + 1, count);       // Unaligned
+      kernels.sub(subbed.data() + 1, with.data() + 1, count);
+      kernels.mul(mulled.data() + 1, with.data() + 1, count);
+      for(size_t i = 1; i <= count; i++)
+        if(added[i] != words[i] + with[i] || subbed[i] != words[i] - with[i] || mulled[i] != words[i] * with[i]) return false;
+    }
+  }
+  return true;
+});
+
+#ifdef SAM_FLAT_MEMORY
+TEST("MEMCPY and MEMSET stop at the end of flat memory", [&]
+{
+  Sam::VM m;
+  m.use_flat_memory(1024);
+  m.push(9);
+  m.push(1000);
+  m.push(24);
+  m.memfill();                // 0 - 6: fills 1000 - 1023
+  m.push(1000);
+  m.push(0);
+  m.push(25);
+  m.memcopy();                // 7 - 13: reads 1024
+  m.execute();
+  bool stopped = m.error_state == Sam::VM::ERR_MEMORY_BOUNDS && m.get_ip() == 13 && m.peek() == 25;
+
+  m.clear();
+  m.use_flat_memory(1024);
+  m.push(9);
+  m.push(0);
+  m.push(1000);
+  m.memfill();                // 0 - 6
+  m.load(999);                // 7, 8
+  m.push(0);
+  m.push(0xffffffff);
+  m.push(2);
+  m.memfill();                // 9 - 15: wraps round to 0 through memory it doesn't have
+  m.execute();
+  if(m.error_state != Sam::VM::ERR_MEMORY_BOUNDS || m.get_ip() != 15) return false;
+  m.error_state = Sam::VM::ERR_NONE;
+  return stopped && drain_stack(m) == std::vector<uint>({ 2, 0xffffffff, 0, 9 });
+});
+#endif
+
+TEST("Immediate arithmetic and INCM/DECM", [&]
+{
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT })
+  {
+    Sam::VM m;
+    m.engine = engine;
+    m.push(7);                // 0, 1
+    m.addi(5);                // 2, 3:   12
+    m.subi(2);                // 4, 5:   10
+    m.muli(3);                // 6, 7:   30
+    m.divi(4);                // 8, 9:   7
+    m.modi(4);                // 10, 11: 3
+    m.push(1);                // 12, 13
+    m.subi(2);                // 14, 15: wraps round to 0xffffffff
+    m.incm(5);                // 16, 17
+    m.incm(5);                // 18, 19
+    m.decm(6);                // 20, 21
+    m.load(5);                // 22, 23
+    m.load(6);                // 24, 25
+    m.execute();
+    if(m.error_state != Sam::VM::ERR_NONE ||
+       drain_stack(m) != std::vector<uint>({ 0xffffffff, 2, 0xffffffff, 3 })) return false;
+  }
+  return true;
+});
+
+// Runs JSGE ... JSNE with 'top' on 'second', and returns the stack: 1 if it jumped, 0 if it didn't, then 9
+auto stack_jump = [](Sam::VM::Engine engine, uint op, uint top, uint second)
+{
+  Sam::VM m;
+  m.engine = engine;
+  m.push(9);                  // 0, 1
+  m.push(second);             // 2, 3
+  m.push(top);                // 4, 5
+  switch(op)                  // 6, 7
+  {
+  case Sam::JSGE: m.jsge(11); break;
+  case Sam::JSGT: m.jsgt(11); break;
+  case Sam::JSLE: m.jsle(11); break;
+  case Sam::JSLT: m.jslt(11); break;
+  case Sam::JSEQ: m.jseq(11); break;
+  case Sam::JSNE: m.jsne(11); break;
+  }
+  m.push(0);                  // 8, 9
+  m.halt();                   // 10
+  m.push(1);                  // 11, 12
+  m.execute();
+  return m.error_state == Sam::VM::ERR_NONE ? drain_stack(m) : std::vector<uint>();
+};
+
+TEST("JSGE ... JSNE compare the top of the stack with the value under it, and pop both", [&]
+{
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT })
+    for(uint top = 1; top <= 3; top++)
+    {
+      const uint second = 2;
+      const uint taken = (top >= second) | (top > second) << 1 | (top <= second) << 2 | (top < second) << 3 |
+                         (top == second) << 4 | (top != second) << 5;  // Bit 0 for JSGE, up to bit 5 for JSNE
+      for(uint op = Sam::JSGE; op <= Sam::JSNE; op++)
+        if(stack_jump(engine, op, top, second) != std::vector<uint>({ taken >> (op - Sam::JSGE) & 1, 9 })) return false;
+    }
+  return true;
+});
+
+// Sums the 'n' (> 0) words at 16, all filled with 2, into memory location 1. With 'immediate', the loop uses
+// ADDI, INCM and JSLT: 10 instructions an iteration instead of 14.
+auto bounded_loop = [](Sam::VM& m, uint n, bool immediate)
+{
+  const uint base = 16;
+  m.push(2);                  // 0, 1
+  m.push(base);               // 2, 3
+  m.push(n);                  // 4, 5
+  m.memfill();                // 6
+  m.push(n);                  // 7, 8
+  m.store(2);                 // 9, 10: memory[0] is the index, [1] the sum and [2] the count
+  m.load(0);                  // 11, 12
+  if(immediate)
+  {
+    m.addi(base);             // 13, 14
+    m.sload();                // 15
+    m.load(1);                // 16, 17
+    m.add();                  // 18
+    m.store(1);               // 19, 20
+    m.incm(0);                // 21, 22
+    m.load(2);                // 23, 24
+    m.load(0);                // 25, 26
+    m.jslt(11);               // 27, 28
+  }
+  else
+  {
+    m.push(base);             // 13, 14
+    m.add();                  // 15
+    m.sload();                // 16
+    m.load(1);                // 17, 18
+    m.add();                  // 19
+    m.store(1);               // 20, 21
+    m.load(0);                // 22, 23
+    m.inc();                  // 24
+    m.store(0);               // 25, 26
+    m.load(0);                // 27, 28
+    m.jge(n, 35);             // 29 - 31
+    m.pop();                  // 32
+    m.jmp(11);                // 33, 34
+    m.pop();                  // 35
+  }
+  m.load(1);
+};
+
+TEST("ADDI, INCM and JSLT cut the instructions a loop runs", [&]
+{
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    uint64_t ran[2] = {};
+    for(bool immediate : { false, true })
+    {
+      Sam::VM m;
+      m.engine = engine;
+      m.profile = true;
+      bounded_loop(m, 1000, immediate);
+      m.execute();
+      if(m.error_state != Sam::VM::ERR_NONE || drain_stack(m) != std::vector<uint>({ 2000 })) return false;
+      for(uint64_t count : m.get_profile()) ran[immediate] += count;
+    }
+    if(ran[1] * 10 > ran[0] * 75) return false;  // At least a quarter fewer
+  }
+  Sam::VM jit;
+  jit.engine = Sam::VM::ENGINE_JIT;
+  bounded_loop(jit, 1000, true);
+  jit.execute();
+  return jit.error_state == Sam::VM::ERR_NONE && jit.peek() == 2000;
+});
+
+TEST("ENGINE_JIT matches ENGINE_SWITCH on random programs", [&]
+{
+  for(unsigned seed = 1; seed <= 500; seed++)
+    if(!same_as_switch(Sam::VM::ENGINE_JIT, [=](Sam::VM& m) { random_program(m, seed); })) return false;
+  return true;
+});
+
+TEST("ENGINE_THREADED matches ENGINE_SWITCH on random programs", [&]
+{
+  for(unsigned seed = 1; seed <= 500; seed++)
+    if(!same_as_switch(Sam::VM::ENGINE_THREADED, [=](Sam::VM& m) { random_program(m, seed); })) return false;
+  return true;
+});
+
+TEST("ENGINE_JIT runs loops", [&]
+{
+  return same_as_switch(Sam::VM::ENGINE_JIT, [](Sam::VM& m)
+  {
+    m.push(0);                // 0, 1:   Sum of i * i for i in 1..20, kept in memory location 3
+    m.store(3);               // 2, 3
+    m.push(0);                // 4, 5
+    m.inc();                  // 6
+    m.store(4);               // 7, 8
+    m.load(4);                // 9, 10
+    m.load(4);                // 11, 12
+    m.mul();                  // 13
+    m.load(3);                // 14, 15
+    m.add();                  // 16
+    m.store(3);               // 17, 18
+    m.load(4);                // 19, 20
+    m.jlt(20, 6);             // 21 - 23
+    m.load(3);                // 24, 25
+    m.dbg();                  // 26
+    m.push(1000000);          // 27, 28: Grow memory from native code
+    m.store(999999);          // 29, 30
+    m.load(999999);           // 31, 32
+    m.dbg();                  // 33
+    m.halt();                 // 34
+  });
+});
+
+TEST("ENGINE_JIT stack faults", [&]
+{
+  bool overflow = same_as_switch(Sam::VM::ENGINE_JIT, [](Sam::VM& m)
+  {
+    m.push(0);
+    m.push(1);
+    m.jmp(0);                 // Push until the 64 value stack is full
+  });
+  bool underflow = same_as_switch(Sam::VM::ENGINE_JIT, [](Sam::VM& m)
+  {
+    m.push(5);
+    m.dec();
+    m.jgt(0, 2);
+    m.sub();                  // Only one value on the stack
+  });
+  return overflow && underflow;
+});
+
+TEST("ENGINE_REGISTER matches ENGINE_SWITCH on random programs", [&]
+{
+  for(unsigned seed = 1; seed <= 500; seed++)
+    if(!same_as_switch(Sam::VM::ENGINE_REGISTER, [=](Sam::VM& m) { random_program(m, seed); })) return false;
+  return true;
+});
+
+TEST("ENGINE_REGISTER runs loops", [&]
+{
+  bool squares = same_as_switch(Sam::VM::ENGINE_REGISTER, [](Sam::VM& m)
+  {
+    m.push(0);                // 0, 1:   Sum of i * i for i in 1..20, kept in memory location 3
+    m.store(3);               // 2, 3
+    m.push(0);                // 4, 5
+    m.inc();                  // 6
+    m.store(4);               // 7, 8
+    m.load(4);                // 9, 10:  The second load comes from a register
+    m.load(4);                // 11, 12
+    m.mul();                  // 13
+    m.load(3);                // 14, 15
+    m.add();                  // 16
+    m.store(3);               // 17, 18
+    m.load(4);                // 19, 20
+    m.jlt(20, 6);             // 21 - 23
+    m.load(3);                // 24, 25
+    m.dbg();                  // 26
+    m.push(7);                // 27, 28
+    m.push(3);                // 29, 30: Stored through a constant address
+    m.sstore();               // 31
+    m.load(3);                // 32, 33
+    m.dbg();                  // 34
+    m.halt();                 // 35
+  });
+  bool summed = same_as_switch(Sam::VM::ENGINE_REGISTER, [&](Sam::VM& m) { bounded_loop(m, 30, false); });
+  bool immediate = same_as_switch(Sam::VM::ENGINE_REGISTER, [&](Sam::VM& m) { bounded_loop(m, 30, true); });
+  return squares && summed && immediate;
+});
+
+TEST("ENGINE_REGISTER stack faults", [&]
+{
+  bool overflow = same_as_switch(Sam::VM::ENGINE_REGISTER, [](Sam::VM& m)
+  {
+    m.push(0);
+    m.push(1);
+    m.jmp(0);                 // Push until the 64 value stack is full
+  });
+  bool underflow = same_as_switch(Sam::VM::ENGINE_REGISTER, [](Sam::VM& m)
+  {
+    m.push('a');
+    m.out();                  // Output before the fault, in the same block
+    m.pop();
+    m.push(5);
+    m.dec();
+    m.jgt(0, 5);
+    m.add();                  // Only one value on the stack
+  });
+  return overflow && underflow;
+});
+
+TEST("ENGINE_REGISTER leaves the stack and ip as a stack machine would", [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_REGISTER;
+  m.push(6);                  // 0, 1
+  m.push(7);                  // 2, 3
+  m.mul();                    // 4:      Folded into a constant
+  m.load(10);                 // 5, 6
+  m.addi(3);                  // 7, 8
+  m.store(11);                // 9, 10:  Only written to memory when the block ends
+  m.halt();                   // 11
+  m.load(11);                 // 12, 13
+  m.execute();
+  if(m.get_ip() != 12 || m.peek() != 42) return false;
+  m.execute();
+  return m.get_ip() == 14 && drain_stack(m) == std::vector<uint>({ 3, 42 });
+});
+
+TEST("optimize() keeps what random programs do", [&]
+{
+  int shrunk = 0;
+  for(unsigned seed = 1; seed <= 500; seed++)
+  {
+    Sam::VM plain(64);
+    Sam::VM optimized(64);
+    random_program(plain, seed);
+    random_program(optimized, seed);
+    size_t before = optimized.get_code().size();
+    if(optimized.optimize() && optimized.get_code().size() < before) shrunk++;
+
+    plain.engine = optimized.engine = Sam::VM::ENGINE_SWITCH;
+    if(run_captured(plain) != run_captured(optimized) || plain.error_state != optimized.error_state) return false;
+    if(drain_stack(plain) != drain_stack(optimized)) return false;
+  }
+  return shrunk > 0;
+});
+
+TEST("optimize() folds constants and drops dead code", [&]
+{
+  Sam::VM m;
+  m.push(6);                  // 0, 1
+  m.push(7);                  // 2, 3
+  m.mul();                    // 4:      PUSH 42
+  m.push(1);                  // 5, 6
+  m.pop();                    // 7:      Dropped
+  m.jmp(11);                  // 8, 9:   Only jumps over dead code
+  m.halt();                   // 10
+  m.dbg();                    // 11
+  m.inc();                    // 12:     Not folded, DBG is in between
+  m.halt();                   // 13
+  m.push(9);                  // 14, 15: Never reached
+  if(!m.optimize()) return false;
+  m.output = std::make_shared<Sam::VectorSink>();
+  m.execute();
+  return m.get_code() == std::vector<uint>({ Sam::PUSH, 42, Sam::DBG, Sam::INC, Sam::HALT }) && m.peek() == 43;
+});
+
+TEST("optimize() threads jumps and rewrites their addresses", [&]
+{
+  Sam::VM m;
+  m.push(0);                  // 0, 1
+  m.inc();                    // 2:      A jump target, so it isn't folded into the PUSH
+  m.jlt(10, 8);               // 3 - 5:  Goes to a JMP, so it goes to 2 instead
+  m.halt();                   // 6
+  m.halt();                   // 7
+  m.jmp(2);                   // 8, 9:   No longer reached
+  if(!m.optimize()) return false;
+  m.execute();
+  bool threaded = m.get_code() == std::vector<uint>({ Sam::PUSH, 0, Sam::INC, Sam::JLT, 10, 2, Sam::HALT }) && m.peek() == 10;
+
+  Sam::VM grows;              // The stack isn't proven, so PUSH / POP can't go: it keeps the overflow
+  grows.push(5);
+  grows.push(1);
+  grows.pop();
+  grows.jmp(0);
+  std::vector<uint> kept = grows.get_code();
+  bool unproven = grows.optimize() && grows.get_code() == kept;
+
+  Sam::VM bad;                // Jumps into an operand
+  bad.push(Sam::HALT);
+  bad.jmp(1);
+  kept = bad.get_code();
+  bool malformed = !bad.optimize() && bad.get_code() == kept;
+  return threaded && unproven && malformed;
+});
+
+TEST("VMs share one Program, and copy it before changing it", [&]
+{
+  Sam::VM first;
+  bounded_loop(first, 30, true);
+  auto program = first.get_program();
+  Sam::VM second;
+  second.push(1);             // Replaced, not added to
+  second.set_program(program);
+  bool shared = second.get_code().data() == first.get_code().data();
+  first.execute();
+  second.execute();
+  bool ran = first.peek() == 60 && second.peek() == 60;
+
+  first.halt();               // Gets first a copy of its own
+  bool copied = first.get_code().data() != program->get_code().data() &&
+                first.get_code().size() == program->get_code().size() + 1 &&
+                second.get_code().data() == program->get_code().data();
+  return shared && ran && copied;
+});
+
+TEST("VMs on several threads run one Program", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT, Sam::VM::ENGINE_REGISTER })
+  {
+    Sam::VM builder;
+    bounded_loop(builder, 1000, true);
+    builder.dbg();
+    std::shared_ptr<const Sam::Program> program = builder.get_program();
+    std::vector<std::string> outputs(8);
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < outputs.size(); i++)
+    {
+      threads.push_back(std::thread([&outputs, program, engine](size_t at)
+      {
+        Sam::VM m;
+        auto sink = std::make_shared<Sam::VectorSink>();
+        m.output = sink;
+        m.engine = engine;
+        m.set_program(program);
+        m.execute();
+        outputs[at] = std::string(sink->bytes.begin(), sink->bytes.end());
+      }, i));
+    }
+    for(auto& thread : threads) thread.join();
+    passed = passed && std::count(outputs.begin(), outputs.end(), "7d0\n") == (long)outputs.size();
+  }
+  return passed;
+});
+
+TEST("execute(fuel) stops and carries on like execute() on random programs", [&]
+{
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT, Sam::VM::ENGINE_REGISTER })
+    for(unsigned seed = 1; seed <= 200; seed++)
+      if(!sliced_same_as_switch(engine, 1 + seed % 3, [=](Sam::VM& m) { random_program(m, seed); })) return false;
+  return sliced_same_as_switch(Sam::VM::ENGINE_THREADED, 7, [&](Sam::VM& m) { bounded_loop(m, 100, true); });
+});
+
+TEST("execute(fuel) stops a loop that never ends", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT, Sam::VM::ENGINE_REGISTER })
+  {
+    Sam::VM m;
+    m.engine = engine;
+    m.push(0);                // 0, 1
+    m.inc();                  // 2
+    m.jmp(2);                 // 3, 4: One unit of fuel each time round
+    bool stopped = m.execute(1000) == Sam::VM::RUN_OUT_OF_FUEL && m.get_ip() == 2 && m.peek() == 1000;
+    bool resumed = m.execute(1) == Sam::VM::RUN_OUT_OF_FUEL && m.peek() == 1001;
+    bool empty = m.execute(0) == Sam::VM::RUN_OUT_OF_FUEL && m.peek() == 1001;
+    passed = passed && stopped && resumed && empty;
+  }
+#ifdef SAM_FLAT_MEMORY
+  Sam::VM flat;
+  flat.use_flat_memory(1024);
+  flat.push(0);
+  flat.inc();
+  flat.jmp(2);
+  passed = passed && flat.execute(50) == Sam::VM::RUN_OUT_OF_FUEL && flat.peek() == 50;
+#endif
+  return passed;
+});
+
+TEST("execute(fuel) says why it stopped", [&]
+{
+  Sam::VM halts;
+  halts.push(1);              // 0, 1
+  halts.jmp(5);               // 2, 3
+  halts.halt();               // 4
+  halts.dec();                // 5
+  halts.jgt(0, 5);            // 6 - 8: Runs out here, with HALT still to run
+  halts.halt();               // 9
+  bool out = halts.execute(2) == Sam::VM::RUN_OUT_OF_FUEL && halts.get_ip() == 9;
+  bool halted = halts.execute(5) == Sam::VM::RUN_HALTED && halts.get_ip() == 10;
+
+  Sam::VM fails;
+  fails.add();
+  bool failed = fails.execute(100) == Sam::VM::RUN_ERROR && fails.error_state == Sam::VM::ERR_POP_FAIL;
+
+  Sam::VM flagged;            // An error from before the call isn't the run's
+  flagged.output = std::make_shared<Sam::VectorSink>();
+  flagged.push(5);
+  flagged.jmp(5);             // Into the PUSH's operand, an INC
+  flagged.push(Sam::INC);
+  flagged.out();
+  flagged.halt();
+  bool unverified = !flagged.verify();
+  return out && halted && failed && unverified && flagged.execute(100) == Sam::VM::RUN_HALTED &&
+         flagged.error_state == Sam::VM::ERR_INVALID_INS && sink_text(flagged) == "\x06";
+});
+
+TEST("execute(fuel) stops at an IN until a QueueSource has a line", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED })
+  {
+    auto input = std::make_shared<Sam::QueueSource>();
+    auto m = reader_vm(input, 2);
+    m->engine = engine;
+    bool woken = false;
+    passed = passed && m->execute(100) == Sam::VM::RUN_WAITING && m->get_ip() == 4;
+    input->when_ready([&] { woken = true; });
+    input->push("first");
+    passed = passed && woken && m->execute(10000) == Sam::VM::RUN_WAITING && m->get_ip() == 4;
+    input->push("second");
+    passed = passed && m->execute(10000) == Sam::VM::RUN_HALTED && sink_text(*m) == "second";
+  }
+  return passed;
+});
+
+TEST("run() stops at an IN until supply() gives it a line, on every engine", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT, Sam::VM::ENGINE_REGISTER })
+  {
+    auto m = reader_vm(std::make_shared<Sam::QueueSource>(), 3);
+    m->engine = engine;
+    passed = passed && m->run() == Sam::VM::RUN_WAITING && m->get_ip() == 4;
+    m->supply("one");
+    passed = passed && m->run() == Sam::VM::RUN_WAITING && m->get_ip() == 4;
+    m->supply("two");
+    m->supply("three");
+    passed = passed && m->run() == Sam::VM::RUN_HALTED && sink_text(*m) == "three";
+  }
+  return passed;
+});
+
+#ifdef SAM_POSIX
+TEST("run() waits at an IN until an FdSource has a whole line", [&]
+{
+  int fds[2];
+  if(pipe(fds) != 0) return false;
+  auto m = reader_vm(std::make_shared<Sam::QueueSource>(), 2);
+  m->input = std::make_shared<Sam::FdSource>(fds[0]);
+  bool passed = m->run() == Sam::VM::RUN_WAITING;
+  passed = passed && write(fds[1], "par", 3) == 3 && m->run() == Sam::VM::RUN_WAITING && m->get_ip() == 4;
+  passed = passed && write(fds[1], "t\nla", 4) == 4 && m->run() == Sam::VM::RUN_WAITING;
+  passed = passed && write(fds[1], "st", 2) == 2;
+  close(fds[1]);                // The end of input ends the last line
+  passed = passed && m->run() == Sam::VM::RUN_HALTED && sink_text(*m) == "last";
+  close(fds[0]);
+  return passed;
+});
+#endif
+
+// A VM that sets memory[5] to 7 and memory[100000] to 1, pushes 9, and waits at the IN at 10 for a request.
+// The request's first word is added to memory[5], which is output.
+auto request_vm = []
+{
+  auto m = std::make_shared<Sam::VM>();
+  m->input = std::make_shared<Sam::QueueSource>();
+  m->output = std::make_shared<Sam::VectorSink>();
+  m->push(7);                 // 0, 1
+  m->store(5);                // 2, 3
+  m->push(1);                 // 4, 5
+  m->store(100000);           // 6, 7
+  m->push(9);                 // 8, 9
+  m->in(1, 0);                // 10 - 12
+  m->load(0);
+  m->load(5);
+  m->add();
+  m->store(5);
+  m->load(5);
+  m->dbg();
+  m->halt();
+  return m;
+};
+
+TEST("A fork's memory writes don't reach its parent, or the parent's its fork", [&]
+{
+  bool passed = true;
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT, Sam::VM::ENGINE_REGISTER })
+  {
+    auto parent = request_vm();
+    parent->engine = engine;
+    passed = passed && parent->run() == Sam::VM::RUN_WAITING;
+    Sam::VM child = parent->fork();
+    child.input = std::make_shared<Sam::QueueSource>();
+    child.output = std::make_shared<Sam::VectorSink>();
+    child.supply("A");
+    passed = passed && child.run() == Sam::VM::RUN_HALTED && sink_text(child) == "41000007\n";
+    parent->supply("B");
+    passed = passed && parent->run() == Sam::VM::RUN_HALTED && sink_text(*parent) == "42000007\n";
+
+    Sam::VM grandchild = child.fork();      // Forked after both wrote to the shared page
+    grandchild.output = std::make_shared<Sam::VectorSink>();
+    grandchild.dbg();
+    grandchild.execute();
+    passed = passed && sink_text(grandchild) == "41000007\n" && child.peek() == 0x41000007;
+  }
+  return passed;
+});
+
+TEST("restore() goes back to a snapshot, on the VM it was taken from or another", [&]
+{
+  bool passed = true;
+  auto m = request_vm();
+  passed = passed && m->run() == Sam::VM::RUN_WAITING;
+  Sam::VM::Snapshot saved = m->snapshot();
+  m->supply("A");
+  passed = passed && m->run() == Sam::VM::RUN_HALTED && sink_text(*m) == "41000007\n";
+  m->restore(saved);
+  passed = passed && m->get_ip() == 10 && saved.get_ip() == 10 && m->peek() == 9;
+  m->supply("B");
+  passed = passed && m->run() == Sam::VM::RUN_HALTED && sink_text(*m) == "41000007\n42000007\n";
+
+  for(auto engine : { Sam::VM::ENGINE_SWITCH, Sam::VM::ENGINE_THREADED, Sam::VM::ENGINE_JIT, Sam::VM::ENGINE_REGISTER })
+  {
+    Sam::VM other(16);
+    other.push(1);
+    other.store(5);
+    other.execute();
+    other.engine = engine;
+    other.output = std::make_shared<Sam::VectorSink>();
+    other.restore(saved);
+    other.supply("C");
+    passed = passed && other.get_stack_size() == SAM_STACK_SIZE && other.run() == Sam::VM::RUN_HALTED &&
+             sink_text(other) == "43000007\n";
+  }
+  return passed;
+});
+
+TEST("VMs on several threads restore one snapshot", [&]
+{
+  auto m = request_vm();
+  m->run();
+  Sam::VM::Snapshot saved = m->snapshot();
+  std::vector<std::string> outputs(8);
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < outputs.size(); i++)
+    threads.push_back(std::thread([&, i]
+    {
+      Sam::VM other;
+      other.output = std::make_shared<Sam::VectorSink>();
+      other.restore(saved);
+      other.supply("A");
+      other.run();
+      outputs[i] = sink_text(other);
+    }));
+  for(std::thread& thread : threads) thread.join();
+  return std::count(outputs.begin(), outputs.end(), "41000007\n") == (long)outputs.size();
+});
+
+TEST("Scheduler runs VMs to the end", [&]
+{
+  std::vector<std::shared_ptr<Sam::VM> > vms;
+  Sam::Scheduler scheduler(4, 10);
+  for(uint i = 0; i < 50; i++)
+  {
+    auto m = std::make_shared<Sam::VM>();
+    m->output = std::make_shared<Sam::VectorSink>();
+    m->engine = i % 2 ? Sam::VM::ENGINE_SWITCH : Sam::VM::ENGINE_THREADED;
+    bounded_loop(*m, 10 + i, true);
+    m->dbg();
+    vms.push_back(m);
+    scheduler.add(m);
+  }
+  scheduler.wait();
+
+  for(uint i = 0; i < vms.size(); i++)
+  {
+    std::ostringstream expect;
+    expect << std::hex << 2 * (10 + i) << "\n";
+    if(sink_text(*vms[i]) != expect.str()) return false;
+  }
+  Sam::Scheduler::Stats stats = scheduler.stats();
+  return scheduler.workers() == 4 && stats.finished == 50 && stats.slices > 50 && stats.max_latency >= stats.mean_latency;
+});
+
+TEST("Scheduler parks VMs waiting for input, and wakes them when it comes", [&]
+{
+  std::vector<std::shared_ptr<Sam::QueueSource> > inputs;
+  std::vector<std::shared_ptr<Sam::VM> > vms;
+  Sam::Scheduler scheduler(2);
+  for(int i = 0; i < 10; i++)
+  {
+    inputs.push_back(std::make_shared<Sam::QueueSource>());
+    vms.push_back(reader_vm(inputs.back(), 3));
+    scheduler.add(vms.back());
+  }
+
+  for(int round = 0; round < 3; round++)
+    for(size_t i = 0; i < inputs.size(); i++)
+      inputs[i]->push("line " + std::to_string(round * 10 + i));
+  scheduler.wait();
+
+  for(size_t i = 0; i < vms.size(); i++)
+    if(sink_text(*vms[i]) != "line " + std::to_string(20 + i)) return false;
+  return scheduler.stats().finished == 10;
+});
+
+TEST("Scheduler frees VMs still parked when it is destroyed", [&]
+{
+  auto input = std::make_shared<Sam::QueueSource>();
+  std::weak_ptr<Sam::VM> parked;
+  {
+    Sam::Scheduler scheduler(2);
+    auto m = reader_vm(input, 1);
+    parked = m;
+    scheduler.add(m);
+    while(scheduler.stats().parks == 0) std::this_thread::yield();
+  }
+  bool freed = parked.expired();
+  input->push("late");        // Wakes nothing
+  return freed;
+});
+
+#ifdef SAM_POSIX
+TEST("Scheduler parks a VM reading an FdSource until its pipe has a line", [&]
+{
+  int fds[2];
+  if(pipe(fds) != 0) return false;
+  auto m = reader_vm(std::make_shared<Sam::QueueSource>(), 1);
+  m->input = std::make_shared<Sam::FdSource>(fds[0]);
+  bool passed;
+  {
+    Sam::Scheduler scheduler(2);
+    scheduler.add(m);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));   // Nothing written: it stays parked
+    Sam::Scheduler::Stats idle = scheduler.stats();
+    passed = idle.slices == 1 && idle.parks == 1 && write(fds[1], "line\n", 5) == 5;
+    scheduler.wait();
+    passed = passed && sink_text(*m) == "line" && scheduler.stats().finished == 1;
+  }
+
+  std::weak_ptr<Sam::VM> parked;
+  {
+    Sam::Scheduler scheduler(1);
+    auto waiting = reader_vm(std::make_shared<Sam::QueueSource>(), 1);
+    waiting->input = std::make_shared<Sam::FdSource>(fds[0]);
+    parked = waiting;
+    scheduler.add(waiting);
+    while(scheduler.stats().parks == 0) std::this_thread::yield();
+  }
+  passed = passed && parked.expired();
+
+  bool woken = false;         // A source destroyed while it waits stops waiting, without calling 'wake'
+  {
+    Sam::FdSource idle(fds[0]);
+    idle.when_ready([&] { woken = true; });
+  }
+  close(fds[0]);
+  close(fds[1]);
+  return passed && !woken;
+});
+#endif
+
+// A counting loop: PUSH 0 / INC / JLE n, 2 / HALT. Each iteration dispatches two instructions.
+auto counting_loop = [](Sam::VM& m, uint n)
+{
+  m.push(0);
+  m.inc();
+  m.jle(n, 2);
+  m.halt();
+};
+
+BENCHMARK("ENGINE_SWITCH: 1M iteration loop (2M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_SWITCH;
+  counting_loop(m, 1000000);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: 1M iteration loop (2M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_THREADED;
+  counting_loop(m, 1000000);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: 1M iteration loop in slices of execute(10000)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_THREADED;
+  counting_loop(m, 1000000);
+  while(m.execute(10000) == Sam::VM::RUN_OUT_OF_FUEL);
+});
+
+BENCHMARK("ENGINE_SWITCH: 1M iteration loop in slices of execute(10000)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_SWITCH;
+  counting_loop(m, 1000000);
+  while(m.execute(10000) == Sam::VM::RUN_OUT_OF_FUEL);
+});
+
+BENCHMARK("execute<CheckedPolicy>: 1M iteration loop (2M instructions)", 20, [&]
+{
+  Sam::VM m;
+  counting_loop(m, 1000000);
+  m.execute<Sam::CheckedPolicy>();
+});
+
+BENCHMARK("execute<UncheckedPolicy>: 1M iteration loop (2M instructions)", 20, [&]
+{
+  Sam::VM m;
+  counting_loop(m, 1000000);
+  m.execute<Sam::UncheckedPolicy>();
+});
+
+#ifdef SAM_COMPUTED_GOTO
+BENCHMARK("Hand-stripped interpreter: 1M iteration loop (2M instructions)", 20, [&]
+{
+  volatile uint result = hand_stripped_loop(1000000);
+  (void)result;
+});
+#endif
+
+BENCHMARK("ENGINE_JIT: 1M iteration loop (2M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_JIT;
+  counting_loop(m, 1000000);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_REGISTER: 1M iteration loop (2M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_REGISTER;
+  counting_loop(m, 1000000);
+  m.execute();
+});
+
+// A counter kept in program memory, incremented with LOAD 0 / INC / STORE 0. Seven instructions per iteration.
+auto memory_loop = [](Sam::VM& m, uint n)
+{
+  m.push(0);                  // 0, 1
+  m.store(0);                 // 2, 3
+  m.load(0);                  // 4, 5
+  m.inc();                    // 6
+  m.store(0);                 // 7, 8
+  m.load(0);                  // 9, 10
+  m.jge(n, 17);               // 11 - 13
+  m.pop();                    // 14
+  m.jmp(4);                   // 15, 16
+  m.halt();                   // 17
+};
+
+BENCHMARK("ENGINE_SWITCH: 1M iteration memory counter (7M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_SWITCH;
+  memory_loop(m, 1000000);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: 1M iteration memory counter (7M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_THREADED;
+  memory_loop(m, 1000000);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_JIT: 1M iteration memory counter (7M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_JIT;
+  memory_loop(m, 1000000);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_REGISTER: 1M iteration memory counter (7M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_REGISTER;
+  memory_loop(m, 1000000);
+  m.execute();
+});
+
+#ifdef SAM_FLAT_MEMORY
+BENCHMARK("ENGINE_SWITCH on flat memory: 1M iteration memory counter (7M instructions)", 20, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_SWITCH;
+  m.use_flat_memory(1024);
+  memory_loop(m, 1000000);
+  m.execute();
+});
+#endif
+
+// Prints "abcd" n times: one OUT per iteration
+auto out_loop = [](Sam::VM& m, uint n)
+{
+  m.push(0);                  // 0, 1: counter
+  m.push(0x61626364);         // 2, 3
+  m.out();                    // 4
+  m.pop();                    // 5
+  m.inc();                    // 6
+  m.jlt(n, 2);                // 7 - 9
+};
+
+BENCHMARK("ENGINE_THREADED: 1M OUTs to a StreamSink on an ostringstream", 20, [&]
+{
+  std::ostringstream stream;
+  Sam::VM m;
+  m.output = std::make_shared<Sam::StreamSink>(stream);
+  out_loop(m, 1000000);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: 1M OUTs to a VectorSink", 20, [&]
+{
+  Sam::VM m;
+  m.output = std::make_shared<Sam::VectorSink>();
+  out_loop(m, 1000000);
+  m.execute();
+});
+
+// 10000 lines of 100 characters
+std::string in_lines;
+for(int i = 0; i < 10000; i++) in_lines += std::string(100, 'a' + i % 26) + "\n";
+
+BENCHMARK("ENGINE_THREADED: IN of 10K 100 character lines from a BufferSource", 20, [&]
+{
+  Sam::VM m;
+  m.input = std::make_shared<Sam::BufferSource>(in_lines);
+  m.push(0);                  // 0, 1: counter
+  m.in(25, 1000);             // 2 - 4
+  m.inc();                    // 5
+  m.jlt(10000, 2);            // 6 - 8
+  m.execute();
+});
+
+// Prints the 100 character string at address 0, n times, with OUTS or with a loop over its words
+auto print_loop = [](Sam::VM& m, uint n, bool outs)
+{
+  m.input = std::make_shared<Sam::BufferSource>(std::string(100, 'x') + "\n");
+  m.output = std::make_shared<Sam::VectorSink>();
+  m.in(25, 0);                // 0 - 2
+  m.push(0);                  // 3, 4: counter
+  if(outs)
+  {
+    m.push(0);                // 5, 6: address
+    m.outs();                 // 7
+    m.pop();                  // 8
+    m.inc();                  // 9
+    m.jlt(n, 5);              // 10 - 12
+    return;
+  }
+  m.push(0);                  // 5, 6: address
+  m.store(1000);              // 7, 8
+  m.load(1000);               // 9, 10
+  m.sload();                  // 11
+  m.jeq(0, 22);               // 12 - 14
+  m.out();                    // 15
+  m.pop();                    // 16
+  m.load(1000);               // 17, 18
+  m.inc();                    // 19
+  m.jmp(7);                   // 20, 21
+  m.pop();                    // 22
+  m.inc();                    // 23
+  m.jlt(n, 5);                // 24 - 26
+};
+
+BENCHMARK("ENGINE_THREADED: print a 100 character string 100K times with a loop", 5, [&]
+{
+  Sam::VM m;
+  print_loop(m, 100000, false);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: print a 100 character string 100K times with OUTS", 5, [&]
+{
+  Sam::VM m;
+  print_loop(m, 100000, true);
+  m.execute();
+});
+
+// Fills the 'n' words at 0, then copies them to 'n', 'times' times, with MEMCPY or with a loop over the words
+auto copy_loop = [](Sam::VM& m, uint n, uint times, bool block)
+{
+  const uint index = 2 * n;
+  m.push(5);                  // 0, 1
+  m.push(0);                  // 2, 3
+  m.push(n);                  // 4, 5
+  m.memfill();                // 6
+  m.push(0);                  // 7, 8: counter
+  if(block)
+  {
+    m.push(0);                // 9, 10
+    m.push(n);                // 11, 12
+    m.push(n);                // 13, 14
+    m.memcopy();              // 15
+    m.inc();                  // 16
+    m.jlt(times, 9);          // 17 - 19
+    return;
+  }
+  m.push(0);                  // 9, 10
+  m.store(index);             // 11, 12
+  m.load(index);              // 13, 14
+  m.sload();                  // 15
+  m.load(index);              // 16, 17
+  m.push(n);                  // 18, 19
+  m.add();                    // 20
+  m.sstore();                 // 21: memory[n + index] = memory[index]
+  m.load(index);              // 22, 23
+  m.inc();                    // 24
+  m.store(index);             // 25, 26
+  m.load(index);              // 27, 28
+  m.jge(n, 35);               // 29 - 31
+  m.pop();                    // 32
+  m.jmp(13);                  // 33, 34
+  m.pop();                    // 35
+  m.inc();                    // 36
+  m.jlt(times, 9);            // 37 - 39
+};
+
+BENCHMARK("ENGINE_THREADED: copy 64K words 16 times with a loop", 5, [&]
+{
+  Sam::VM m;
+  copy_loop(m, 1 << 16, 16, false);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: copy 64K words 16 times with MEMCPY", 5, [&]
+{
+  Sam::VM m;
+  copy_loop(m, 1 << 16, 16, true);
+  m.execute();
+});
+
+// Fills the 'n' words at 0 with 3, then sums them with VSUM or with a loop over the words
+auto sum_loop = [](Sam::VM& m, uint n, bool vector)
+{
+  const uint index = n;
+  m.push(3);                  // 0, 1
+  m.push(0);                  // 2, 3
+  m.push(n);                  // 4, 5
+  m.memfill();                // 6
+  if(vector)
+  {
+    m.push(0);                // 7, 8
+    m.push(n);                // 9, 10
+    m.vsum();                 // 11
+    return;
+  }
+  m.push(0);                  // 7, 8
+  m.store(index);             // 9, 10
+  m.push(0);                  // 11, 12: sum
+  m.load(index);              // 13, 14
+  m.sload();                  // 15
+  m.add();                    // 16
+  m.load(index);              // 17, 18
+  m.inc();                    // 19
+  m.store(index);             // 20, 21
+  m.load(index);              // 22, 23
+  m.jge(n, 30);               // 24 - 26
+  m.pop();                    // 27
+  m.jmp(13);                  // 28, 29
+  m.pop();                    // 30
+};
+
+BENCHMARK("ENGINE_THREADED: sum 1M words with a loop", 5, [&]
+{
+  Sam::VM m;
+  sum_loop(m, 1 << 20, false);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: sum 1M words with VSUM", 5, [&]
+{
+  Sam::VM m;
+  sum_loop(m, 1 << 20, true);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_SWITCH: 1M iteration bounded loop", 5, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_SWITCH;
+  bounded_loop(m, 1 << 20, false);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: 1M iteration bounded loop", 5, [&]
+{
+  Sam::VM m;
+  bounded_loop(m, 1 << 20, false);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_SWITCH: 1M iteration bounded loop with ADDI, INCM and JSLT", 5, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_SWITCH;
+  bounded_loop(m, 1 << 20, true);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: 1M iteration bounded loop with ADDI, INCM and JSLT", 5, [&]
+{
+  Sam::VM m;
+  bounded_loop(m, 1 << 20, true);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_JIT: 1M iteration bounded loop", 5, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_JIT;
+  bounded_loop(m, 1 << 20, false);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_JIT: 1M iteration bounded loop with ADDI, INCM and JSLT", 5, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_JIT;
+  bounded_loop(m, 1 << 20, true);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_REGISTER: 1M iteration bounded loop", 5, [&]
+{
+  Sam::VM m;
+  m.engine = Sam::VM::ENGINE_REGISTER;
+  bounded_loop(m, 1 << 20, false);
+  m.execute();
+});
+
+// Stores to 'n' addresses 'stride' apart, in increasing order from 'stride', so memory keeps growing
+auto scattered_stores = [](Sam::VM& m, uint n, uint stride)
+{
+  m.push(1);                  // 0, 1
+  m.store(0);                 // 2, 3: counter
+  m.push(1);                  // 4, 5
+  m.load(0);                  // 6, 7
+  m.push(stride);             // 8, 9
+  m.mul();                    // 10
+  m.sstore();                 // 11: memory[counter * stride] = 1
+  m.load(0);                  // 12, 13
+  m.inc();                    // 14
+  m.store(0);                 // 15, 16
+  m.load(0);                  // 17, 18
+  m.jgt(n, 25);               // 19 - 21
+  m.pop();                    // 22
+  m.jmp(4);                   // 23, 24
+  m.halt();                   // 25
+};
+
+BENCHMARK("ENGINE_THREADED: 100K stores 64 values apart", 20, [&]
+{
+  Sam::VM m;
+  scattered_stores(m, 100000, 64);
+  m.execute();
+});
+
+BENCHMARK("ENGINE_THREADED: 1 store at 100000000", 20, [&]
+{
+  Sam::VM m;
+  scattered_stores(m, 1, 100000000);
+  m.execute();
+});
+
+// A mixed workload: 64 VMs counting to 100000, sharing one Program, and 64 reading 20 lines each from a
+// thread that hands every one of them a line every 200 microseconds
+auto mixed_workload = [&](unsigned workers)
+{
+  Sam::VM counter;
+  counting_loop(counter, 100000);
+  std::vector<std::shared_ptr<Sam::QueueSource> > inputs;
+  Sam::Scheduler scheduler(workers);
+  for(int i = 0; i < 64; i++)
+  {
+    auto m = std::make_shared<Sam::VM>();
+    m->set_program(counter.get_program());
+    scheduler.add(m);
+    inputs.push_back(std::make_shared<Sam::QueueSource>());
+    scheduler.add(reader_vm(inputs.back(), 20));
+  }
+  std::thread feeder([&]
+  {
+    for(int round = 0; round < 20; round++)
+    {
+      for(auto& input : inputs) input->push("input");
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  });
+  scheduler.wait();
+  feeder.join();
+};
+
+std::vector<unsigned> worker_counts;
+for(unsigned n = 1; n < std::thread::hardware_concurrency(); n *= 2) worker_counts.push_back(n);
+worker_counts.push_back(std::max(1u, std::thread::hardware_concurrency()));
+for(unsigned workers : worker_counts)
+{
+  BENCHMARK("Scheduler, " + std::to_string(workers) + " workers: 64 counting VMs and 64 reading VMs", 5, [=]
+  {
+    mixed_workload(workers);
+  });
+}
+
+// A 64 MB program: 8M PUSHes. save() writes the file the load() benchmark reads, and its last run removes it.
+Sam::VM big_program;
+for(uint i = 0; i < 8 * 1024 * 1024; i++) big_program.push(i);
+const double big_bytes = big_program.get_code().size() * sizeof(uint);
+std::vector<std::shared_ptr<const Sam::Program> > loaded;     // By the load() benchmark, for the verify() one
+
+// One thread hosting many interactive VMs, as an event loop would: hand each a line, and run it until it wants another
+BENCHMARK("run() and supply(): one thread, 1000 VMs reading 20 lines each", 5, [&]
+{
+  std::vector<std::shared_ptr<Sam::VM> > vms;
+  for(int i = 0; i < 1000; i++) vms.push_back(reader_vm(std::make_shared<Sam::QueueSource>(), 20));
+  for(auto& m : vms) m->run();
+  for(int round = 0; round < 20; round++)
+    for(auto& m : vms)
+    {
+      m->supply("input");
+      m->run();
+    }
+});
+
+// Requests that each need a 4 MB table built first. The table is built by a loop, and then the VM waits at an
+// IN for the request, which changes one entry and outputs it.
+auto table_vm = [](Sam::VM& m)
+{
+  m.input = std::make_shared<Sam::QueueSource>();
+  m.output = std::make_shared<Sam::VectorSink>();
+  m.push(1);                  // 0, 1
+  m.store(0);                 // 2, 3
+  m.load(0);                  // 4, 5:   memory[i] = i, for i in memory[0]
+  m.load(0);                  // 6, 7
+  m.sstore();                 // 8
+  m.incm(0);                  // 9, 10
+  m.push(1 << 20);            // 11, 12
+  m.load(0);                  // 13, 14
+  m.jslt(4);                  // 15, 16: While i < 1M
+  m.in(1, 0);                 // 17 - 19
+  m.load(0);
+  m.load(7);
+  m.add();
+  m.store(7);
+  m.load(7);
+  m.dbg();
+  m.halt();
+};
+
+BENCHMARK("Snapshots: 100 requests, building a 4 MB table for each", 1, [&]
+{
+  Sam::VM builder;
+  table_vm(builder);
+  for(int i = 0; i < 100; i++)
+  {
+    Sam::VM m;
+    table_vm(m);
+    m.set_program(builder.get_program());
+    m.supply("request");
+    m.run();
+  }
+});
+
+BENCHMARK("Snapshots: 100 requests, each on a fork() of a VM that built a 4 MB table", 5, [&]
+{
+  Sam::VM parent;
+  table_vm(parent);
+  parent.run();
+  for(int i = 0; i < 100; i++)
+  {
+    Sam::VM m = parent.fork();
+    m.input = std::make_shared<Sam::QueueSource>();
+    m.supply("request");
+    m.run();
+  }
+});
+
+BENCHMARK("Snapshots: 100 requests, each restore()d from a snapshot of a 4 MB table", 5, [&]
+{
+  Sam::VM m;
+  table_vm(m);
+  m.run();
+  Sam::VM::Snapshot saved = m.snapshot();
+  for(int i = 0; i < 100; i++)
+  {
+    m.restore(saved);
+    m.supply("request");
+    m.run();
+  }
+});
+
+BENCHMARK_BYTES("save(): 64 MB program", 5, big_bytes, [&]
+{
+  big_program.save("bench.sam");
+});
+
+// The file read alone: the code is decoded and verified when it first runs, timed below
+BENCHMARK_BYTES("load(): 64 MB program", 5, big_bytes, [&]
+{
+  Sam::VM m;
+  m.load("bench.sam");
+  loaded.push_back(m.get_program());
+  if(loaded.size() == 5) std::remove("bench.sam");
+});
+
+BENCHMARK_BYTES("verify(): decoding and verifying a 64 MB program", 5, big_bytes, [&]
+{
+  Sam::VM m;
+  m.set_program(loaded.back());
+  loaded.pop_back();
+  m.verify();
+});
 
 END_TEST();
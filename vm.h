@@ -2,18 +2,90 @@
 #define VM_H
 
 #include <vector>
-#include <stack>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <initializer_list>
 
-#define SAM_BYTECODE_VER 1 // This is the current version of the bytecode. If any ordering changes are made, or
+#define SAM_BYTECODE_VER 6 // This is the current version of the bytecode. If any ordering changes are made, or
 // opcodes are added, this should be increased.
+#define SAM_NATIVE_LAYOUT_VER 2 // Files from this version on hold native-endian code after a SAM_CODE_OFFSET byte header.
+#define SAM_CODE_OFFSET 64 // Older files hold big-endian code straight after an 18 byte header.
 
 #define SAM_MAJOR_VER 0    // This represents the current version of the Sam VM.
 #define SAM_MINOR_VER 2
 #define SAM_REVISION 2
 
+#define SAM_STACK_SIZE 4096 // Default operand stack capacity, in values. Can be changed per VM.
+
+// Program memory is allocated in pages of 2^SAM_PAGE_BITS values. Defining SAM_HUGE_PAGES on Linux backs
+// each page with a 2 MB transparent huge page instead, for programs that use memory densely.
+#ifndef SAM_PAGE_BITS
+#ifdef SAM_HUGE_PAGES
+#define SAM_PAGE_BITS 19
+#else
+#define SAM_PAGE_BITS 12
+#endif
+#endif
+#if defined(SAM_HUGE_PAGES) && defined(__linux__)
+#define SAM_MMAP_PAGES
+#endif
+
+// The threaded engine uses computed goto (labels as values), which is a GCC/Clang extension.
+// Other compilers, or builds defining SAM_NO_COMPUTED_GOTO, get a portable switch instead.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(SAM_NO_COMPUTED_GOTO)
+#define SAM_COMPUTED_GOTO
+#endif
+
+// ENGINE_JIT compiles to native code on Linux x86-64, unless SAM_NO_JIT is defined. Elsewhere it interprets.
+#if defined(__x86_64__) && defined(__linux__) && !defined(SAM_NO_JIT)
+#define SAM_JIT
+#include <cstddef>
+#endif
+
+// Flat memory (VM::use_flat_memory()) reserves 16 GB of address space and catches SIGSEGV, so it needs
+// 64-bit Linux. Define SAM_NO_FLAT_MEMORY to leave it out.
+#if defined(__linux__) && defined(__LP64__) && !defined(SAM_NO_FLAT_MEMORY)
+#define SAM_FLAT_MEMORY
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#endif
+
+// Bulk byte swaps use SSE2 where the compiler targets it. Define SAM_NO_SIMD to use scalar code only.
+#if defined(__SSE2__) && !defined(SAM_NO_SIMD)
+#define SAM_SSE2
+#include <emmintrin.h>
+#endif
+
+// The vector instructions also get AVX2 kernels on x86 with GCC or Clang, used when the CPU turns out to have AVX2.
+#if defined(SAM_SSE2) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SAM_AVX2
+#define SAM_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+// POSIX systems can read input from, and send output to, file descriptors (FdSource and FdSink).
+#if defined(__unix__) || defined(__APPLE__)
+#define SAM_POSIX
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#endif
+
+#if defined(SAM_JIT) || defined(SAM_MMAP_PAGES) || defined(SAM_FLAT_MEMORY)
+#include <sys/mman.h>
+#endif
+
 namespace Sam
 {
 enum Bytecode
@@ -40,515 +112,4519 @@ enum Bytecode
   LOAD,
   SSTORE,
   SLOAD,
-  HALT
+  HALT,
+  OUTS,
+  MEMCPY,
+  MEMSET,
+  MEMCMP,
+  VADD,
+  VSUB,
+  VMUL,
+  VSUM,
+  VCOUNT,
+  ADDI,
+  SUBI,
+  MULI,
+  DIVI,
+  MODI,
+  INCM,
+  DECM,
+  JSGE,
+  JSGT,
+  JSLE,
+  JSLT,
+  JSEQ,
+  JSNE,
+  OPCODE_END                    // One past the last opcode
 };
 
-class VM
+// Indexed by opcode: how many values an instruction needs on the stack, and how it changes the stack depth.
+static const unsigned char stack_need[] =
+{
+  0, 0, 1, 2, 2, 2, 2, 2,       // -, PUSH, POP, ADD, SUB, MUL, DIV, MOD
+  1, 1, 1, 1, 1, 1, 1, 0,       // INC, DEC, JGE, JGT, JLE, JLT, JEQ, JMP
+  1, 0, 1, 1, 0, 2, 1, 0,       // OUT, IN, DBG, STORE, LOAD, SSTORE, SLOAD, HALT
+  1, 3, 3, 3, 3, 3, 3, 2,       // OUTS, MEMCPY, MEMSET, MEMCMP, VADD, VSUB, VMUL, VSUM
+  3, 1, 1, 1, 1, 1, 0, 0,       // VCOUNT, ADDI, SUBI, MULI, DIVI, MODI, INCM, DECM
+  2, 2, 2, 2, 2, 2              // JSGE, JSGT, JSLE, JSLT, JSEQ, JSNE
+};
+static const signed char stack_effect[] =
+{
+  0, 1, -1, -1, -1, -1, -1, -1,
+  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, -1, 1, -2, 0, 0,
+  0, -3, -3, -2, -3, -3, -3, -1,
+  -2, 0, 0, 0, 0, 0, 0, 0,
+  -2, -2, -2, -2, -2, -2
+};
+static const unsigned char op_operands[] =    // Number of operands that follow the opcode in the code
+{
+  0, 1, 0, 0, 0, 0, 0, 0,
+  0, 0, 2, 2, 2, 2, 2, 1,
+  0, 2, 0, 1, 1, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1
+};
+
+// Assembler mnemonic of each opcode
+static const char* const op_names[] =
+{
+  "?", "push", "pop", "add", "sub", "mul", "div", "mod",
+  "inc", "dec", "jge", "jgt", "jle", "jlt", "jeq", "jmp",
+  "out", "in", "dbg", "store", "load", "sstore", "sload", "halt",
+  "outs", "memcpy", "memset", "memcmp", "vadd", "vsub", "vmul", "vsum",
+  "vcount", "addi", "subi", "muli", "divi", "modi", "incm", "decm",
+  "jsge", "jsgt", "jsle", "jslt", "jseq", "jsne"
+};
+
+// Jumps are JGE ... JMP and JSGE ... JSNE. JGE ... JEQ jump to their second operand; JMP and the stack
+// compares only have the one.
+inline bool is_jump(uint op) { return (op >= JGE && op <= JMP) || (op >= JSGE && op <= JSNE); }
+inline uint target_operand(uint op) { return (op >= JGE && op < JMP) ? 1 : 0; }
+
+// Ops that only exist in the decoded stream, numbered after the bytecode
+enum DecodedOp
+{
+  OP_INVALID = 0,               // Unknown opcode, skipped
+  OP_END = OPCODE_END,          // End of the code
+  OP_EXIT,                      // Leave the decoded stream and continue in cycle() at 'addr'
+
+  // Superinstructions. Each replaces the first Instr of a common sequence; the rest of the sequence
+  // is left in the stream behind it, and is skipped over.
+  OP_PUSH_OUT_POP,              // PUSH a / OUT / POP
+  OP_LOAD_INC_STORE,            // LOAD a / INC / STORE b
+  OP_LOAD_SLOAD,                // LOAD a / SLOAD
+  OP_PUSH_ADD                   // PUSH a / ADD
+};
+
+/*
+ * Compile-time options for VM::execute<Policy>(). Each instantiation of the threaded engine only
+ * contains the features its policy turns on; the rest are compiled out rather than tested at run time.
+ */
+template<bool Trace, bool Profile, bool Checked, bool Metered = false>
+struct ExecPolicy
+{
+  static const bool trace = Trace;              // Print a trace line before every instruction
+  static const bool profile = Profile;          // Count how many times each instruction runs
+  static const bool checked = Checked;          // Check the stack bounds of every instruction
+  static const bool metered = Metered;          // Charge each jump to VM::fuel, see VM::execute(uint64_t)
+};
+
+typedef ExecPolicy<false, false, true> CheckedPolicy;           // Production use
+typedef ExecPolicy<false, false, false> UncheckedPolicy;        // Only for programs known not to fault
+typedef UncheckedPolicy VerifiedPolicy;                         // verify() proving the stack depth makes it safe
+
+/*
+ * Program memory. The 32-bit address space is split into pages of page_size values, each allocated the
+ * first time something is written to it; memory that was never written reads as 0. An address is looked
+ * up by shifting it to a page number and indexing one of two page directories:
+ *
+ *   rdir   for reads. Every entry points at a page, which is a shared page of zeros if it was never written.
+ *   wdir   for writes. Null where the page can't be written in place, which sends the write to writable().
+ *
+ * Both directories only reach as far as the highest page written so far. Pages can be shared between
+ * memories by share(), for VM snapshots and forks. A shared page is left out of wdir in every memory
+ * holding it, so the first write to it through any of them copies it. Nothing checks whether the others
+ * still hold it; reference counts read on one thread say nothing about pages being read on another.
+ */
+class PagedMemory
 {
 public:
-  VM();
+  static const uint page_bits = SAM_PAGE_BITS;
+  static const uint page_size = 1u << SAM_PAGE_BITS;
+  static const uint page_mask = page_size - 1;
 
-  enum ErrorState
+  PagedMemory() {}
+  PagedMemory(const PagedMemory& other) { *this = other; }
+  PagedMemory(PagedMemory&& other) { swap(other); }
+  PagedMemory& operator=(const PagedMemory& other);
+  PagedMemory& operator=(PagedMemory&& other) { swap(other); other.clear(); return *this; }
+
+  uint read(uint addr) const
   {
-    ERR_NONE = 1,
-    ERR_INVALID_INS,
-    ERR_OPEN_FILE,
-    ERR_BYTECODE_VER,
-    ERR_INT_SIZE,
-    ERR_READ_FAIL,
-    ERR_POP_FAIL
-  } error_state;
+    uint page = addr >> page_bits;
+    return page < rdir.size() ? rdir[page][addr & page_mask] : 0;
+  }
 
-  void execute();                               // Execute the entire code vector
 
-  bool load(std::string filename);
-  bool save(std::string filename);
+  void write(uint addr, uint val)
+  {
+    uint page = addr >> page_bits;
+    if(page < wdir.size() && wdir[page]) wdir[page][addr & page_mask] = val;
+    else writable(page)[addr & page_mask] = val;
+  }
+
+  uint* writable(uint page);                    // Allocate or unshare the page if need be, and return it
+  PagedMemory share();                          // A copy that shares this memory's pages until either writes
   void clear();
-  void reset();
-  uint get_ip();
-  uint peek();
-  bool stack_pop();
+  void swap(PagedMemory& other);
+  size_t pages() const { return rdir.size(); }  // How many pages the directories cover
+  size_t allocated() const;                     // How many pages have been allocated, shared or not
+  bool written(uint page) const { return page < owned.size() && owned[page]; }
+  const uint* read_page(uint page) const { return page < rdir.size() ? rdir[page] : zero_page(); }
+  const uint* const* read_dir() const { return rdir.data(); }
+  uint* const* write_dir() const { return wdir.data(); }
 
-  // Instructions
-  void push(uint val);
-  void pop();
-  void add();
-  void sub();
-  void mul();
-  void div();
-  void mod();
-  void inc();
-  void dec();
-  void jge(uint val, uint addr);                // Jump if >=
-  void jgt(uint val, uint addr);                // Jump if >
-  void jle(uint val, uint addr);                // Jump if <=
-  void jlt(uint val, uint addr);                // Jump if <
-  void jeq(uint val, uint addr);                // Jump if ==
-  void jmp(uint val);
-  void out();
-  void in(uint val, uint addr);
-  void dbg();
-  void store(uint addr);
-  void load(uint addr);
-  void sstore();
-  void sload();
-  void halt();
+private:
+  static const uint* zero_page();
+  static std::shared_ptr<uint> new_page();
 
-  bool trace; // Trace output
+  std::vector<const uint*> rdir;
+  std::vector<uint*> wdir;
+  std::vector<std::shared_ptr<uint> > owned;    // Page storage, by page number. Null if never written.
+};
 
-private:
-  bool cycle();                                                 // Execute one CPU cycle
-  void vec_to_mem(std::vector<uint> str, uint size, uint addr); // Store an int vector in program memory at the given address
-  void alloc(uint addr);                                        // Allocate new memory up to and including 'addr'
-  std::vector<uint> string_to_int(std::string conv);            // This is a convenience method that convert a C++ string in a vector
-  // of packed integers.
+// Copies get pages of their own
+PagedMemory& PagedMemory::operator=(const PagedMemory& other)
+{
+  if(this == &other) return *this;
 
-  std::vector<uint> code;            // Bytecode to run
-  std::vector<uint> memory;          // Program memory
-  std::stack<uint> mn_stack;         // This is a stack-based VM
+  rdir.assign(other.rdir.size(), zero_page());
+  wdir.assign(other.wdir.size(), nullptr);
+  owned.assign(other.owned.size(), std::shared_ptr<uint>());
+  for(size_t page = 0; page < other.owned.size(); page++)
+  {
+    if(!other.owned[page]) continue;
+    owned[page] = new_page();
+    std::copy(other.owned[page].get(), other.owned[page].get() + page_size, owned[page].get());
+    rdir[page] = wdir[page] = owned[page].get();
+  }
+  return *this;
+}
 
-  uint ip;
-};
+uint* PagedMemory::writable(uint page)
+{
+  if(page >= rdir.size())
+  {
+    rdir.resize(page + 1, zero_page());
+    wdir.resize(page + 1, nullptr);
+    owned.resize(page + 1);
+  }
+  if(!wdir[page])
+  {
+    if(!owned[page]) owned[page] = new_page();
+    else                                        // Shared by share(): write to a copy, even if the others are gone
+    {
+      std::shared_ptr<uint> copy = new_page();
+      std::copy(owned[page].get(), owned[page].get() + page_size, copy.get());
+      owned[page] = copy;
+    }
+    rdir[page] = wdir[page] = owned[page].get();
+  }
+  return wdir[page];
+}
 
+// Costs a copy of the directories, not of the pages. From now on, both copy a page before writing to it.
+PagedMemory PagedMemory::share()
+{
+  for(uint*& page : wdir)
+    if(page) page = nullptr;                    // Not stored if already null, so snapshots share from any thread
+  PagedMemory copy;
+  copy.rdir = rdir;
+  copy.wdir.assign(wdir.size(), nullptr);
+  copy.owned = owned;
+  return copy;
+}
 
-VM::VM()
+void PagedMemory::clear()
 {
-  ip = 0;
-  trace = false;
-  error_state = ERR_NONE;
+  rdir.clear();
+  wdir.clear();
+  owned.clear();
 }
 
-void VM::clear()
+void PagedMemory::swap(PagedMemory& other)
 {
-  ip = 0;
-  error_state = ERR_NONE;
+  rdir.swap(other.rdir);
+  wdir.swap(other.wdir);
+  owned.swap(other.owned);
+}
 
-  // Clear the mn_stack
-  while(!mn_stack.empty()) stack_pop();
+size_t PagedMemory::allocated() const
+{
+  return owned.size() - std::count(owned.begin(), owned.end(), std::shared_ptr<uint>());
+}
 
-  // Clear the code and memory
-  memory.clear();
-  code.clear();
+const uint* PagedMemory::zero_page()
+{
+  static const std::vector<uint> zeros(page_size, 0);
+  return zeros.data();
 }
 
-void VM::reset()
+// A page of zeros
+std::shared_ptr<uint> PagedMemory::new_page()
 {
-  ip = 0;
-  error_state = ERR_NONE;
+#ifdef SAM_MMAP_PAGES
+  // Over-allocate so the page can start on a huge page boundary, and give back the ends
+  const size_t bytes = page_size * sizeof(uint);
+  uint8_t* map = (uint8_t*)mmap(nullptr, 2 * bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(map == MAP_FAILED) throw std::bad_alloc();
 
-  // Clear the mn_stack
-  while(!mn_stack.empty()) stack_pop();
+  uint8_t* page = map + (bytes - (uintptr_t)map % bytes) % bytes;
+  if(page > map) munmap(map, page - map);
+  if(page + bytes < map + 2 * bytes) munmap(page + bytes, map + 2 * bytes - (page + bytes));
+  madvise(page, bytes, MADV_HUGEPAGE);
 
-  memory.clear();
+  return std::shared_ptr<uint>((uint*)page, [bytes](uint* p) { munmap(p, bytes); });
+#else
+  return std::shared_ptr<uint>(new uint[page_size](), std::default_delete<uint[]>());
+#endif
 }
 
-uint VM::get_ip()
+#ifdef SAM_FLAT_MEMORY
+/*
+ * Flat program memory: one mmap'd range spanning the whole 32-bit address space, so any address can index
+ * it with no check. The first 'size' values (rounded up to whole pages) are readable and writable, and the
+ * kernel only commits pages as they are touched. Everything after them, and a guard region in front, is
+ * PROT_NONE, so an access out of range raises SIGSEGV, which VM::execute() turns into ERR_MEMORY_BOUNDS.
+ */
+class FlatMemory
 {
-  return ip;
+public:
+  FlatMemory() : map(nullptr), reserved(0), base(nullptr), bytes(0), values(0) {}
+  explicit FlatMemory(uint64_t size);
+  FlatMemory(const FlatMemory& other);
+  FlatMemory(FlatMemory&& other) : FlatMemory() { swap(other); }
+  ~FlatMemory();
+  FlatMemory& operator=(FlatMemory other) { swap(other); return *this; }
+
+  bool ok() const { return map != nullptr; }
+  uint* data() const { return base; }
+  uint64_t size() const { return values; }     // Values that can be used, after rounding up to whole pages
+  bool contains(const void* addr) const { return addr >= map && addr < (const uint8_t*)map + reserved; }
+  void clear();                                 // Zero the memory, and give the pages back to the kernel
+  void swap(FlatMemory& other);
+
+private:
+  static const size_t guard = 1 << 16;
+
+  void* map;
+  size_t reserved;
+  uint* base;                                   // map + guard
+  size_t bytes;                                 // Readable and writable bytes from base
+  uint64_t values;
+};
+
+FlatMemory::FlatMemory(uint64_t size)
+  : map(nullptr), reserved(0), base(nullptr), bytes(0), values(0)
+{
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t span = ((size_t)1 << 32) * sizeof(uint);
+
+  void* range = mmap(nullptr, span + 2 * guard, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(range == MAP_FAILED) return;
+
+  uint* start = (uint*)((uint8_t*)range + guard);
+  size_t writable = (size * sizeof(uint) + page - 1) / page * page;
+  if(writable && mprotect(start, writable, PROT_READ | PROT_WRITE) != 0)
+  {
+    munmap(range, span + 2 * guard);
+    return;
+  }
+
+  map = range;
+  reserved = span + 2 * guard;
+  base = start;
+  bytes = writable;
+  values = std::min<uint64_t>(writable / sizeof(uint), (uint64_t)1 << 32);
 }
 
-// Peek at the top of the stack without popping it
-uint VM::peek()
+// Copies only touch the pages the original has committed
+FlatMemory::FlatMemory(const FlatMemory& other) : FlatMemory()
+{
+  if(!other.ok()) return;
+
+  FlatMemory copy(other.values);
+  if(!copy.ok()) return;
+
+  const size_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> resident(other.bytes / page);
+  if(other.bytes == 0 || mincore(other.base, other.bytes, resident.data()) != 0) resident.assign(resident.size(), 1);
+  for(size_t i = 0; i < resident.size(); i++)
+    if(resident[i] & 1) memcpy((uint8_t*)copy.base + i * page, (uint8_t*)other.base + i * page, page);
+
+  swap(copy);
+}
+
+FlatMemory::~FlatMemory()
 {
-  return mn_stack.top();
+  if(map) munmap(map, reserved);
 }
 
-// Pop the top value of the stack. If it fails because it's empty, set the error_state
-bool VM::stack_pop()
+void FlatMemory::clear()
+{
+  if(bytes) madvise(base, bytes, MADV_DONTNEED);   // Private anonymous pages read as zero again
+}
+
+void FlatMemory::swap(FlatMemory& other)
+{
+  std::swap(map, other.map);
+  std::swap(reserved, other.reserved);
+  std::swap(base, other.base);
+  std::swap(bytes, other.bytes);
+  std::swap(values, other.values);
+}
+
+// Where VM::execute() catches faults in the flat memory it is running on, for the current thread
+struct FlatFault
+{
+  const FlatMemory* memory;
+  sigjmp_buf env;
+};
+#endif
+
+// Whether this machine stores uint low byte first
+inline bool little_endian()
 {
-  if(mn_stack.empty())
+  const uint one = 1;
+  return *(const unsigned char*)&one == 1;
+}
+
+inline uint swap_bytes(uint val)
+{
+  uint swapped = 0;
+  for(size_t i = 0; i < sizeof(uint); i++)
   {
-    error_state = ERR_POP_FAIL;
-    return false;
+    swapped = (swapped << 8) | (val & 0xFF);
+    val >>= 8;
   }
-  else
+  return swapped;
+}
+
+// Copy 'count' words, swapping the byte order of each. Neither side needs to be aligned, and they may be the same.
+inline void swap_copy(const void* from, void* to, size_t count)
+{
+  const char* src = (const char*)from;
+  char* dest = (char*)to;
+  size_t i = 0;
+#ifdef SAM_SSE2
+  // Four words at a time: swap the bytes of each 16-bit half, then swap the halves
+  for(; sizeof(uint) == 4 && i + 4 <= count; i += 4)
   {
-    mn_stack.pop();
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * sizeof(uint)));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    _mm_storeu_si128((__m128i*)(dest + i * sizeof(uint)), v);
+  }
+#endif
+  for(; i < count; i++)
+  {
+    uint word;
+    memcpy(&word, src + i * sizeof(uint), sizeof(uint));
+    word = swap_bytes(word);
+    memcpy(dest + i * sizeof(uint), &word, sizeof(uint));
   }
-  return true;
 }
 
-bool VM::cycle()
+// Index of the first of 'count' words where 'a' and 'b' differ, or 'count' if they are the same
+inline size_t mismatch_words(const uint* a, const uint* b, size_t count)
 {
-  uint opcode = code[ip];
-  uint val = 0;
-  uint addr = 0;
-  ip++;
-
-  if(trace)
+  size_t i = 0;
+#ifdef SAM_SSE2
+  // Eight words at a time, then find the word in the block that differs
+  for(; sizeof(uint) == 4 && i + 8 <= count; i += 8)
   {
-    std::cout << '\n' << (ip - 1) << "\t: " << opcode << "\tStack: ";
+    __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i + 4)), _mm_loadu_si128((const __m128i*)(b + i + 4)));
+    if(_mm_movemask_epi8(_mm_and_si128(lo, hi)) != 0xFFFF) break;
+  }
+#endif
+  while(i < count && a[i] == b[i]) i++;
+  return i;
+}
+
+/*
+ * Kernels for the vector instructions. The element-wise ones apply an op to each word of 'words' and the
+ * word at the same index of 'with', and store the result in 'words'. Each op has a scalar form, which wraps
+ * round like ADD, SUB and MUL do, and SSE2 and AVX2 forms on four and eight words at a time.
+ */
+struct WordAdd
+{
+  static uint scalar(uint a, uint b) { return a + b; }
+#ifdef SAM_SSE2
+  static __m128i sse2(__m128i a, __m128i b) { return _mm_add_epi32(a, b); }
+#endif
+#ifdef SAM_AVX2
+  SAM_TARGET_AVX2 static __m256i avx2(__m256i a, __m256i b) { return _mm256_add_epi32(a, b); }
+#endif
+};
+
+struct WordSub
+{
+  static uint scalar(uint a, uint b) { return a - b; }
+#ifdef SAM_SSE2
+  static __m128i sse2(__m128i a, __m128i b) { return _mm_sub_epi32(a, b); }
+#endif
+#ifdef SAM_AVX2
+  SAM_TARGET_AVX2 static __m256i avx2(__m256i a, __m256i b) { return _mm256_sub_epi32(a, b); }
+#endif
+};
 
-    if(!mn_stack.empty()) std::cout << mn_stack.top();
-    else std::cout << "N/A";
+struct WordMul
+{
+  static uint scalar(uint a, uint b) { return a * b; }
+#ifdef SAM_SSE2
+  // SSE2 only multiplies the even words into 64 bits, so do the odd ones separately and take the low halves
+  static __m128i sse2(__m128i a, __m128i b)
+  {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+  }
+#endif
+#ifdef SAM_AVX2
+  SAM_TARGET_AVX2 static __m256i avx2(__m256i a, __m256i b) { return _mm256_mullo_epi32(a, b); }
+#endif
+};
 
-    std::cout << "\tOut: ";
+// words[i] = Op(words[i], with[i]). The two may be the same, or 'words' may start before 'with'.
+template<class Op>
+inline void zip_words(uint* words, const uint* with, size_t count)
+{
+  size_t i = 0;
+#ifdef SAM_SSE2
+  for(; sizeof(uint) == 4 && i + 4 <= count; i += 4)
+  {
+    __m128i v = Op::sse2(_mm_loadu_si128((const __m128i*)(words + i)), _mm_loadu_si128((const __m128i*)(with + i)));
+    _mm_storeu_si128((__m128i*)(words + i), v);
   }
+#endif
+  for(; i < count; i++) words[i] = Op::scalar(words[i], with[i]);
+}
 
-  switch(opcode)
+// The sum of the words, wrapping round like ADD
+inline uint sum_words(const uint* words, size_t count)
+{
+  size_t i = 0;
+  uint sum = 0;
+#ifdef SAM_SSE2
+  __m128i acc = _mm_setzero_si128();
+  for(; sizeof(uint) == 4 && i + 4 <= count; i += 4) acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)(words + i)));
+  uint lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  if(sizeof(uint) == 4) sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for(; i < count; i++) sum += words[i];
+  return sum;
+}
+
+// How many of the words are equal to 'val'
+inline uint count_words(const uint* words, size_t count, uint val)
+{
+  size_t i = 0;
+  uint found = 0;
+#ifdef SAM_SSE2
+  // Each match is -1 in its lane, so subtracting the compare counts it
+  const __m128i v = _mm_set1_epi32((int)val);
+  __m128i acc = _mm_setzero_si128();
+  for(; sizeof(uint) == 4 && i + 4 <= count; i += 4)
+    acc = _mm_sub_epi32(acc, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(words + i)), v));
+  uint lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  if(sizeof(uint) == 4) found = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for(; i < count; i++) found += (words[i] == val);
+  return found;
+}
+
+#ifdef SAM_AVX2
+template<class Op>
+SAM_TARGET_AVX2 inline void zip_words_avx2(uint* words, const uint* with, size_t count)
+{
+  size_t i = 0;
+  for(; sizeof(uint) == 4 && i + 8 <= count; i += 8)
   {
-  case PUSH:
-    mn_stack.push(code[ip]);
-    ip++;
-    break;
+    __m256i v = Op::avx2(_mm256_loadu_si256((const __m256i*)(words + i)), _mm256_loadu_si256((const __m256i*)(with + i)));
+    _mm256_storeu_si256((__m256i*)(words + i), v);
+  }
+  zip_words<Op>(words + i, with + i, count - i);
+}
 
-  case POP:
-    stack_pop();
-    break;
+SAM_TARGET_AVX2 inline uint sum_words_avx2(const uint* words, size_t count)
+{
+  size_t i = 0;
+  __m256i acc = _mm256_setzero_si256();
+  for(; sizeof(uint) == 4 && i + 8 <= count; i += 8) acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i*)(words + i)));
+  uint lanes[8];
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  uint sum = 0;
+  for(int lane = 0; lane < 8; lane++) sum += lanes[lane];
+  return sum + sum_words(words + i, count - i);
+}
 
-  case ADD:
-    val = mn_stack.top();
-    stack_pop();
-    val += mn_stack.top();
-    stack_pop();
-    mn_stack.push(val);
-    break;
+SAM_TARGET_AVX2 inline uint count_words_avx2(const uint* words, size_t count, uint val)
+{
+  size_t i = 0;
+  const __m256i v = _mm256_set1_epi32((int)val);
+  __m256i acc = _mm256_setzero_si256();
+  for(; sizeof(uint) == 4 && i + 8 <= count; i += 8)
+    acc = _mm256_sub_epi32(acc, _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(words + i)), v));
+  uint lanes[8];
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  uint found = 0;
+  for(int lane = 0; lane < 8; lane++) found += lanes[lane];
+  return found + count_words(words + i, count - i, val);
+}
+#endif
 
-  case SUB:
-    val = mn_stack.top();
-    stack_pop();
-    val -= mn_stack.top();
-    stack_pop();
-    mn_stack.push(val);
-    break;
+// One set of kernels for the vector instructions
+struct VectorKernels
+{
+  void (*add)(uint* words, const uint* with, size_t count);
+  void (*sub)(uint* words, const uint* with, size_t count);
+  void (*mul)(uint* words, const uint* with, size_t count);
+  uint (*sum)(const uint* words, size_t count);
+  uint (*count)(const uint* words, size_t count, uint val);
+};
 
-  case MUL:
-    val = mn_stack.top();
-    stack_pop();
-    val *= mn_stack.top();
-    stack_pop();
-    mn_stack.push(val);
-    break;
+// The kernels the vector instructions use: AVX2 if this build has them and the CPU supports them, else SSE2
+// or scalar ones depending on the build. 'avx2' false gives the others regardless.
+inline const VectorKernels& vector_kernels(bool avx2 = true)
+{
+  static const VectorKernels portable = { &zip_words<WordAdd>, &zip_words<WordSub>, &zip_words<WordMul>, &sum_words, &count_words };
+#ifdef SAM_AVX2
+  static const VectorKernels wide =
+    { &zip_words_avx2<WordAdd>, &zip_words_avx2<WordSub>, &zip_words_avx2<WordMul>, &sum_words_avx2, &count_words_avx2 };
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if(avx2 && has_avx2) return wide;
+#endif
+  (void)avx2;
+  return portable;
+}
 
-  case DIV:
-    val = mn_stack.top();
-    stack_pop();
-    val /= mn_stack.top();
-    stack_pop();
-    mn_stack.push(val);
-    break;
+/*
+ * Where OUT and DBG write. Output is collected in a buffer and handed to write() in large blocks: when the
+ * buffer is full, before IN reads input, before each trace line, and when VM::execute() returns.
+ */
+class OutputSink
+{
+public:
+  OutputSink() : used(0) {}
+  virtual ~OutputSink() {}
 
-  case MOD:
-    val = mn_stack.top();
-    stack_pop();
-    val %= mn_stack.top();
-    stack_pop();
-    mn_stack.push(val);
-    break;
+  void put(char c)
+  {
+    if(used == sizeof(buffer)) flush();
+    buffer[used++] = c;
+  }
+  void put_chars(uint chars);                   // The characters packed in 'chars', high byte first, skipping nulls
+  void put_words(const uint* words, size_t count);  // put_chars() of each word
+  void put_hex(uint val);                       // 'val' in lowercase hex, then a newline
+  void flush();
 
-  case INC:
-    val = mn_stack.top();
-    stack_pop();
-    val++;
-    mn_stack.push(val);
-    break;
+protected:
+  virtual void write(const char* data, size_t size) = 0;
 
-  case DEC:
-    val = mn_stack.top();
-    stack_pop();
-    val--;
-    mn_stack.push(val);
-    break;
+private:
+  char buffer[1 << 16];
+  size_t used;
+};
+
+void OutputSink::put_chars(uint chars)
+{
+  for(int shift = sizeof(uint) * 8 - 8; shift >= 0; shift -= 8)
+  {
+    char ascii = (char)(chars >> shift);
+    if(ascii) put(ascii);                       // A null character is not output
+  }
+}
+
+void OutputSink::put_words(const uint* words, size_t count)
+{
+  while(count)
+  {
+    if(used + sizeof(uint) > sizeof(buffer)) flush();
+    size_t n = std::min(count, (sizeof(buffer) - used) / sizeof(uint));
+    char* chars = buffer + used;
+    size_t length = n * sizeof(uint);
+    if(little_endian()) swap_copy(words, chars, n);
+    else memcpy(chars, words, length);
+
+    // Drop the null characters, which are normally just the padding at the end of a string
+    char* null = (char*)memchr(chars, 0, length);
+    if(null)
+    {
+      char* kept = null;
+      for(char* c = null; c < chars + length; c++)
+        if(*c) *kept++ = *c;
+      length = kept - chars;
+    }
+
+    used += length;
+    words += n;
+    count -= n;
+  }
+}
+
+void OutputSink::put_hex(uint val)
+{
+  char digits[sizeof(uint) * 2];
+  int count = 0;
+  do
+  {
+    digits[count++] = "0123456789abcdef"[val & 0xF];
+    val >>= 4;
+  } while(val);
+  while(count) put(digits[--count]);
+  put('\n');
+}
+
+void OutputSink::flush()
+{
+  if(!used) return;
+  write(buffer, used);
+  used = 0;
+}
+
+// Output to a C++ stream. A VM writes to std::cout through one of these unless it is given another sink.
+class StreamSink : public OutputSink
+{
+public:
+  explicit StreamSink(std::ostream& stream = std::cout) : stream(stream) {}
+  ~StreamSink() { flush(); }
+
+protected:
+  void write(const char* data, size_t size) { stream.write(data, size); }
+
+private:
+  std::ostream& stream;
+};
+
+// Output collected in memory
+class VectorSink : public OutputSink
+{
+public:
+  ~VectorSink() { flush(); }
+
+  std::vector<char> bytes;                      // Everything written so far, once flushed
+
+protected:
+  void write(const char* data, size_t size) { bytes.insert(bytes.end(), data, data + size); }
+};
+
+#ifdef SAM_POSIX
+// Output to a file descriptor with write(2), standard out by default. The descriptor is not closed.
+class FdSink : public OutputSink
+{
+public:
+  explicit FdSink(int fd = STDOUT_FILENO) : fd(fd) {}
+  ~FdSink() { flush(); }
+
+protected:
+  void write(const char* data, size_t size);
+
+private:
+  int fd;
+};
+
+void FdSink::write(const char* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t done = ::write(fd, data, size);
+    if(done < 0 && errno == EINTR) continue;
+    if(done <= 0) return;                       // Like std::cout, output errors are dropped
+    data += done;
+    size -= done;
+  }
+}
+#endif
+
+/*
+ * Where IN reads its lines. Input is read in large blocks, and each line is handed out as a span of the
+ * buffer, so IN can pack it straight into program memory. A source may read past the line IN asked for.
+ */
+class InputSource
+{
+public:
+  InputSource() : buffer(1 << 16), start(0), end(0) {}
+  virtual ~InputSource() {}
+
+  // The next line, without its newline, valid until the next call. False, with an empty line, at the end of input.
+  bool next_line(const char*& line, size_t& length);
+  bool ready();                                 // Whether next_line() can return without waiting for input
+  virtual void when_ready(std::function<void ()> wake) { wake(); }  // Call 'wake' once, when ready() is true
+                                                // Sources that override available() must override this too
+
+protected:
+  virtual size_t read(char* data, size_t size) = 0;    // Read up to 'size' bytes. 0 means the end of input.
+  virtual bool available() { return true; }     // Whether read() can return without waiting. Say so if unsure.
+
+private:
+  bool fill();                                  // Move the unread input to the front and read more. False at the end.
+
+  std::vector<char> buffer;                     // Grows to hold the longest line
+  size_t start;                                 // Unread input is buffer[start, end)
+  size_t end;
+};
+
+bool InputSource::next_line(const char*& line, size_t& length)
+{
+  size_t scanned = start;
+  while(true)
+  {
+    const char* newline = (const char*)memchr(buffer.data() + scanned, '\n', end - scanned);
+    if(newline)
+    {
+      line = buffer.data() + start;
+      length = newline - line;
+      start += length + 1;
+      return true;
+    }
+
+    scanned = end - start;                      // fill() moves the unread input to the front
+    if(!fill())                                 // The last line may not end with a newline
+    {
+      line = buffer.data();
+      length = end;
+      start = end;
+      return length > 0;
+    }
+  }
+}
+
+// A whole line is buffered, or the input has ended. A partial line is read on with, while available() says so.
+bool InputSource::ready()
+{
+  size_t scanned = start;
+  while(!memchr(buffer.data() + scanned, '\n', end - scanned))
+  {
+    if(!available()) return false;
+    scanned = end - start;
+    if(!fill()) return true;
+  }
+  return true;
+}
+
+bool InputSource::fill()
+{
+  // Move the partial line to the front, and make room for more of it
+  memmove(buffer.data(), buffer.data() + start, end - start);
+  end -= start;
+  start = 0;
+  if(end == buffer.size()) buffer.resize(buffer.size() * 2);
+
+  size_t got = read(buffer.data() + end, buffer.size() - end);
+  end += got;
+  return got > 0;
+}
+
+/*
+ * Input from a C++ stream, std::cin by default. It only takes what the stream has buffered, or one
+ * character at a time, so with std::cin synchronized with stdio (the default) it never reads past the
+ * end of the line, and whatever reads std::cin next gets the rest.
+ */
+class StreamSource : public InputSource
+{
+public:
+  explicit StreamSource(std::istream& stream = std::cin) : stream(stream) {}
+
+protected:
+  size_t read(char* data, size_t size)
+  {
+    std::streambuf* buf = stream.rdbuf();
+    std::streamsize want = std::min<std::streamsize>(size, std::max<std::streamsize>(1, buf->in_avail()));
+    std::streamsize got = buf->sgetn(data, want);
+    return got > 0 ? got : 0;
+  }
+
+private:
+  std::istream& stream;
+};
+
+// Input from memory
+class BufferSource : public InputSource
+{
+public:
+  explicit BufferSource(std::string data) : data(std::move(data)), pos(0) {}
+
+protected:
+  size_t read(char* out, size_t size)
+  {
+    size_t got = std::min(size, data.size() - pos);
+    memcpy(out, data.data() + pos, got);
+    pos += got;
+    return got;
+  }
+
+private:
+  std::string data;
+  size_t pos;
+};
+
+/*
+ * Input handed over by the host a line at a time, from any thread. read() waits for a line, but
+ * execute(fuel) and run() stop at an IN while there is none, and when_ready() says when there is one.
+ */
+class QueueSource : public InputSource
+{
+public:
+  QueueSource() : closed(false) {}
+
+  void push(const std::string& line);           // Add a line, without its newline
+  void close();                                 // End the input after the lines pushed so far
+  void when_ready(std::function<void ()> wake);
+
+protected:
+  size_t read(char* data, size_t size);
+  bool available();
+
+private:
+  std::mutex lock;
+  std::condition_variable more;
+  std::string pending;                          // Pushed, and not yet read
+  bool closed;
+  std::function<void ()> waiting;               // when_ready()'s 'wake', until there is input
+};
+
+void QueueSource::push(const std::string& line)
+{
+  std::function<void ()> wake;
+  {
+    std::lock_guard<std::mutex> hold(lock);
+    pending += line;
+    pending += '\n';
+    wake.swap(waiting);
+  }
+  more.notify_all();
+  if(wake) wake();
+}
+
+void QueueSource::close()
+{
+  std::function<void ()> wake;
+  {
+    std::lock_guard<std::mutex> hold(lock);
+    closed = true;
+    wake.swap(waiting);
+  }
+  more.notify_all();
+  if(wake) wake();
+}
+
+void QueueSource::when_ready(std::function<void ()> wake)
+{
+  {
+    std::lock_guard<std::mutex> hold(lock);
+    if(pending.empty() && !closed)
+    {
+      waiting = std::move(wake);
+      return;
+    }
+  }
+  wake();
+}
+
+size_t QueueSource::read(char* data, size_t size)
+{
+  std::unique_lock<std::mutex> hold(lock);
+  more.wait(hold, [this] { return !pending.empty() || closed; });
+  size_t got = std::min(size, pending.size());
+  memcpy(data, pending.data(), got);
+  pending.erase(0, got);
+  return got;
+}
+
+bool QueueSource::available()
+{
+  std::lock_guard<std::mutex> hold(lock);
+  return !pending.empty() || closed;
+}
+
+#ifdef SAM_POSIX
+/*
+ * Input from a file descriptor with read(2), standard in by default. The descriptor is not closed.
+ * available() polls it, so execute(fuel) and run() stop at an IN until a whole line has arrived, and
+ * an event loop can wait for the descriptor to be readable and run the VM again. A descriptor set to
+ * O_NONBLOCK should only be read that way: execute() would take "no data yet" as the end of input.
+ *
+ * when_ready() waits for the descriptor on a thread of its own, which the destructor stops if it is
+ * still waiting. It wakes as soon as there is anything to read, which may be less than a whole line.
+ */
+class FdSource : public InputSource
+{
+public:
+  explicit FdSource(int fd = STDIN_FILENO) : fd(fd) { stop[0] = stop[1] = -1; }
+  ~FdSource();
+
+  void when_ready(std::function<void ()> wake);
+
+protected:
+  size_t read(char* data, size_t size)
+  {
+    ssize_t got;
+    do got = ::read(fd, data, size); while(got < 0 && errno == EINTR);
+    return got > 0 ? got : 0;                   // Errors end the input
+  }
+
+  bool available()
+  {
+    pollfd p = { fd, POLLIN, 0 };
+    int got;
+    do got = ::poll(&p, 1, 0); while(got < 0 && errno == EINTR);
+    return got != 0;                            // Readable, at the end, or failed: read() won't wait
+  }
+
+private:
+  void finish_watching();
+
+  int fd;
+  int stop[2];                                  // A pipe that wakes the watcher to end it. Made when first needed.
+  std::thread watcher;                          // Waits for fd to be readable, for when_ready()
+};
+
+FdSource::~FdSource()
+{
+  if(watcher.joinable() && stop[1] >= 0)
+  {
+    ssize_t sent;
+    do sent = ::write(stop[1], "", 1); while(sent < 0 && errno == EINTR);
+  }
+  finish_watching();
+  if(stop[0] >= 0)
+  {
+    close(stop[0]);
+    close(stop[1]);
+  }
+}
+
+/*
+ * Each call after the first comes once the last watcher has called 'wake', so it has finished, or is
+ * about to. It may be calling in from inside 'wake' itself, though, and can't be waited for there.
+ */
+void FdSource::finish_watching()
+{
+  if(!watcher.joinable()) return;
+  if(watcher.get_id() == std::this_thread::get_id()) watcher.detach();
+  else watcher.join();
+}
+
+void FdSource::when_ready(std::function<void ()> wake)
+{
+  finish_watching();
+  if(ready() || (stop[0] < 0 && pipe(stop) != 0))     // Without a pipe to stop it, there can be no watcher
+  {
+    wake();
+    return;
+  }
+
+  const int fd = this->fd, cancel = stop[0];
+  watcher = std::thread([fd, cancel, wake]
+  {
+    pollfd p[2] = { { fd, POLLIN, 0 }, { cancel, POLLIN, 0 } };
+    int got;
+    do got = ::poll(p, 2, -1); while(got < 0 && errno == EINTR);
+    if(!(p[1].revents & POLLIN)) wake();        // Unless the source is going away
+  });
+}
+#endif
+
+#ifdef SAM_JIT
+class VM;
+
+// State shared between VM::execute_jit() and the native code it runs. The native code keeps 'top'
+// in a register while it runs and writes it back here when it returns.
+struct JitContext
+{
+  VM* vm;
+  uint* top;                    // Stack pointer, as in the threaded engine: the slot the top value belongs in
+  uint* base;                   // mn_stack.data()
+  uint* full;                   // base + stack capacity
+  const uint* const* rdir;      // memory's page directories. The callbacks update these whenever memory grows.
+  uint* const* wdir;
+  uint64_t pages;               // Size of the page directories
+  uint ip;                      // Where to carry on after the native code returns
+
+  void map(const PagedMemory& memory)
+  {
+    rdir = memory.read_dir();
+    wdir = memory.write_dir();
+    pages = memory.pages();
+  }
+};
+
+// Why the native code returned
+enum JitStatus
+{
+  JIT_END = 1,                  // Ran off the end of the code
+  JIT_HALT,
+  JIT_FALLBACK,                 // Jumped somewhere the JIT has no code for; the interpreter carries on at ip
+  JIT_UNDERFLOW,
+  JIT_OVERFLOW
+};
+
+// A little x86-64 assembler: just enough to write bytes and patch 32-bit relative jumps
+struct JitAssembler
+{
+  std::vector<uint8_t> buf;
+
+  size_t here() { return buf.size(); }
+  void bytes(std::initializer_list<uint8_t> b) { buf.insert(buf.end(), b); }
+  void imm32(uint32_t v) { for(int i = 0; i < 4; i++) buf.push_back((uint8_t)(v >> (8 * i))); }
+  void imm64(uint64_t v) { for(int i = 0; i < 8; i++) buf.push_back((uint8_t)(v >> (8 * i))); }
+
+  // Emit a jump with a 32-bit displacement to be patched later, and return the displacement's offset.
+  // 'cc' is the x86 condition code, or -1 for an unconditional jump.
+  size_t jump(int cc)
+  {
+    if(cc < 0) bytes({ 0xE9 });
+    else bytes({ 0x0F, (uint8_t)(0x80 + cc) });
+    imm32(0);
+    return here() - 4;
+  }
+
+  void patch(size_t at, size_t target)
+  {
+    int32_t rel = (int32_t)(target - (at + 4));
+    for(int i = 0; i < 4; i++) buf[at + i] = (uint8_t)(rel >> (8 * i));
+  }
+};
+
+// x86 condition codes, for unsigned comparisons
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+// Native code for one program, in an executable mapping that is released with the object.
+// Copies of a VM share it; nothing in it depends on which VM runs it.
+struct JitCode
+{
+  void* buffer;
+  size_t size;
+  size_t len;                   // Size of the code vector it was compiled from
+  std::vector<int> entry;       // Bytecode address -> offset of its native code, or -1 if it can't be entered there
+
+  JitCode() : buffer(nullptr), size(0), len(0) {}
+  ~JitCode() { if(buffer) munmap(buffer, size); }
+
+  // Enter the native code at bytecode address 'addr', which must have an entry
+  uint run(JitContext* ctx, uint addr) const
+  {
+    typedef uint (*Entry)(JitContext*, const void*);
+    return ((Entry)buffer)(ctx, (const uint8_t*)buffer + entry[addr]);
+  }
+};
+#endif
+
+// One instruction of the decoded stream. See VM::decode().
+struct Instr
+{
+  uint op;                      // Handler: a Bytecode or DecodedOp
+  uint a;                       // First operand
+  uint b;                       // Second operand
+  uint addr;                    // Address of the instruction in the bytecode
+  const Instr* target;          // Resolved jump target
+};
+
+// Ops of the register IR. See VM::reg_compile(). Registers are stack slots, named by their offset from the
+// top of the stack once the block has moved it; the block's temporaries live in the slots above its peak.
+enum RegOp
+{
+  R_ENTER,                      // If sp >= x and sp + y fits the stack, move the top by d. Otherwise cycle() from z.
+  R_SET,                        // [d] = y
+  R_MOVE,                       // [d] = [x]
+  R_LOAD,                       // [d] = memory[y]
+  R_STORE,                      // memory[d] = [x]
+  R_STOREI,                     // memory[d] = y
+  R_SLOAD,                      // [d] = memory[[x]]
+  R_SSTORE,                     // memory[[x]] = [y]
+  R_ADD, R_SUB, R_MUL, R_DIV, R_MOD,            // [d] = [x] op [y], in bytecode order
+  R_ADDI, R_SUBI, R_MULI, R_DIVI, R_MODI,       // [d] = [x] op y
+  R_RSUBI, R_RDIVI, R_RMODI,                    // [d] = y op [x]
+  R_OUT,                        // OUT [x]
+  R_DBG,                        // DBG [x]
+  R_OUTS,                       // OUTS [x]
+  R_IN,                         // IN y, d
+  R_MEMCPY, R_MEMSET, R_MEMCMP, R_VADD, R_VSUB, R_VMUL, R_VSUM, R_VCOUNT,  // [d] = op on [x], [y], [z]
+  R_BGE, R_BGT, R_BLE, R_BLT, R_BEQ, R_BNE,     // Go to d if [x] cmp [y], to z if not
+  R_BGEI, R_BGTI, R_BLEI, R_BLTI, R_BEQI, R_BNEI, // Go to d if [x] cmp y, to z if not
+  R_JUMP,                       // Move the top by x, and go to d
+  R_HALT,                       // Stop, with ip at d
+  R_EXIT                        // Leave the IR, with ip at d
+};
+
+// One instruction of the register IR
+struct RegInstr
+{
+  uint op;                      // A RegOp
+  uint d;                       // Destination register, memory address or IR index to go to
+  uint x;                       // Source register
+  uint y;                       // Second source register, or an immediate
+  uint z;                       // Third source register, or IR index to go to
+};
+
+// The register IR for one program. Copies of a VM share it; nothing in it depends on which VM runs it.
+struct RegisterCode
+{
+  std::vector<RegInstr> ir;
+  std::vector<int> entry;       // Bytecode address -> index in 'ir' of the block starting there, or -1
+  size_t len;                   // Size of the code vector it was translated from
+  uint regs;                    // Temporaries the block with the most uses, above its peak
+};
+
+// Why VM::run_register() returned
+enum RegStatus
+{
+  REG_STOP = 1,                 // Halted
+  REG_EXIT,                     // Carry on at ip, in another block or in cycle()
+  REG_STEP                      // A block at ip would fault somewhere inside: run it with cycle()
+};
+
+class Program;
+
+class VM
+{
+public:
+  VM(uint stack_size = SAM_STACK_SIZE);
+
+  enum ErrorState
+  {
+    ERR_NONE = 1,
+    ERR_INVALID_INS,
+    ERR_OPEN_FILE,
+    ERR_BYTECODE_VER,
+    ERR_INT_SIZE,
+    ERR_READ_FAIL,
+    ERR_POP_FAIL,
+    ERR_STACK_OVERFLOW,
+    ERR_MEMORY_BOUNDS
+  } error_state;
+
+  enum Engine
+  {
+    ENGINE_SWITCH = 1,                          // Reference interpreter, one cycle() per instruction
+    ENGINE_THREADED,                            // Threaded interpreter, one indirect jump per handler
+    ENGINE_JIT,                                 // Native code on Linux x86-64, the threaded engine elsewhere
+    ENGINE_REGISTER                             // Basic blocks translated to a register IR
+  } engine;
+
+  // Why execute(fuel) returned
+  enum RunState
+  {
+    RUN_HALTED = 1,                             // Ran HALT, or off the end of the code
+    RUN_OUT_OF_FUEL,                            // Ran out of fuel. execute() again to carry on.
+    RUN_ERROR,                                  // Stopped on an error, see error_state
+    RUN_WAITING                                 // Stopped at an IN with no input ready. See InputSource::when_ready().
+  };
+
+  // Where a VM had got to: its program, ip, error_state, operand stack and program memory. See snapshot().
+  class Snapshot
+  {
+  public:
+    uint get_ip() const { return ip; }
+
+  private:
+    friend class VM;
+    Snapshot() {}
+
+    std::shared_ptr<Program> program;
+    uint ip;
+    ErrorState error_state;
+    std::vector<uint> stack;                    // Bottom first
+    uint stack_cap;
+    std::shared_ptr<PagedMemory> memory;        // Never written, so its pages stay shared
+#ifdef SAM_FLAT_MEMORY
+    std::shared_ptr<const FlatMemory> flat;     // A copy, if the VM was on flat memory
+#endif
+  };
+
+  void execute();                               // Execute the entire code vector
+  RunState execute(uint64_t fuel);              // Execute until HALT, an error, or 'fuel' jumps have run
+  RunState run();                               // Execute until HALT, an error, or an IN with no input ready
+  void supply(const std::string& line);         // Give IN a line, through a QueueSource
+
+  template<class Policy>
+  void execute();                               // Execute with the threaded engine, built for Policy
+
+  bool load(std::string filename);
+  bool save(std::string filename);
+  bool verify();                                // Check the code is well formed and prove its stack stays in bounds
+  bool optimize();                              // Fold constants, thread jumps and drop dead code, then compact
+  void clear();
+  void reset();
+  uint get_ip();
+  const std::vector<uint>& get_code();          // The program's bytecode
+  std::shared_ptr<const Program> get_program(); // The program, to run on other VMs too
+  void set_program(std::shared_ptr<const Program> program); // Run 'program', from address 0
+  Snapshot snapshot();                          // Save where the VM has got to, sharing its memory copy-on-write
+  void restore(const Snapshot& snapshot);       // Go back to a snapshot, from this VM or any other
+  VM fork();                                    // A copy of this VM, sharing its memory copy-on-write
+  uint peek();
+  bool stack_pop();
+  const std::vector<uint64_t>& get_profile();  // Times each instruction has run, by address, when profiling
+  uint get_stack_size();
+  uint get_stack_depth();                       // How many values are on the stack
+  bool set_stack_size(uint size);               // Change the stack capacity. Fails if the stack holds more values.
+  bool use_flat_memory(uint64_t size);          // Use 'size' values of flat memory, or paged memory if 0
+
+  // Instructions
+  void push(uint val);
+  void pop();
+  void add();
+  void sub();
+  void mul();
+  void div();
+  void mod();
+  void inc();
+  void dec();
+  void jge(uint val, uint addr);                // Jump if >=
+  void jgt(uint val, uint addr);                // Jump if >
+  void jle(uint val, uint addr);                // Jump if <=
+  void jlt(uint val, uint addr);                // Jump if <
+  void jeq(uint val, uint addr);                // Jump if ==
+  void jmp(uint val);
+  void out();
+  void in(uint val, uint addr);
+  void dbg();
+  void store(uint addr);
+  void load(uint addr);
+  void sstore();
+  void sload();
+  void halt();
+  void outs();
+  void memcopy();                               // Copy words: pops length, destination, source
+  void memfill();                               // Fill words: pops length, destination, value
+  void memcompare();                            // Compare words: pops length, two addresses; pushes 0, 1 or 2
+  void vadd();                                  // Add words: pops length, destination, source
+  void vsub();                                  // Subtract words: pops length, destination, source
+  void vmul();                                  // Multiply words: pops length, destination, source
+  void vsum();                                  // Sum words: pops length, address; pushes the sum
+  void vcount();                                // Count words equal to a value: pops length, address, value; pushes the count
+  void addi(uint val);                          // Add val to the top of the stack
+  void subi(uint val);                          // Subtract val from the top of the stack
+  void muli(uint val);
+  void divi(uint val);
+  void modi(uint val);
+  void incm(uint addr);                         // Increment memory at addr
+  void decm(uint addr);
+  void jsge(uint addr);                         // Pop two values, and jump if the top one was >= the one under it
+  void jsgt(uint addr);                         // ... >
+  void jsle(uint addr);                         // ... <=
+  void jslt(uint addr);                         // ... <
+  void jseq(uint addr);                         // ... ==
+  void jsne(uint addr);                         // ... !=
+
+  bool trace; // Trace output
+  std::shared_ptr<OutputSink> output; // Where OUT and DBG write. Copies of a VM share it.
+  std::shared_ptr<InputSource> input; // Where IN reads. Copies of a VM share it.
+  bool profile; // Count instructions run, see get_profile()
+  bool bounds_checks; // Check stack bounds (memory reads are always checked through PagedMemory::read). Turning this
+                      // off is only safe for programs that never under- or overflow the stack.
+
+private:
+  friend class Program;
+
+  template<bool Flat = false>
+  bool cycle();                                                 // Execute one CPU cycle, on flat or paged memory
+  template<bool Flat = false>
+  bool metered_cycle();                                         // cycle(), charging fuel if it runs a jump
+  template<bool Metered>
+  void execute_threaded();                                      // Run the threaded engine with the right policy
+  template<bool Flat>
+  uint read_memory(uint addr);
+  template<bool Flat>
+  void write_memory(uint addr, uint val);
+  std::vector<uint>& edit();                                    // The code, unshared and with its caches dropped
+  void append(std::initializer_list<uint> words);               // Add an instruction to the code
+  bool stack_proven();                                          // Whether execution can skip its stack checks from ip
+  template<class Policy>
+  bool run_decoded(const Instr* pc);                            // Run the decoded stream from pc
+  void trace_line(uint addr, uint depth, uint top);             // Print the trace of one instruction
+#ifdef SAM_JIT
+  void execute_jit();                                           // Run the program with the JIT
+  static void jit_out(JitContext* ctx, uint chars);             // Callbacks from native code
+  static void jit_dbg(JitContext* ctx, uint val);
+  static void jit_outs(JitContext* ctx, uint addr);
+  static uint jit_block(JitContext* ctx, uint op, const uint* top);
+  static void jit_in(JitContext* ctx, uint size, uint addr);
+  static void jit_store(JitContext* ctx, uint addr, uint val);
+#endif
+  void execute_register();                                      // Run the program with the register engine
+  RegStatus run_register();                                     // Run register IR blocks from ip
+#ifdef SAM_FLAT_MEMORY
+  template<bool Metered>
+  void execute_flat();                                          // Run the program on flat memory
+  static FlatFault*& flat_fault();                              // This thread's FlatFault, if any
+  static struct sigaction& flat_old_action();                   // The SIGSEGV handler before ours
+  static void flat_signal(int sig, siginfo_t* info, void* context);
+#endif
+  bool load_code(std::ifstream& infile, uint64_t offset, uint64_t bytes, bool swap);
+  static void pack_words(const char* chars, size_t length, uint* words); // Pack chars into words, high byte first
+  template<bool Flat = false>
+  bool input_line(uint size, uint addr);                        // Run IN. False if the line doesn't fit flat memory.
+  template<bool Flat = false>
+  bool output_string(uint addr);                                // Run OUTS. False if the string runs off flat memory.
+  template<bool Flat = false>
+  bool block_memory(uint op, uint a, uint b, uint len, uint& result); // Run MEMCPY ... VCOUNT. False if off flat memory.
+
+  std::shared_ptr<Program> program;  // Code to run, and what the engines built from it. May be shared.
+  PagedMemory memory;                // Program memory
+#ifdef SAM_FLAT_MEMORY
+  FlatMemory flat;                   // Program memory instead of 'memory', if ok()
+  uint fault_ip;                     // Instruction being run on flat memory, in case it faults
+#endif
+  std::vector<uint> mn_stack;        // This is a stack-based VM. Values live in mn_stack[1..sp]; slot 0 is scratch
+  uint sp;                           // Number of values on the stack
+  uint stack_cap;                    // Maximum number of values on the stack
+  std::vector<uint64_t> profile_counts;
+  uint64_t fuel;                     // Jumps execute(fuel) may still run
+  bool waiting;                      // Whether execute(fuel) stopped at an IN for want of input
+
+  uint ip;
+};
+
+/*
+ * A program's code, and everything the engines build from it: the decoded stream, what the verifier
+ * proved, the JIT's native code and the register IR. Any number of VMs can run one Program (see
+ * VM::get_program() and VM::set_program()), each with its own stack, memory and ip. Each of those is
+ * built by the first VM that needs it, under a lock so that VMs on other threads can share the
+ * Program, and then used by all of them.
+ *
+ * A Program is never changed while anything else holds it. Building code on, loading into or optimizing
+ * a VM whose Program is shared gives that VM a copy of the code first.
+ */
+class Program
+{
+public:
+  explicit Program(std::vector<uint> code = std::vector<uint>());
+
+  const std::vector<uint>& get_code() const;
+
+private:
+  friend class VM;
+
+  void prepare();                                               // Decode and verify the code, if not done yet
+  void decode();                                                // Build the decoded stream from the code vector
+  void fuse();                                                  // Replace common sequences with superinstructions
+  VM::ErrorState check_code();                                  // Verify the code vector, see VM::verify()
+#ifdef SAM_JIT
+  const JitCode* jit();                                         // jit_code, compiled if need be. Null if it can't be.
+  void jit_compile();                                           // Compile the code vector into jit_code
+#endif
+  const RegisterCode* registers();                              // reg_code, translated if need be
+  void reg_compile();                                           // Translate the code vector into reg_code
+
+  std::vector<uint> code;            // Bytecode to run
+  std::mutex lock;                   // Held while building everything below
+  std::atomic<bool> prepared;        // Whether 'decoded' and the verifier's results are ready
+
+  std::vector<Instr> decoded;        // Pre-decoded form of 'code' run by the threaded engine
+  std::vector<int> decoded_index;    // Bytecode address -> index in 'decoded', or -1 if not an instruction boundary
+  VM::ErrorState verified;           // What check_code() found when 'code' was decoded. ERR_NONE if all is proven.
+  std::vector<int> verified_depth;   // Bytecode address -> stack depth on every path reaching it, or -1
+  uint max_depth;                    // Deepest the stack gets when starting from address 0 on an empty stack
+#ifdef SAM_JIT
+  std::shared_ptr<JitCode> jit_code;  // Native code for 'code', if ENGINE_JIT has compiled it
+#endif
+  std::shared_ptr<RegisterCode> reg_code; // Register IR for 'code', if ENGINE_REGISTER has translated it
+};
+
+
+Program::Program(std::vector<uint> code)
+  : code(std::move(code)), prepared(false), verified(VM::ERR_NONE), max_depth(0)
+{
+}
+
+const std::vector<uint>& Program::get_code() const
+{
+  return code;
+}
+
+void Program::prepare()
+{
+  if(prepared.load(std::memory_order_acquire)) return;
+
+  std::lock_guard<std::mutex> hold(lock);
+  if(prepared.load(std::memory_order_relaxed)) return;
+  decode();
+  prepared.store(true, std::memory_order_release);
+}
+
+#ifdef SAM_JIT
+const JitCode* Program::jit()
+{
+  prepare();
+
+  std::lock_guard<std::mutex> hold(lock);
+  if(!jit_code) jit_compile();
+  return jit_code.get();
+}
+#endif
+
+const RegisterCode* Program::registers()
+{
+  std::lock_guard<std::mutex> hold(lock);
+  if(!reg_code) reg_compile();
+  return reg_code.get();
+}
+
+
+VM::VM(uint stack_size)
+  : program(std::make_shared<Program>()), mn_stack(stack_size + 1), sp(0), stack_cap(stack_size), fuel(0), waiting(false)
+{
+  ip = 0;
+  trace = false;
+  profile = false;
+  bounds_checks = true;
+  output = std::make_shared<StreamSink>();
+  input = std::make_shared<StreamSource>();
+  engine = ENGINE_THREADED;
+  error_state = ERR_NONE;
+}
+
+void VM::clear()
+{
+  ip = 0;
+  error_state = ERR_NONE;
+
+  sp = 0;
+
+  // Clear the code and memory
+  memory.clear();
+#ifdef SAM_FLAT_MEMORY
+  flat.clear();
+#endif
+  program = std::make_shared<Program>();
+  profile_counts.clear();
+}
+
+void VM::reset()
+{
+  ip = 0;
+  error_state = ERR_NONE;
+
+  sp = 0;
+
+  memory.clear();
+#ifdef SAM_FLAT_MEMORY
+  flat.clear();
+#endif
+  profile_counts.clear();
+}
+
+uint VM::get_ip()
+{
+  return ip;
+}
+
+const std::vector<uint>& VM::get_code()
+{
+  return program->code;
+}
+
+std::shared_ptr<const Program> VM::get_program()
+{
+  return program;
+}
+
+// Attach a program that may be running on other VMs, too. The stack and memory are left as they are.
+void VM::set_program(std::shared_ptr<const Program> program)
+{
+  this->program = program ? std::const_pointer_cast<Program>(program) : std::make_shared<Program>();
+  ip = 0;
+  profile_counts.clear();
+}
+
+/*
+ * Program memory is shared page by page with the snapshot, copy-on-write, so taking one costs a copy of
+ * the stack and the page directories, and each page is copied again only when the VM, or a VM restored
+ * from the snapshot, first writes to it. Flat memory has no pages to share, and is copied whole.
+ */
+VM::Snapshot VM::snapshot()
+{
+  Snapshot saved;
+  saved.program = program;
+  saved.ip = ip;
+  saved.error_state = error_state;
+  saved.stack.assign(mn_stack.begin() + 1, mn_stack.begin() + 1 + sp);
+  saved.stack_cap = stack_cap;
+  saved.memory = std::make_shared<PagedMemory>(memory.share());
+#ifdef SAM_FLAT_MEMORY
+  if(flat.ok()) saved.flat = std::make_shared<const FlatMemory>(flat);
+#endif
+  return saved;
+}
+
+// Everything else about the VM, such as its engine, input and output, is left as it is
+void VM::restore(const Snapshot& snapshot)
+{
+  if(program != snapshot.program) profile_counts.clear();
+  program = snapshot.program;
+  ip = snapshot.ip;
+  error_state = snapshot.error_state;
+  mn_stack.resize(snapshot.stack_cap + 1);
+  stack_cap = snapshot.stack_cap;
+  std::copy(snapshot.stack.begin(), snapshot.stack.end(), mn_stack.begin() + 1);
+  sp = snapshot.stack.size();
+  memory = snapshot.memory->share();
+#ifdef SAM_FLAT_MEMORY
+  flat = snapshot.flat ? FlatMemory(*snapshot.flat) : FlatMemory();
+#endif
+}
+
+// The copy shares the program, input and output too, as a copy of a VM does
+VM VM::fork()
+{
+  PagedMemory mine(std::move(memory));          // So that copying the VM doesn't copy its memory
+  VM child(*this);
+  memory = std::move(mine);
+  child.memory = memory.share();
+  return child;
+}
+
+/*
+ * The code, for changing. Nobody else may see the change, so a Program that is shared is copied first.
+ * One that isn't, but has been run, is moved into a new Program, dropping what was built from it.
+ */
+std::vector<uint>& VM::edit()
+{
+  if(program.use_count() > 1) program = std::make_shared<Program>(program->code);
+  else if(program->prepared || program->reg_code) program = std::make_shared<Program>(std::move(program->code));
+  return program->code;
+}
+
+void VM::append(std::initializer_list<uint> words)
+{
+  std::vector<uint>& code = edit();
+  code.insert(code.end(), words);
+}
+
+// Peek at the top of the stack without popping it. Returns 0 if the stack is empty.
+uint VM::peek()
+{
+  return sp ? mn_stack[sp] : 0;
+}
+
+// Pop the top value of the stack. If it fails because it's empty, set the error_state
+bool VM::stack_pop()
+{
+  if(sp == 0)
+  {
+    error_state = ERR_POP_FAIL;
+    return false;
+  }
+  else
+  {
+    sp--;
+  }
+  return true;
+}
+
+const std::vector<uint64_t>& VM::get_profile()
+{
+  return profile_counts;
+}
+
+uint VM::get_stack_size()
+{
+  return stack_cap;
+}
+
+uint VM::get_stack_depth()
+{
+  return sp;
+}
+
+bool VM::set_stack_size(uint size)
+{
+  if(sp > size) return false;
+
+  mn_stack.resize(size + 1);
+  stack_cap = size;
+  return true;
+}
+
+// Switching between flat and paged memory empties it
+bool VM::use_flat_memory(uint64_t size)
+{
+#ifdef SAM_FLAT_MEMORY
+  if(size > ((uint64_t)1 << 32)) return false;
+
+  FlatMemory fresh;
+  if(size)
+  {
+    fresh = FlatMemory(size);
+    if(!fresh.ok()) return false;
+  }
+  flat = std::move(fresh);
+  memory.clear();
+  return true;
+#else
+  return size == 0;
+#endif
+}
+
+void VM::trace_line(uint addr, uint depth, uint top)
+{
+  output->flush();                              // So the previous instruction's output comes before this line
+  std::cout << '\n' << addr << "\t: " << program->code[addr] << "\tStack: ";
+
+  if(depth) std::cout << top;
+  else std::cout << "N/A";
+
+  std::cout << "\tOut: ";
+}
+
+/*
+ * The reference interpreter. On flat memory, memory accesses are plain array indexing, and may raise SIGSEGV
+ * instead; execute_flat() then resets ip to fault_ip. Memory instructions therefore read and write memory
+ * before changing sp, so the stack is left as it was before the faulting instruction.
+ */
+template<bool Flat>
+bool VM::cycle()
+{
+  uint opcode = program->code[ip];
+  uint val = 0;
+  uint addr = 0;
+#ifdef SAM_FLAT_MEMORY
+  if(Flat) fault_ip = ip;
+#endif
+  ip++;
+
+  if(trace) trace_line(ip - 1, sp, mn_stack[sp]);
+  if(profile) profile_counts[ip - 1]++;
+
+  // Make sure the stack holds enough operands for the instruction, or has room for its result.
+  // On failure ip is left on the faulting instruction.
+  if(opcode < OPCODE_END && sp < stack_need[opcode])
+  {
+    ip--;
+    error_state = ERR_POP_FAIL;
+    return false;
+  }
+  if(opcode < OPCODE_END && stack_effect[opcode] > 0 && sp >= stack_cap)
+  {
+    ip--;
+    error_state = ERR_STACK_OVERFLOW;
+    return false;
+  }
+
+  switch(opcode)
+  {
+  case PUSH:
+    mn_stack[++sp] = program->code[ip];
+    ip++;
+    break;
+
+  case POP:
+    sp--;
+    break;
+
+  case ADD:
+    val = mn_stack[sp--];
+    val += mn_stack[sp];
+    mn_stack[sp] = val;
+    break;
+
+  case SUB:
+    val = mn_stack[sp--];
+    val -= mn_stack[sp];
+    mn_stack[sp] = val;
+    break;
+
+  case MUL:
+    val = mn_stack[sp--];
+    val *= mn_stack[sp];
+    mn_stack[sp] = val;
+    break;
+
+  case DIV:
+    val = mn_stack[sp--];
+    val /= mn_stack[sp];
+    mn_stack[sp] = val;
+    break;
+
+  case MOD:
+    val = mn_stack[sp--];
+    val %= mn_stack[sp];
+    mn_stack[sp] = val;
+    break;
+
+  case INC:
+    mn_stack[sp]++;
+    break;
+
+  case DEC:
+    mn_stack[sp]--;
+    break;
+
+  case JGE:
+    val = program->code[ip];		// The value to compare to
+    ip++;
+    addr = program->code[ip];		// The address to jump to if true
+    ip++;			// Next opcode for next round
+    if(mn_stack[sp] >= val) ip = addr;	// If true, jump to the following address.
+    break;
+
+  case JGT:
+    val = program->code[ip];
+    ip++;
+    addr = program->code[ip];
+    ip++;
+    if(mn_stack[sp] > val) ip = addr;
+    break;
+
+  case JLE:
+    val = program->code[ip];
+    ip++;
+    addr = program->code[ip];
+    ip++;
+    if(mn_stack[sp] <= val) ip = addr;
+    break;
+
+  case JLT:
+    val = program->code[ip];
+    ip++;
+    addr = program->code[ip];
+    ip++;
+    if(mn_stack[sp] < val) ip = addr;
+    break;
+
+  case JEQ:
+    val = program->code[ip];
+    ip++;
+    addr = program->code[ip];
+    ip++;
+    if(mn_stack[sp] == val) ip = addr;
+    break;
+
+  case JMP:
+    ip = program->code[ip];
+    break;
+
+  case OUT:
+    // Since a null character (0x00) signals the end of a string in C++, null characters are not output.
+    output->put_chars(mn_stack[sp]);
+    break;
+
+  case IN:
+    val = program->code[ip];
+    ip++;
+    addr = program->code[ip];
+    ip++;
+    if(!input_line<Flat>(val, addr))
+    {
+#ifdef SAM_FLAT_MEMORY
+      ip = fault_ip;
+#endif
+      error_state = ERR_MEMORY_BOUNDS;
+      return false;
+    }
+    break;
+
+  case DBG:
+    output->put_hex(mn_stack[sp]);
+    break;
+
+  case STORE:
+    addr = program->code[ip];
+    ip++;
+    write_memory<Flat>(addr, mn_stack[sp]);
+    sp--;
+    break;
+
+  case LOAD:
+    addr = program->code[ip];
+    ip++;
+    val = read_memory<Flat>(addr);
+    mn_stack[++sp] = val;
+    break;
+
+  case SSTORE:
+    addr = mn_stack[sp];
+    val = mn_stack[sp - 1];
+    write_memory<Flat>(addr, val);
+    sp -= 2;
+    break;
+
+  case SLOAD:
+    addr = mn_stack[sp];
+    mn_stack[sp] = read_memory<Flat>(addr);
+    break;
+
+  case HALT:
+    return false;
+
+  case OUTS:
+    if(!output_string<Flat>(mn_stack[sp]))
+    {
+#ifdef SAM_FLAT_MEMORY
+      ip = fault_ip;
+#endif
+      error_state = ERR_MEMORY_BOUNDS;
+      return false;
+    }
+    break;
+
+  case MEMCPY:
+  case MEMSET:
+  case MEMCMP:
+  case VADD:
+  case VSUB:
+  case VMUL:
+  case VSUM:
+  case VCOUNT:
+    // The length is on top, with one or two values under it
+    if(!block_memory<Flat>(opcode, stack_need[opcode] > 2 ? mn_stack[sp - 2] : 0, mn_stack[sp - 1], mn_stack[sp], val))
+    {
+#ifdef SAM_FLAT_MEMORY
+      ip = fault_ip;
+#endif
+      error_state = ERR_MEMORY_BOUNDS;
+      return false;
+    }
+    sp -= stack_need[opcode];
+    if(stack_need[opcode] + stack_effect[opcode] > 0) mn_stack[++sp] = val;
+    break;
+
+  case ADDI:
+    mn_stack[sp] += program->code[ip];
+    ip++;
+    break;
+
+  case SUBI:
+    mn_stack[sp] -= program->code[ip];
+    ip++;
+    break;
+
+  case MULI:
+    mn_stack[sp] *= program->code[ip];
+    ip++;
+    break;
+
+  case DIVI:
+    mn_stack[sp] /= program->code[ip];
+    ip++;
+    break;
+
+  case MODI:
+    mn_stack[sp] %= program->code[ip];
+    ip++;
+    break;
+
+  case INCM:
+    addr = program->code[ip];
+    ip++;
+    write_memory<Flat>(addr, read_memory<Flat>(addr) + 1);
+    break;
+
+  case DECM:
+    addr = program->code[ip];
+    ip++;
+    write_memory<Flat>(addr, read_memory<Flat>(addr) - 1);
+    break;
+
+  case JSGE:
+    addr = program->code[ip];
+    ip++;
+    sp -= 2;
+    if(mn_stack[sp + 2] >= mn_stack[sp + 1]) ip = addr;
+    break;
+
+  case JSGT:
+    addr = program->code[ip];
+    ip++;
+    sp -= 2;
+    if(mn_stack[sp + 2] > mn_stack[sp + 1]) ip = addr;
+    break;
+
+  case JSLE:
+    addr = program->code[ip];
+    ip++;
+    sp -= 2;
+    if(mn_stack[sp + 2] <= mn_stack[sp + 1]) ip = addr;
+    break;
+
+  case JSLT:
+    addr = program->code[ip];
+    ip++;
+    sp -= 2;
+    if(mn_stack[sp + 2] < mn_stack[sp + 1]) ip = addr;
+    break;
+
+  case JSEQ:
+    addr = program->code[ip];
+    ip++;
+    sp -= 2;
+    if(mn_stack[sp + 2] == mn_stack[sp + 1]) ip = addr;
+    break;
+
+  case JSNE:
+    addr = program->code[ip];
+    ip++;
+    sp -= 2;
+    if(mn_stack[sp + 2] != mn_stack[sp + 1]) ip = addr;
+    break;
+  }
+
+  return true;
+}
+
+template<bool Flat>
+bool VM::metered_cycle()
+{
+  const uint op = ip < program->code.size() ? program->code[ip] : 0;
+  if(op == IN && !input->ready())
+  {
+    waiting = true;
+    return false;
+  }
+
+  const bool jump = is_jump(op);
+  if(!cycle<Flat>()) return false;
+  return !jump || --fuel > 0;
+}
+
+void VM::execute()
+{
+  if(profile && profile_counts.size() < program->code.size()) profile_counts.resize(program->code.size());
+
+#ifdef SAM_FLAT_MEMORY
+  if(flat.ok()) execute_flat<false>();          // Only cycle() runs on flat memory
+  else
+#endif
+  if(engine == ENGINE_SWITCH)
+  {
+    bool cyc = true;
+    while(ip < program->code.size() && cyc == true)
+      cyc = cycle();
+  }
+#ifdef SAM_JIT
+  else if(engine == ENGINE_JIT && !trace && !profile) execute_jit();
+#endif
+  else if(engine == ENGINE_REGISTER && !trace && !profile) execute_register();
+  else execute_threaded<false>();
+
+  output->flush();
+}
+
+/*
+ * Run for a while. Every jump instruction that runs, taken or not, uses one unit of fuel, so fuel counts
+ * the basic blocks run; straight-line code between jumps is free, since it can't run for longer than the
+ * code is. Once the last unit is used, execution stops with ip where that jump went, and execute() or
+ * execute(fuel) carries on from there exactly as if it had never stopped.
+ *
+ * It also stops at an IN whose input source isn't ready() (a QueueSource or FdSource with no whole line),
+ * with ip at the IN, rather than wait for input. The host can run something else, and carry on once there
+ * is a line.
+ *
+ * The switch and threaded engines are metered. ENGINE_JIT and ENGINE_REGISTER have no fuel check in the
+ * code they build, so they run the threaded engine instead, which stops in the same places.
+ */
+VM::RunState VM::execute(uint64_t fuel)
+{
+  if(profile && profile_counts.size() < program->code.size()) profile_counts.resize(program->code.size());
+
+  this->fuel = fuel;
+  waiting = false;
+  const ErrorState before = error_state;        // Left from earlier, e.g. by verify(). Not this run's.
+  error_state = ERR_NONE;
+  if(fuel > 0)
+  {
+#ifdef SAM_FLAT_MEMORY
+    if(flat.ok()) execute_flat<true>();
+    else
+#endif
+    if(engine == ENGINE_SWITCH) while(ip < program->code.size() && metered_cycle());
+    else execute_threaded<true>();
+
+    output->flush();
+  }
+
+  if(error_state != ERR_NONE) return RUN_ERROR;
+  error_state = before;
+  if(waiting) return RUN_WAITING;
+  return this->fuel == 0 && ip < program->code.size() ? RUN_OUT_OF_FUEL : RUN_HALTED;
+}
+
+/*
+ * For hosts that can't block, such as an event loop: run until the program halts or fails, or until
+ * an IN has no line to read, and then return RUN_WAITING with ip at the IN. It uses the metered engines
+ * with more fuel than could ever run out.
+ */
+VM::RunState VM::run()
+{
+  return execute(UINT64_MAX);
+}
+
+/*
+ * Queue a line for IN, for run() or execute(fuel) to read. If input isn't a QueueSource, it is replaced
+ * with a new one, and anything the old source had buffered is dropped.
+ */
+void VM::supply(const std::string& line)
+{
+  QueueSource* queue = dynamic_cast<QueueSource*>(input.get());
+  if(!queue)
+  {
+    std::shared_ptr<QueueSource> source = std::make_shared<QueueSource>();
+    queue = source.get();
+    input = source;
+  }
+  queue->push(line);
+}
+
+template<bool Metered>
+void VM::execute_threaded()
+{
+  if(trace || profile)                          // Debugging runs are always checked
+  {
+    if(trace && profile) execute<ExecPolicy<true, true, true, Metered> >();
+    else if(trace) execute<ExecPolicy<true, false, true, Metered> >();
+    else execute<ExecPolicy<false, true, true, Metered> >();
+  }
+  else if(!bounds_checks || stack_proven()) execute<ExecPolicy<false, false, false, Metered> >();
+  else execute<ExecPolicy<false, false, true, Metered> >();
+}
+
+/*
+ * The threaded engine has the same semantics as cycle(), but runs over the decoded stream built
+ * by decode(), and every handler ends with its own dispatch to the next one instead of returning
+ * to a single switch. With computed goto that is one indirect jump per handler, which the branch
+ * predictor can learn per opcode. Without it, SAM_OP and SAM_NEXT fall back to an ordinary
+ * switch inside a loop.
+ *
+ * Jumps to an address that decode() did not find an instruction at (the middle of an instruction,
+ * or past the end of the code) leave the decoded stream, and cycle() takes over until ip is back
+ * on an instruction boundary. cycle() goes by the run-time trace and profile flags, not Policy.
+ */
+template<class Policy>
+void VM::execute()
+{
+  program->prepare();
+  if(Policy::profile && profile_counts.size() < program->code.size()) profile_counts.resize(program->code.size());
+
+  while(ip < program->code.size())
+  {
+    if(program->decoded_index[ip] >= 0)
+    {
+      if(!run_decoded<Policy>(&program->decoded[program->decoded_index[ip]])) break;
+    }
+    else if(!(Policy::metered ? metered_cycle() : cycle())) break;
+  }
+
+  output->flush();
+}
+
+/*
+ * Translate the code vector into the decoded stream. Every instruction becomes one Instr holding
+ * its handler, its operands and, for jumps, a pointer to the Instr it jumps to, so the engine never
+ * touches 'code' or bumps ip for operands. decoded_index maps bytecode addresses back to Instrs.
+ * The stream ends with an OP_END sentinel, so the engine does not need to check for the end of code.
+ */
+void Program::decode()
+{
+  const size_t len = code.size();
+  std::vector<size_t> targets;
+
+  decoded.clear();
+  decoded_index.assign(len + 1, -1);
+
+  size_t at = 0;
+  while(at < len)
+  {
+    uint opcode = code[at];
+    Instr ins = { OP_INVALID, 0, 0, (uint)at, nullptr };
+    size_t size = 1;
+
+    if(opcode != 0 && opcode < OPCODE_END)
+    {
+      ins.op = opcode;
+      size += op_operands[opcode];
+    }
+    if(at + size > len) break;                  // A truncated last instruction is treated as the end of code
+    if(size > 1) ins.a = code[at + 1];
+    if(size > 2) ins.b = code[at + 2];
+
+    decoded_index[at] = decoded.size();
+    decoded.push_back(ins);
+    at += size;
+  }
+
+  Instr end = { OP_END, 0, 0, (uint)at, nullptr };
+  decoded_index[at] = decoded.size();
+  decoded.push_back(end);
+
+  // Resolve jump targets. Addresses that aren't instruction boundaries get an OP_EXIT stub of their own.
+  const size_t count = decoded.size();
+  targets.resize(count);
+  for(size_t i = 0; i < count; i++)
+  {
+    uint op = decoded[i].op;
+    if(!is_jump(op)) continue;
+
+    uint addr = target_operand(op) ? decoded[i].b : decoded[i].a;
+    if(addr <= len && decoded_index[addr] >= 0)
+      targets[i] = decoded_index[addr];
+    else
+    {
+      Instr stub = { OP_EXIT, 0, 0, addr, nullptr };
+      targets[i] = decoded.size();
+      decoded.push_back(stub);
+    }
+  }
+  for(size_t i = 0; i < count; i++)
+  {
+    uint op = decoded[i].op;
+    if(is_jump(op)) decoded[i].target = &decoded[targets[i]];
+  }
+
+  fuse();
+  verified = check_code();
+}
+
+/*
+ * The verifier. The code is well formed if every instruction is a known opcode with all its operands,
+ * and every jump goes to the start of an instruction or to the end of the code. Anything else is
+ * ERR_INVALID_INS. It then follows every path from address 0 with an empty stack, as if each branch
+ * could go either way, recording the stack depth at each instruction. The depth is proven if no
+ * instruction can find too few values, and every path into an instruction arrives with the same depth
+ * (so loops can't grow or shrink the stack). Otherwise the result is ERR_POP_FAIL or ERR_STACK_OVERFLOW.
+ * Whether the deepest point fits the stack is left to the caller, since the capacity can change.
+ */
+VM::ErrorState Program::check_code()
+{
+  const size_t len = code.size();
+  std::vector<bool> boundary(len + 1, false);
+
+  verified_depth.clear();
+  max_depth = 0;
+
+  for(size_t at = 0; at < len; at += 1 + op_operands[code[at]])
+  {
+    if(code[at] == 0 || code[at] >= OPCODE_END || at + 1 + op_operands[code[at]] > len) return VM::ERR_INVALID_INS;
+    boundary[at] = true;
+  }
+  boundary[len] = true;
+
+  for(size_t at = 0; at < len; at += 1 + op_operands[code[at]])
+  {
+    uint op = code[at];
+    if(!is_jump(op)) continue;
+    uint addr = code[at + 1 + target_operand(op)];
+    if(addr > len || !boundary[addr]) return VM::ERR_INVALID_INS;
+  }
+
+  verified_depth.assign(len + 1, -1);
+  verified_depth[0] = 0;
+  std::vector<uint> work(1, 0);
+  while(!work.empty())
+  {
+    uint at = work.back();
+    work.pop_back();
+    if(at == len) continue;
+
+    uint op = code[at];
+    int depth = verified_depth[at];
+    if(depth < stack_need[op]) return VM::ERR_POP_FAIL;
+    depth += stack_effect[op];
+    if((uint)depth > max_depth) max_depth = depth;
+
+    uint next[2];
+    int count = 0;
+    if(is_jump(op)) next[count++] = code[at + 1 + target_operand(op)];
+    if(op != JMP && op != HALT) next[count++] = at + 1 + op_operands[op];
+
+    for(int i = 0; i < count; i++)
+    {
+      if(verified_depth[next[i]] < 0)
+      {
+        verified_depth[next[i]] = depth;
+        work.push_back(next[i]);
+      }
+      else if(verified_depth[next[i]] != depth) return depth > verified_depth[next[i]] ? VM::ERR_STACK_OVERFLOW : VM::ERR_POP_FAIL;
+    }
+  }
+
+  return VM::ERR_NONE;
+}
+
+/*
+ * Returns true if the code is well formed and its stack is proven to stay within its capacity, setting
+ * error_state as check_code() describes otherwise. execute() does this by itself, and when it is proven,
+ * runs without stack checks whenever execution starts from a point the verifier followed, with the
+ * depth it proved for that point.
+ */
+bool VM::verify()
+{
+  program->prepare();
+
+  ErrorState result = program->verified;
+  if(result == ERR_NONE && program->max_depth > stack_cap) result = ERR_STACK_OVERFLOW;
+  if(result != ERR_NONE) error_state = result;
+  return result == ERR_NONE;
+}
+
+/*
+ * The peephole optimizer, for programs assembled or built through the API. It works on instructions
+ * rather than addresses, and only on well formed code (see check_code()); anything else is left alone
+ * and it returns false. Each pass:
+ *
+ *  - threads jumps whose target is a JMP straight to where that JMP goes,
+ *  - drops code that no path from address 0 (or from ip) reaches, such as the rest of a block after a
+ *    HALT or JMP,
+ *  - folds PUSH a followed by INC, DEC or ADDI ... MODI into a single PUSH,
+ *  - drops a JMP to the instruction after it,
+ *
+ * and when the stack is proven (see stack_proven()), so dropping a value can't hide an overflow or
+ * underflow that would have happened, also:
+ *
+ *  - folds PUSH a / PUSH b / ADD ... MOD into a single PUSH,
+ *  - turns PUSH a / ADD and PUSH a / MUL into ADDI a and MULI a,
+ *  - drops PUSH a / POP pairs, and JGE ... JEQ to the instruction after them.
+ *
+ * Sequences are only folded if nothing jumps into the middle of them, and a divide by a constant 0 is
+ * left for run time. When no pass changes anything more, the code is compacted and every jump address,
+ * and ip, is rewritten to match. Addresses change, so anything kept from before (profile counts, the
+ * result of get_ip()) refers to the old code.
+ */
+bool VM::optimize()
+{
+  program->prepare();
+  if(program->verified == ERR_INVALID_INS || ip > program->code.size() || (ip < program->code.size() && program->decoded_index[ip] < 0)) return false;
+
+  const bool proven = stack_proven();
+  const size_t len = program->code.size();
+
+  struct Op
+  {
+    uint op, a, b;
+    uint target;                // Index of the instruction a jump goes to, 'count' for the end of code
+    bool live;
+  };
+  std::vector<Op> ops;
+  std::vector<uint> index(len + 1);               // Address -> instruction index
+  for(size_t at = 0; at < len; at += 1 + op_operands[program->code[at]])
+  {
+    uint op = program->code[at];
+    Op ins = { op, op_operands[op] > 0 ? program->code[at + 1] : 0, op_operands[op] > 1 ? program->code[at + 2] : 0, 0, true };
+    index[at] = ops.size();
+    ops.push_back(ins);
+  }
+  const uint count = ops.size();
+  index[len] = count;
+  for(Op& ins : ops)
+    if(is_jump(ins.op)) ins.target = index[target_operand(ins.op) ? ins.b : ins.a];
+
+  // Dropped instructions are no-ops, or never reached, so a jump to one goes on to the next that's live
+  auto follow = [&](uint i) { while(i < count && !ops[i].live) i++; return i; };
+  auto next = [&](uint i) { return follow(i + 1); };
+  const uint start = index[ip];
+
+  bool changed = true;
+  while(changed)
+  {
+    changed = false;
+
+    for(Op& ins : ops)
+    {
+      if(!ins.live || !is_jump(ins.op)) continue;
+      uint to = follow(ins.target);
+      for(uint hops = 0; to < count && ops[to].op == JMP && hops < count; hops++) to = follow(ops[to].target);
+      ins.target = to;
+    }
+
+    std::vector<bool> reached(count + 1, false), target(count + 1, false);
+    std::vector<uint> work;
+    work.push_back(follow(0));
+    work.push_back(follow(start));
+    target[follow(start)] = true;               // Execution resumes there, so nothing may be folded into it
+    while(!work.empty())
+    {
+      uint i = work.back();
+      work.pop_back();
+      if(reached[i]) continue;
+      reached[i] = true;
+      if(i == count) continue;
+
+      uint op = ops[i].op;
+      if(is_jump(op))
+      {
+        target[ops[i].target] = true;
+        work.push_back(ops[i].target);
+      }
+      if(op != JMP && op != HALT) work.push_back(next(i));
+    }
+    for(uint i = 0; i < count; i++)
+    {
+      if(ops[i].live && !reached[i])
+      {
+        ops[i].live = false;
+        changed = true;
+      }
+    }
+
+    uint i = follow(0);
+    while(i < count)
+    {
+      Op& first = ops[i];
+      uint j = next(i);
+      uint k = j < count ? next(j) : count;
+
+      if(is_jump(first.op) && follow(first.target) == j && (first.op == JMP || (proven && first.op < JMP)))
+      {
+        first.live = false;
+      }
+      else if(first.op != PUSH || j == count || target[j])
+      {
+        i = j;
+        continue;
+      }
+      else if(ops[j].op == INC || ops[j].op == DEC ||
+              (ops[j].op >= ADDI && ops[j].op <= MODI && !(ops[j].op >= DIVI && ops[j].a == 0)))
+      {
+        uint val = ops[j].a;
+        switch(ops[j].op)
+        {
+        case INC: first.a++; break;
+        case DEC: first.a--; break;
+        case ADDI: first.a += val; break;
+        case SUBI: first.a -= val; break;
+        case MULI: first.a *= val; break;
+        case DIVI: first.a /= val; break;
+        default: first.a %= val; break;
+        }
+        ops[j].live = false;
+      }
+      else if(!proven)
+      {
+        i = j;
+        continue;
+      }
+      else if(ops[j].op == POP)
+      {
+        first.live = ops[j].live = false;
+      }
+      else if(ops[j].op == PUSH && k < count && !target[k] && ops[k].op >= ADD && ops[k].op <= MOD &&
+              !((ops[k].op == DIV || ops[k].op == MOD) && first.a == 0))
+      {
+        uint t = ops[j].a, s = first.a;         // Applied as 'top op second'
+        switch(ops[k].op)
+        {
+        case ADD: first.a = t + s; break;
+        case SUB: first.a = t - s; break;
+        case MUL: first.a = t * s; break;
+        case DIV: first.a = t / s; break;
+        default: first.a = t % s; break;
+        }
+        ops[j].live = ops[k].live = false;
+      }
+      else if(ops[j].op == ADD || ops[j].op == MUL)
+      {
+        first.op = ops[j].op == ADD ? ADDI : MULI;
+        ops[j].live = false;
+      }
+      else
+      {
+        i = j;
+        continue;
+      }
+
+      // Look at the same place again, in case it folds further. If 'first' went, jumps to it go on.
+      changed = true;
+      uint at = follow(i);
+      if(target[i]) target[at] = true;
+      i = at;
+    }
+  }
+
+  std::vector<uint> addr(count + 1, 0);
+  uint at = 0;
+  for(uint i = 0; i < count; i++)
+  {
+    addr[i] = at;
+    if(ops[i].live) at += 1 + op_operands[ops[i].op];
+  }
+  addr[count] = at;
+
+  std::vector<uint> out;
+  out.reserve(at);
+  for(uint i = 0; i < count; i++)
+  {
+    const Op& ins = ops[i];
+    if(!ins.live) continue;
+    out.push_back(ins.op);
+    if(is_jump(ins.op))
+    {
+      uint to = addr[follow(ins.target)];
+      if(target_operand(ins.op)) out.push_back(ins.a);
+      out.push_back(to);
+    }
+    else
+    {
+      if(op_operands[ins.op] > 0) out.push_back(ins.a);
+      if(op_operands[ins.op] > 1) out.push_back(ins.b);
+    }
+  }
+
+  ip = addr[follow(start)];
+  edit().swap(out);
+  profile_counts.clear();
+  return true;
+}
+
+bool VM::stack_proven()
+{
+  program->prepare();
+
+  return program->verified == ERR_NONE && program->max_depth <= stack_cap && ip <= program->code.size() && program->verified_depth[ip] == (int)sp;
+}
+
+/*
+ * Replace common instruction sequences in the decoded stream with superinstructions, so each costs one
+ * dispatch. A sequence is only fused if nothing jumps into the middle of it. The Instrs it replaces stay
+ * in place behind the superinstruction: if the superinstruction can't complete (a stack check fails), it
+ * runs the sequence one instruction at a time instead, so errors are reported exactly as without fusion.
+ * That also covers execution resuming in the middle of a fused sequence.
+ */
+void Program::fuse()
+{
+  const size_t len = code.size();
+  std::vector<bool> is_target(len + 1, false);
+  size_t count = 0;
+
+  while(decoded[count].op != OP_END) count++;  // Stubs after OP_END are never fused
+  for(size_t i = 0; i < count; i++)
+  {
+    uint op = decoded[i].op;
+    uint addr = target_operand(op) ? decoded[i].b : decoded[i].a;
+    if(is_jump(op) && addr <= len) is_target[addr] = true;
+  }
+
+  for(size_t i = 0; i < count; i++)
+  {
+    Instr* in = &decoded[i];
+    size_t left = count - i;
+
+    // in[1] is never a jump target in any of the patterns below; in[2] is checked where used
+    if(left < 2 || is_target[in[1].addr]) continue;
+
+    if(left >= 3 && !is_target[in[2].addr] && in[0].op == PUSH && in[1].op == OUT && in[2].op == POP)
+    {
+      in->op = OP_PUSH_OUT_POP;
+      i += 2;
+    }
+    else if(left >= 3 && !is_target[in[2].addr] && in[0].op == LOAD && in[1].op == INC && in[2].op == STORE)
+    {
+      in->op = OP_LOAD_INC_STORE;
+      in->b = in[2].a;
+      i += 2;
+    }
+    else if(in[0].op == LOAD && in[1].op == SLOAD)
+    {
+      in->op = OP_LOAD_SLOAD;
+      i += 1;
+    }
+    else if(in[0].op == PUSH && in[1].op == ADD)
+    {
+      in->op = OP_PUSH_ADD;
+      i += 1;
+    }
+  }
+}
+
+// SAM_OP starts the handler of a bytecode instruction, which runs the policy's hooks first.
+// SAM_INTERNAL starts the handler of an op that only exists in the decoded stream.
+#ifdef SAM_COMPUTED_GOTO
+#define SAM_INTERNAL(op) op_##op:
+#define SAM_DISPATCH()  goto *dispatch[pc->op]
+#define SAM_UNFUSE(op)  goto *dispatch[op]
+#else
+#define SAM_INTERNAL(op) case op:
+#define SAM_DISPATCH()  { opcode = pc->op; continue; }
+#define SAM_UNFUSE(op)  { opcode = op; continue; }
+#endif
+#define SAM_OP(op)      SAM_INTERNAL(op) \
+                        if(Policy::trace) trace_line(pc->addr, top - base, tos); \
+                        if(Policy::profile) profile_counts[pc->addr]++;
+// Not wrapped in do/while, since 'continue' has to reach the switch loop
+#define SAM_NEXT()      { pc++; SAM_DISPATCH(); }
+#define SAM_BRANCH(c)   { pc = (c) ? pc->target : pc + 1; if(Policy::metered && --fuel_left == 0) goto stop; SAM_DISPATCH(); }
+// Pop two values, and branch if 'top <cmp> the one under it'
+#define SAM_STACK_BRANCH(cmp) \
+  SAM_NEED(2); \
+  val = tos; \
+  top -= 2; \
+  tos = *top; \
+  SAM_BRANCH(val cmp top[1])
+
+// Run the decoded stream from 'pc'. Returns true if execution left through an OP_EXIT stub and
+// should carry on in cycle(), false if it halted, reached the end of code, failed or ran out of fuel.
+template<class Policy>
+bool VM::run_decoded(const Instr* pc)
+{
+  bool resume = false;
+
+  // The top of the stack is cached in 'tos' for the whole run. 'top' points at the slot it belongs in,
+  // so the values below it are top[-1], top[-2]... and the depth is top - base. Pushing spills tos into
+  // *top first. When the stack is empty, top points at the scratch slot 0, so spilling there is harmless.
+  uint* const base = mn_stack.data();
+  uint* const full = base + stack_cap;
+  uint* top = base + sp;
+  uint tos = *top;
+  uint val = 0;
+  uint64_t fuel_left = fuel;
+  OutputSink& out = *output;
+#ifndef SAM_COMPUTED_GOTO
+  uint opcode = pc->op;
+#endif
+
+// Underflow and overflow checks are one compare against a fixed pointer, done before the handler
+// changes anything, so pc is still the faulting instruction.
+#define SAM_NEED(n)     if(Policy::checked && top < base + (n)) goto underflow
+#define SAM_ROOM()      if(Policy::checked && top >= full) goto overflow
+#define SAM_READ(addr)  memory.read(addr)        // Memory never written reads 0, even past the page directory
+#define SAM_PUSH(v)     do { *top++ = tos; tos = (v); } while(0)
+
+#ifdef SAM_COMPUTED_GOTO
+  // Indexed by decoded op.
+  static const void* dispatch[] =
+  {
+    &&op_OP_INVALID, &&op_PUSH, &&op_POP, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_MOD,
+    &&op_INC, &&op_DEC, &&op_JGE, &&op_JGT, &&op_JLE, &&op_JLT, &&op_JEQ, &&op_JMP,
+    &&op_OUT, &&op_IN, &&op_DBG, &&op_STORE, &&op_LOAD, &&op_SSTORE, &&op_SLOAD, &&op_HALT,
+    &&op_OUTS, &&op_MEMCPY, &&op_MEMSET, &&op_MEMCMP, &&op_VADD, &&op_VSUB, &&op_VMUL, &&op_VSUM,
+    &&op_VCOUNT, &&op_ADDI, &&op_SUBI, &&op_MULI, &&op_DIVI, &&op_MODI, &&op_INCM, &&op_DECM,
+    &&op_JSGE, &&op_JSGT, &&op_JSLE, &&op_JSLT, &&op_JSEQ, &&op_JSNE,
+    &&op_OP_END, &&op_OP_EXIT,
+    &&op_OP_PUSH_OUT_POP, &&op_OP_LOAD_INC_STORE, &&op_OP_LOAD_SLOAD, &&op_OP_PUSH_ADD
+  };
+
+  SAM_DISPATCH();
+  {
+#else
+  for(;;)
+  {
+    switch(opcode)
+    {
+#endif
+  SAM_OP(OP_INVALID)
+    SAM_NEXT();                 // cycle() silently skips unknown opcodes as well
+
+  SAM_OP(PUSH)
+    SAM_ROOM();
+    SAM_PUSH(pc->a);
+    SAM_NEXT();
+
+  SAM_OP(POP)
+    SAM_NEED(1);
+    tos = *--top;
+    SAM_NEXT();
+
+  SAM_OP(ADD)
+    SAM_NEED(2);
+    tos += *--top;
+    SAM_NEXT();
+
+  SAM_OP(SUB)
+    SAM_NEED(2);
+    tos -= *--top;
+    SAM_NEXT();
+
+  SAM_OP(MUL)
+    SAM_NEED(2);
+    tos *= *--top;
+    SAM_NEXT();
+
+  SAM_OP(DIV)
+    SAM_NEED(2);
+    tos /= *--top;
+    SAM_NEXT();
+
+  SAM_OP(MOD)
+    SAM_NEED(2);
+    tos %= *--top;
+    SAM_NEXT();
+
+  SAM_OP(INC)
+    SAM_NEED(1);
+    tos++;
+    SAM_NEXT();
+
+  SAM_OP(DEC)
+    SAM_NEED(1);
+    tos--;
+    SAM_NEXT();
+
+  SAM_OP(JGE)
+    SAM_NEED(1);
+    SAM_BRANCH(tos >= pc->a);
+
+  SAM_OP(JGT)
+    SAM_NEED(1);
+    SAM_BRANCH(tos > pc->a);
+
+  SAM_OP(JLE)
+    SAM_NEED(1);
+    SAM_BRANCH(tos <= pc->a);
+
+  SAM_OP(JLT)
+    SAM_NEED(1);
+    SAM_BRANCH(tos < pc->a);
+
+  SAM_OP(JEQ)
+    SAM_NEED(1);
+    SAM_BRANCH(tos == pc->a);
+
+  SAM_OP(JMP)
+    SAM_BRANCH(true);
+
+  SAM_OP(OUT)
+    SAM_NEED(1);
+    out.put_chars(tos);
+    SAM_NEXT();
+
+  SAM_OP(IN)
+    if(Policy::metered && !input->ready())
+    {
+      waiting = true;
+      goto stop;
+    }
+    input_line(pc->a, pc->b);
+    SAM_NEXT();
+
+  SAM_OP(DBG)
+    SAM_NEED(1);
+    out.put_hex(tos);
+    SAM_NEXT();
+
+  SAM_OP(STORE)
+    SAM_NEED(1);
+    memory.write(pc->a, tos);
+    tos = *--top;
+    SAM_NEXT();
+
+  SAM_OP(LOAD)
+    SAM_ROOM();
+    SAM_PUSH(SAM_READ(pc->a));
+    SAM_NEXT();
+
+  SAM_OP(SSTORE)
+  {
+    SAM_NEED(2);
+    uint addr = tos;
+    val = *--top;
+    tos = *--top;
+    memory.write(addr, val);
+    SAM_NEXT();
+  }
+
+  SAM_OP(SLOAD)
+    SAM_NEED(1);
+    tos = SAM_READ(tos);
+    SAM_NEXT();
+
+  SAM_OP(HALT)
+    pc++;                       // Like cycle(), ip ends up after the HALT
+    goto stop;
+
+  SAM_OP(OUTS)
+    SAM_NEED(1);
+    output_string(tos);
+    SAM_NEXT();
+
+  SAM_OP(MEMCPY) goto block;
+  SAM_OP(MEMSET) goto block;
+  SAM_OP(MEMCMP) goto block;
+  SAM_OP(VADD) goto block;
+  SAM_OP(VSUB) goto block;
+  SAM_OP(VMUL) goto block;
+  SAM_OP(VSUM) goto block;
+  SAM_OP(VCOUNT) goto block;
+  block:                        // The length in tos, with one or two values under it
+  {
+    const uint need = stack_need[pc->op];
+    SAM_NEED(need);
+    block_memory(pc->op, need > 2 ? top[-2] : 0, top[-1], tos, val);
+    top -= need - 1;
+    if(need + stack_effect[pc->op] > 0) tos = val;
+    else tos = *--top;
+    SAM_NEXT();
+  }
+
+  SAM_OP(ADDI)
+    SAM_NEED(1);
+    tos += pc->a;
+    SAM_NEXT();
+
+  SAM_OP(SUBI)
+    SAM_NEED(1);
+    tos -= pc->a;
+    SAM_NEXT();
+
+  SAM_OP(MULI)
+    SAM_NEED(1);
+    tos *= pc->a;
+    SAM_NEXT();
+
+  SAM_OP(DIVI)
+    SAM_NEED(1);
+    tos /= pc->a;
+    SAM_NEXT();
+
+  SAM_OP(MODI)
+    SAM_NEED(1);
+    tos %= pc->a;
+    SAM_NEXT();
+
+  SAM_OP(INCM)
+    memory.write(pc->a, SAM_READ(pc->a) + 1);
+    SAM_NEXT();
+
+  SAM_OP(DECM)
+    memory.write(pc->a, SAM_READ(pc->a) - 1);
+    SAM_NEXT();
+
+  SAM_OP(JSGE)
+    SAM_STACK_BRANCH(>=);
+
+  SAM_OP(JSGT)
+    SAM_STACK_BRANCH(>);
+
+  SAM_OP(JSLE)
+    SAM_STACK_BRANCH(<=);
+
+  SAM_OP(JSLT)
+    SAM_STACK_BRANCH(<);
+
+  SAM_OP(JSEQ)
+    SAM_STACK_BRANCH(==);
+
+  SAM_OP(JSNE)
+    SAM_STACK_BRANCH(!=);
+
+  SAM_INTERNAL(OP_END)
+    goto stop;
+
+  SAM_INTERNAL(OP_EXIT)
+    resume = true;
+    goto stop;
+
+  SAM_INTERNAL(OP_PUSH_OUT_POP)
+    if(Policy::trace || Policy::profile || (Policy::checked && top >= full)) SAM_UNFUSE(PUSH);
+    out.put_chars(pc->a);
+    pc += 3;
+    SAM_DISPATCH();
+
+  SAM_INTERNAL(OP_LOAD_INC_STORE)
+    if(Policy::trace || Policy::profile || (Policy::checked && top >= full)) SAM_UNFUSE(LOAD);
+    val = SAM_READ(pc->a) + 1;
+    memory.write(pc->b, val);
+    pc += 3;
+    SAM_DISPATCH();
+
+  SAM_INTERNAL(OP_LOAD_SLOAD)
+    if(Policy::trace || Policy::profile || (Policy::checked && top >= full)) SAM_UNFUSE(LOAD);
+    val = SAM_READ(pc->a);
+    SAM_PUSH(SAM_READ(val));
+    pc += 2;
+    SAM_DISPATCH();
+
+  SAM_INTERNAL(OP_PUSH_ADD)
+    if(Policy::trace || Policy::profile || (Policy::checked && (top >= full || top < base + 1))) SAM_UNFUSE(PUSH);
+    tos += pc->a;
+    pc += 2;
+    SAM_DISPATCH();
+#ifndef SAM_COMPUTED_GOTO
+    }
+#endif
+  }
+
+underflow:
+  error_state = ERR_POP_FAIL;
+  goto stop;
+
+overflow:
+  error_state = ERR_STACK_OVERFLOW;
+
+stop:
+  *top = tos;
+  sp = top - base;
+  ip = pc->addr;
+  if(Policy::metered) fuel = fuel_left;
+  return resume;
+}
+
+#undef SAM_NEED
+#undef SAM_ROOM
+#undef SAM_PUSH
+#undef SAM_READ
+#undef SAM_OP
+#undef SAM_INTERNAL
+#undef SAM_DISPATCH
+#undef SAM_UNFUSE
+#undef SAM_NEXT
+#undef SAM_BRANCH
+#undef SAM_STACK_BRANCH
+
+#ifdef SAM_JIT
+/*
+ * The JIT translates the whole program into x86-64 code in one mmap'd buffer, laid out basic block by basic
+ * block; blocks start at address 0, at jump targets, and after jumps and HALT. While native code runs:
+ *
+ *   rbx   JitContext*          r12   stack pointer ('top')        r13d  cached top of stack ('tos')
+ *   r14   stack base           r15   end of the stack
+ *
+ * This is the same stack layout the threaded engine uses. OUT, IN, DBG and stores to pages that aren't
+ * writable yet call back into the VM. Other memory accesses look the page up in the page directories
+ * directly; the directories are reloaded from the context each time, since callbacks may move them.
+ *
+ * Each block remembers how deep it has already checked the stack, and leaves out checks that can't fail.
+ * Blocks can therefore only be entered at the top; execute_jit() uses cycle() to get to the next block
+ * when it needs to start anywhere else.
+ */
+void Program::jit_compile()
+{
+  const size_t len = code.size();
+  const uint8_t ctx_top = offsetof(JitContext, top);
+  const uint8_t ctx_base = offsetof(JitContext, base);
+  const uint8_t ctx_full = offsetof(JitContext, full);
+  const uint8_t ctx_rdir = offsetof(JitContext, rdir);
+  const uint8_t ctx_wdir = offsetof(JitContext, wdir);
+  const uint8_t ctx_pages = offsetof(JitContext, pages);
+  const uint8_t ctx_ip = offsetof(JitContext, ip);
+
+  struct Exit
+  {
+    size_t from;                // Jump displacement to patch
+    uint ip;
+    uint status;
+  };
+
+  JitAssembler as;
+  std::vector<bool> leader(len + 1, false);
+  std::vector<size_t> native(len + 1, 0);
+  std::vector<std::pair<size_t, uint> > jumps;  // Jump displacement to patch, and bytecode address it goes to
+  std::vector<Exit> exits;
+  std::vector<size_t> to_epilogue;
+  int known = 0;                                // Stack depth already checked in this block
+
+  // Prologue: uint entry(JitContext* rdi, const void* rsi)
+  as.bytes({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });   // push rbx, r12, r13, r14, r15
+  as.bytes({ 0x48, 0x89, 0xFB });                                       // mov rbx, rdi
+  as.bytes({ 0x4C, 0x8B, 0x63, ctx_top });                              // mov r12, [rbx + top]
+  as.bytes({ 0x45, 0x8B, 0x2C, 0x24 });                                 // mov r13d, [r12]
+  as.bytes({ 0x4C, 0x8B, 0x73, ctx_base });                             // mov r14, [rbx + base]
+  as.bytes({ 0x4C, 0x8B, 0x7B, ctx_full });                             // mov r15, [rbx + full]
+  as.bytes({ 0xFF, 0xE6 });                                             // jmp rsi
+
+  // Epilogue, returning the status in eax
+  const size_t epilogue = as.here();
+  as.bytes({ 0x45, 0x89, 0x2C, 0x24 });                                 // mov [r12], r13d
+  as.bytes({ 0x4C, 0x89, 0x63, ctx_top });                              // mov [rbx + top], r12
+  as.bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B });   // pop r15, r14, r13, r12, rbx
+  as.bytes({ 0xC3 });                                                   // ret
+
+  auto leave = [&](uint ip, uint status)
+  {
+    as.bytes({ 0xC7, 0x43, ctx_ip });                                   // mov dword [rbx + ip], ip
+    as.imm32(ip);
+    as.bytes({ 0xB8 });                                                 // mov eax, status
+    as.imm32(status);
+    to_epilogue.push_back(as.jump(-1));
+  };
+  auto need = [&](int n, uint addr)
+  {
+    if(known >= n) return;
+    as.bytes({ 0x49, 0x8D, 0x46, (uint8_t)(n * sizeof(uint)) });        // lea rax, [r14 + n]
+    as.bytes({ 0x49, 0x39, 0xC4 });                                     // cmp r12, rax
+    exits.push_back(Exit { as.jump(CC_B), addr, JIT_UNDERFLOW });
+    known = n;
+  };
+  auto room = [&](uint addr)
+  {
+    as.bytes({ 0x4D, 0x39, 0xFC });                                     // cmp r12, r15
+    exits.push_back(Exit { as.jump(CC_AE), addr, JIT_OVERFLOW });
+  };
+  auto push_tos = [&]
+  {
+    as.bytes({ 0x45, 0x89, 0x2C, 0x24 });                               // mov [r12], r13d
+    as.bytes({ 0x49, 0x83, 0xC4, 0x04 });                               // add r12, 4
+  };
+  auto pop_tos = [&]
+  {
+    as.bytes({ 0x49, 0x83, 0xEC, 0x04 });                               // sub r12, 4
+    as.bytes({ 0x45, 0x8B, 0x2C, 0x24 });                               // mov r13d, [r12]
+  };
+  auto call = [&](uint64_t fn)
+  {
+    as.bytes({ 0x48, 0xB8 });                                           // mov rax, fn
+    as.imm64(fn);
+    as.bytes({ 0xFF, 0xD0 });                                           // call rax
+  };
+  auto jump_to = [&](int cc, uint target)
+  {
+    if(target <= len && decoded_index[target] >= 0) jumps.push_back(std::make_pair(as.jump(cc), target));
+    else exits.push_back(Exit { as.jump(cc), target, JIT_FALLBACK });
+  };
+  // Page number of eax into edx
+  auto page_of = [&]
+  {
+    as.bytes({ 0x89, 0xC2 });                                           // mov edx, eax
+    as.bytes({ 0xC1, 0xEA, (uint8_t)PagedMemory::page_bits });          // shr edx, page_bits
+    as.bytes({ 0x48, 0x3B, 0x53, ctx_pages });                          // cmp rdx, [rbx + pages]
+  };
+  // r13d = memory[eax], or 0 past the page directory
+  auto read = [&]
+  {
+    page_of();
+    size_t past_end = as.jump(CC_AE);
+    as.bytes({ 0x48, 0x8B, 0x4B, ctx_rdir });                           // mov rcx, [rbx + rdir]
+    as.bytes({ 0x48, 0x8B, 0x0C, 0xD1 });                               // mov rcx, [rcx + rdx * 8]
+    as.bytes({ 0x25 });                                                 // and eax, page_mask
+    as.imm32(PagedMemory::page_mask);
+    as.bytes({ 0x44, 0x8B, 0x2C, 0x81 });                               // mov r13d, [rcx + rax * 4]
+    size_t done = as.jump(-1);
+    as.patch(past_end, as.here());
+    as.bytes({ 0x45, 0x31, 0xED });                                     // xor r13d, r13d
+    as.patch(done, as.here());
+  };
+  // memory[eax] = r13d, or ecx if from_ecx. If the page isn't writable yet, jit_store() allocates it.
+  auto write = [&](bool from_ecx)
+  {
+    page_of();
+    size_t past_end = as.jump(CC_AE);
+    as.bytes({ 0x4C, 0x8B, 0x43, ctx_wdir });                           // mov r8, [rbx + wdir]
+    as.bytes({ 0x4D, 0x8B, 0x04, 0xD0 });                               // mov r8, [r8 + rdx * 8]
+    as.bytes({ 0x4D, 0x85, 0xC0 });                                     // test r8, r8
+    size_t no_page = as.jump(CC_E);
+    as.bytes({ 0x89, 0xC2 });                                           // mov edx, eax
+    as.bytes({ 0x81, 0xE2 });                                           // and edx, page_mask
+    as.imm32(PagedMemory::page_mask);
+    if(from_ecx) as.bytes({ 0x41, 0x89, 0x0C, 0x90 });                  // mov [r8 + rdx * 4], ecx
+    else as.bytes({ 0x45, 0x89, 0x2C, 0x90 });                          // mov [r8 + rdx * 4], r13d
+    size_t done = as.jump(-1);
+    as.patch(past_end, as.here());
+    as.patch(no_page, as.here());
+    as.bytes({ 0x48, 0x89, 0xDF });                                     // mov rdi, rbx
+    as.bytes({ 0x89, 0xC6 });                                           // mov esi, eax
+    if(from_ecx) as.bytes({ 0x89, 0xCA });                              // mov edx, ecx
+    else as.bytes({ 0x44, 0x89, 0xEA });                                // mov edx, r13d
+    call((uint64_t)(uintptr_t)&VM::jit_store);
+    as.patch(done, as.here());
+  };
+
+  // Find the basic blocks
+  size_t count = 0;
+  while(decoded[count].op != OP_END) count++;
+  const uint end = decoded[count].addr;
+  leader[0] = leader[end] = true;
+  for(size_t i = 0; i < count; i++)
+  {
+    uint at = decoded[i].addr;
+    uint op = code[at];
+    if(is_jump(op))
+    {
+      uint target = target_operand(op) ? decoded[i].b : decoded[i].a;
+      if(target <= len) leader[target] = true;
+      leader[decoded[i + 1].addr] = true;
+    }
+    else if(op == HALT) leader[decoded[i + 1].addr] = true;
+  }
+
+  for(size_t i = 0; i < count; i++)
+  {
+    const uint at = decoded[i].addr;
+    const uint op = code[at];
+    const uint a = decoded[i].a;
+    const uint b = (op == LOAD) ? 0 : decoded[i].b;   // A fused LOAD keeps another operand in b
+
+    native[at] = as.here();
+    if(leader[at]) known = 0;
+
+    switch(op)
+    {
+    case PUSH:
+      room(at);
+      push_tos();
+      as.bytes({ 0x41, 0xBD });                                         // mov r13d, a
+      as.imm32(a);
+      break;
+
+    case POP:
+      need(1, at);
+      pop_tos();
+      break;
+
+    case ADD:
+    case SUB:
+    case MUL:
+      need(2, at);
+      as.bytes({ 0x49, 0x83, 0xEC, 0x04 });                             // sub r12, 4
+      if(op == ADD) as.bytes({ 0x45, 0x03, 0x2C, 0x24 });               // add r13d, [r12]
+      else if(op == SUB) as.bytes({ 0x45, 0x2B, 0x2C, 0x24 });          // sub r13d, [r12]
+      else as.bytes({ 0x45, 0x0F, 0xAF, 0x2C, 0x24 });                  // imul r13d, [r12]
+      break;
+
+    case DIV:
+    case MOD:
+      need(2, at);
+      as.bytes({ 0x49, 0x83, 0xEC, 0x04 });                             // sub r12, 4
+      as.bytes({ 0x44, 0x89, 0xE8 });                                   // mov eax, r13d
+      as.bytes({ 0x31, 0xD2 });                                         // xor edx, edx
+      as.bytes({ 0x41, 0xF7, 0x34, 0x24 });                             // div dword [r12]
+      if(op == DIV) as.bytes({ 0x41, 0x89, 0xC5 });                     // mov r13d, eax
+      else as.bytes({ 0x41, 0x89, 0xD5 });                              // mov r13d, edx
+      break;
+
+    case INC:
+      need(1, at);
+      as.bytes({ 0x41, 0x83, 0xC5, 0x01 });                             // add r13d, 1
+      break;
+
+    case DEC:
+      need(1, at);
+      as.bytes({ 0x41, 0x83, 0xED, 0x01 });                             // sub r13d, 1
+      break;
+
+    case JGE:
+    case JGT:
+    case JLE:
+    case JLT:
+    case JEQ:
+    {
+      static const int cc[] = { CC_AE, CC_A, CC_BE, CC_B, CC_E };
+      need(1, at);
+      as.bytes({ 0x41, 0x81, 0xFD });                                   // cmp r13d, a
+      as.imm32(a);
+      jump_to(cc[op - JGE], b);
+      break;
+    }
+
+    case JMP:
+      jump_to(-1, a);
+      break;
+
+    case OUT:
+    case DBG:
+    case OUTS:
+      need(1, at);
+      as.bytes({ 0x48, 0x89, 0xDF });                                   // mov rdi, rbx
+      as.bytes({ 0x44, 0x89, 0xEE });                                   // mov esi, r13d
+      if(op == OUT) call((uint64_t)(uintptr_t)&VM::jit_out);
+      else if(op == DBG) call((uint64_t)(uintptr_t)&VM::jit_dbg);
+      else call((uint64_t)(uintptr_t)&VM::jit_outs);
+      break;
+
+    case IN:
+      as.bytes({ 0x48, 0x89, 0xDF });                                   // mov rdi, rbx
+      as.bytes({ 0xBE });                                               // mov esi, a
+      as.imm32(a);
+      as.bytes({ 0xBA });                                               // mov edx, b
+      as.imm32(b);
+      call((uint64_t)(uintptr_t)&VM::jit_in);
+      break;
+
+    case STORE:
+      need(1, at);
+      as.bytes({ 0xB8 });                                               // mov eax, a
+      as.imm32(a);
+      write(false);
+      pop_tos();
+      break;
+
+    case LOAD:
+      room(at);
+      push_tos();
+      as.bytes({ 0xB8 });                                               // mov eax, a
+      as.imm32(a);
+      read();
+      break;
+
+    case SSTORE:
+      need(2, at);
+      as.bytes({ 0x44, 0x89, 0xE8 });                                   // mov eax, r13d
+      as.bytes({ 0x49, 0x83, 0xEC, 0x04 });                             // sub r12, 4
+      as.bytes({ 0x41, 0x8B, 0x0C, 0x24 });                             // mov ecx, [r12]
+      pop_tos();
+      write(true);
+      break;
+
+    case SLOAD:
+      need(1, at);
+      as.bytes({ 0x44, 0x89, 0xE8 });                                   // mov eax, r13d
+      read();
+      break;
+
+    case HALT:
+      leave(decoded[i + 1].addr, JIT_HALT);
+      break;
+
+    case ADDI:
+      need(1, at);
+      as.bytes({ 0x41, 0x81, 0xC5 });                                   // add r13d, a
+      as.imm32(a);
+      break;
+
+    case SUBI:
+      need(1, at);
+      as.bytes({ 0x41, 0x81, 0xED });                                   // sub r13d, a
+      as.imm32(a);
+      break;
+
+    case MULI:
+      need(1, at);
+      as.bytes({ 0x45, 0x69, 0xED });                                   // imul r13d, r13d, a
+      as.imm32(a);
+      break;
+
+    case DIVI:
+    case MODI:
+      need(1, at);
+      as.bytes({ 0x44, 0x89, 0xE8 });                                   // mov eax, r13d
+      as.bytes({ 0x31, 0xD2 });                                         // xor edx, edx
+      as.bytes({ 0xB9 });                                               // mov ecx, a
+      as.imm32(a);
+      as.bytes({ 0xF7, 0xF1 });                                         // div ecx
+      if(op == DIVI) as.bytes({ 0x41, 0x89, 0xC5 });                    // mov r13d, eax
+      else as.bytes({ 0x41, 0x89, 0xD5 });                              // mov r13d, edx
+      break;
+
+    case INCM:
+    case DECM:
+      as.bytes({ 0x45, 0x89, 0x2C, 0x24 });                             // mov [r12], r13d
+      as.bytes({ 0xB8 });                                               // mov eax, a
+      as.imm32(a);
+      read();
+      if(op == INCM) as.bytes({ 0x41, 0x83, 0xC5, 0x01 });              // add r13d, 1
+      else as.bytes({ 0x41, 0x83, 0xED, 0x01 });                        // sub r13d, 1
+      as.bytes({ 0x44, 0x89, 0xE9 });                                   // mov ecx, r13d
+      as.bytes({ 0xB8 });                                               // mov eax, a
+      as.imm32(a);
+      write(true);
+      as.bytes({ 0x45, 0x8B, 0x2C, 0x24 });                             // mov r13d, [r12]
+      break;
+
+    case JSGE:
+    case JSGT:
+    case JSLE:
+    case JSLT:
+    case JSEQ:
+    case JSNE:
+    {
+      static const int cc[] = { CC_AE, CC_A, CC_BE, CC_B, CC_E, CC_NE };
+      need(2, at);
+      as.bytes({ 0x49, 0x83, 0xEC, 0x08 });                             // sub r12, 8
+      as.bytes({ 0x45, 0x3B, 0x6C, 0x24, 0x04 });                       // cmp r13d, [r12 + 4]
+      as.bytes({ 0x45, 0x8B, 0x2C, 0x24 });                             // mov r13d, [r12]
+      jump_to(cc[op - JSGE], a);
+      break;
+    }
+
+    case MEMCPY:
+    case MEMSET:
+    case MEMCMP:
+    case VADD:
+    case VSUB:
+    case VMUL:
+    case VSUM:
+    case VCOUNT:
+      need(stack_need[op], at);
+      as.bytes({ 0x45, 0x89, 0x2C, 0x24 });                             // mov [r12], r13d
+      as.bytes({ 0x48, 0x89, 0xDF });                                   // mov rdi, rbx
+      as.bytes({ 0xBE });                                               // mov esi, op
+      as.imm32(op);
+      as.bytes({ 0x4C, 0x89, 0xE2 });                                   // mov rdx, r12
+      call((uint64_t)(uintptr_t)&VM::jit_block);
+      as.bytes({ 0x49, 0x83, 0xEC, (uint8_t)((stack_need[op] - 1) * sizeof(uint)) });  // sub r12, need - 1
+      if(stack_need[op] + stack_effect[op] > 0) as.bytes({ 0x41, 0x89, 0xC5 });        // mov r13d, eax
+      else pop_tos();
+      break;
+
+    default:                                                            // Unknown opcodes are skipped
+      break;
+    }
+
+    if(op < OPCODE_END) known = std::max(known + stack_effect[op], 0);
+  }
+
+  native[end] = as.here();
+  leave(end, JIT_END);
+
+  for(auto& e : exits)
+  {
+    as.patch(e.from, as.here());
+    leave(e.ip, e.status);
+  }
+  for(auto& j : jumps) as.patch(j.first, native[j.second]);
+  for(auto at : to_epilogue) as.patch(at, epilogue);
+
+  // Copy it into executable memory
+  std::shared_ptr<JitCode> jc(new JitCode);
+  jc->size = (as.buf.size() + 4095) & ~(size_t)4095;
+  void* buffer = mmap(nullptr, jc->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(buffer == MAP_FAILED) return;
+  jc->buffer = buffer;
+  std::memcpy(buffer, as.buf.data(), as.buf.size());
+  if(mprotect(buffer, jc->size, PROT_READ | PROT_EXEC) != 0) return;
+
+  jc->len = len;
+  jc->entry.assign(len + 1, -1);
+  for(size_t at = 0; at <= len; at++)
+    if(leader[at] && decoded_index[at] >= 0) jc->entry[at] = native[at];
+
+  jit_code = jc;
+}
+
+// Run the program with the JIT, and the interpreter wherever the JIT can't be entered.
+void VM::execute_jit()
+{
+  const JitCode* jc = program->jit();
+  if(!jc)                                       // No executable memory to be had
+  {
+    execute<CheckedPolicy>();
+    return;
+  }
+
+  JitContext ctx;
+  ctx.vm = this;
+  ctx.base = mn_stack.data();
+  ctx.full = ctx.base + stack_cap;
+
+  while(ip < program->code.size())
+  {
+    if(jc->entry[ip] < 0)
+    {
+      if(!cycle()) return;
+      continue;
+    }
+
+    ctx.top = ctx.base + sp;
+    ctx.map(memory);
+    uint status = jc->run(&ctx, ip);
+    sp = ctx.top - ctx.base;
+    ip = ctx.ip;
+
+    if(status == JIT_UNDERFLOW) error_state = ERR_POP_FAIL;
+    else if(status == JIT_OVERFLOW) error_state = ERR_STACK_OVERFLOW;
+    if(status != JIT_FALLBACK) return;
+  }
+}
+
+// Callbacks from native code. These follow the System V calling convention like any other function.
+void VM::jit_out(JitContext* ctx, uint chars)
+{
+  ctx->vm->output->put_chars(chars);
+}
+
+void VM::jit_dbg(JitContext* ctx, uint val)
+{
+  ctx->vm->output->put_hex(val);
+}
+
+void VM::jit_outs(JitContext* ctx, uint addr)
+{
+  ctx->vm->output_string(addr);
+}
+
+// 'top' points at the length, which has one or two values under it
+uint VM::jit_block(JitContext* ctx, uint op, const uint* top)
+{
+  VM* vm = ctx->vm;
+  uint result = 0;
+  vm->block_memory(op, stack_need[op] > 2 ? top[-2] : 0, top[-1], top[0], result);
+  ctx->map(vm->memory);
+  return result;
+}
+
+void VM::jit_in(JitContext* ctx, uint size, uint addr)
+{
+  VM* vm = ctx->vm;
+  vm->input_line(size, addr);
+  ctx->map(vm->memory);
+}
+
+void VM::jit_store(JitContext* ctx, uint addr, uint val)
+{
+  VM* vm = ctx->vm;
+  vm->memory.write(addr, val);
+  ctx->map(vm->memory);
+}
+#endif
+
+/*
+ * The register engine. Each basic block is translated once into a register IR whose registers are the stack
+ * slots themselves: an instruction's result goes in the slot the stack machine would push it to, and its
+ * operands are read from wherever they are, so nothing is pushed or popped. Values from under the block's
+ * stack are used where they lie. Constants become immediate operands, or are folded away. LOAD and STORE of
+ * a constant address are done in registers; stores reach memory at the end of the block, or before anything
+ * goes through memory some other way or the slot holding the value is reused.
+ *
+ * When the block ends, at HALT and on every jump, any value not already in its slot is moved there, so the
+ * stack, ip and memory are exactly where the other engines leave them between blocks, and peek() sees the
+ * same thing. A block checks once, on entry, that the stack holds what it needs and has room for what it
+ * pushes. If it would fault anywhere inside, cycle() runs it instead, so the error comes from the right
+ * instruction after the output of the ones before it.
+ */
+void Program::reg_compile()
+{
+  const size_t len = code.size();
+  std::shared_ptr<RegisterCode> rc = std::make_shared<RegisterCode>();
+  std::vector<RegInstr>& ir = rc->ir;
+  std::vector<bool> leader(len + 1, false);
+  std::vector<uint8_t> fields;                  // While translating: which of an instruction's d, x, y, z are registers
+  std::vector<std::pair<size_t, size_t> > exits;  // IR indices of block exits, whose targets are still addresses,
+                                                // and of their blocks' ENTERs
+
+  rc->len = len;
+  rc->regs = 0;
+  rc->entry.assign(len + 1, -1);
+
+  // Size of the instruction at 'at', or 0 if there isn't a valid one
+  auto size_at = [&](size_t at) -> size_t
+  {
+    if(at >= len || code[at] == 0 || code[at] >= OPCODE_END) return 0;
+    size_t size = 1 + op_operands[code[at]];
+    return at + size <= len ? size : 0;
+  };
+
+  leader[0] = true;
+  for(size_t at = 0, size; at < len; at += size)
+  {
+    uint op = code[at];
+    size = size_at(at);
+    if(op == 0 || op >= OPCODE_END)             // cycle() skips it; carry on in a block after it
+    {
+      size = 1;
+      leader[at + 1] = true;
+      continue;
+    }
+    if(size == 0) break;                        // Truncated
+    if(is_jump(op))
+    {
+      uint target = code[at + 1 + target_operand(op)];
+      if(target <= len) leader[target] = true;
+    }
+    if(is_jump(op) || op == HALT) leader[at + size] = true;
+  }
+
+  // A value on the block's stack: an immediate, a stack slot or a temporary. Slots count up from the top of
+  // the stack when the block was entered, at 0. While translating, registers are encoded in IR fields as the
+  // slot number, or TEMP + the temporary's number, and rebased on the top of the stack when the block ends.
+  enum { IMM, SLOT, TEMP = 0x40000000 };
+  struct Val
+  {
+    int kind;
+    uint v;
+  };
+  struct Cached
+  {
+    uint addr;
+    Val val;
+    bool dirty;                                 // Not written to memory yet
+  };
+  enum { D = 1, X = 2, Y = 4, Z = 8 };
+
+  std::vector<Val> vals;                        // Stack slots [height - vals.size() + 1, height] as the block left them.
+                                                // The ones under those still hold what they held on entry.
+  std::vector<Cached> cache;
+  int height = 0;                               // Top of the stack, relative to where it was on entry
+  uint temps = 0;
+  size_t start;                                 // Address of the block being translated
+
+  auto emit = [&](uint op, uint d, uint x, uint y, uint z, uint8_t regs)
+  {
+    RegInstr in = { op, d, x, y, z };
+    ir.push_back(in);
+    fields.push_back(regs);
+  };
+  auto imm = [](uint v) { Val val = { IMM, v }; return val; };
+  auto slot = [](int n) { Val val = { SLOT, (uint)n }; return val; };
+  auto temp = [&]() { Val val = { TEMP, temps++ }; return val; };
+  auto same = [](Val a, Val b) { return a.kind == b.kind && a.v == b.v; };
+  auto name = [](Val val) -> uint { return val.kind == TEMP ? TEMP + val.v : val.v; };
+  // The register holding a value, setting a temporary to it if it's an immediate
+  auto reg = [&](Val val) -> uint
+  {
+    if(val.kind != IMM) return name(val);
+    Val t = temp();
+    emit(R_SET, name(t), 0, val.v, 0, D);
+    return name(t);
+  };
+  auto push = [&](Val val)
+  {
+    vals.push_back(val);
+    height++;
+  };
+  auto pop = [&]() -> Val
+  {
+    Val val = slot(height);
+    if(!vals.empty())
+    {
+      val = vals.back();
+      vals.pop_back();
+    }
+    height--;
+    return val;
+  };
+  auto peek = [&]() -> Val { return vals.empty() ? slot(height) : vals.back(); };
+  auto find = [&](uint addr) -> Cached*
+  {
+    for(Cached& c : cache) if(c.addr == addr) return &c;
+    return nullptr;
+  };
+  auto write_back = [&](const Cached& c)
+  {
+    if(c.val.kind == IMM) emit(R_STOREI, c.addr, 0, c.val.v, 0, 0);
+    else emit(R_STORE, c.addr, name(c.val), 0, 0, X);
+  };
+  auto flush = [&]()
+  {
+    for(Cached& c : cache)
+    {
+      if(c.dirty) write_back(c);
+      c.dirty = false;
+    }
+  };
+  // Make way for an instruction writing 'dst': anything else still using the value in it is written to
+  // memory, or moved to a temporary
+  auto clobber = [&](Val dst)
+  {
+    for(size_t i = 0; i < cache.size(); )
+    {
+      if(!same(cache[i].val, dst)) i++;
+      else
+      {
+        if(cache[i].dirty) write_back(cache[i]);
+        cache.erase(cache.begin() + i);
+      }
+    }
+
+    const int first = height - (int)vals.size() + 1;
+    Val moved = { IMM, 0 };
+    for(size_t i = 0; i < vals.size(); i++)
+    {
+      if(!same(vals[i], dst) || (dst.kind == SLOT && (int)dst.v == first + (int)i)) continue;
+      if(moved.kind == IMM)
+      {
+        moved = temp();
+        emit(R_MOVE, name(moved), name(dst), 0, 0, D | X);
+      }
+      vals[i] = moved;
+    }
+  };
+  // The slot a value pushed now goes in, made ready to be written
+  auto result = [&]() -> Val
+  {
+    Val dst = slot(height + 1);
+    clobber(dst);
+    return dst;
+  };
+  // The value at 'addr', read into 'dst' if it isn't in a register already
+  auto load = [&](uint addr, Val dst) -> Val
+  {
+    Cached* c = find(addr);
+    if(c) return c->val;
+    emit(R_LOAD, name(dst), 0, addr, 0, D);
+    Cached add = { addr, dst, false };
+    cache.push_back(add);
+    return dst;
+  };
+  auto store = [&](uint addr, Val val)
+  {
+    Cached* c = find(addr);
+    Cached add = { addr, val, true };
+    if(c) *c = add;
+    else cache.push_back(add);
+  };
+  // 'op' is ADD ... MOD, applied as 't op s' like the stack instructions do, into 'dst' unless it folds
+  auto binary = [&](uint op, Val t, Val s, Val dst) -> Val
+  {
+    if(t.kind == IMM && s.kind == IMM && !((op == DIV || op == MOD) && s.v == 0))
+    {
+      switch(op)
+      {
+      case ADD: return imm(t.v + s.v);
+      case SUB: return imm(t.v - s.v);
+      case MUL: return imm(t.v * s.v);
+      case DIV: return imm(t.v / s.v);
+      default: return imm(t.v % s.v);
+      }
+    }
+    if(s.kind == IMM) emit(R_ADDI + (op - ADD), name(dst), reg(t), s.v, 0, D | X);
+    else if(t.kind == IMM && (op == ADD || op == MUL)) emit(R_ADDI + (op - ADD), name(dst), name(s), t.v, 0, D | X);
+    else if(t.kind == IMM) emit(op == SUB ? R_RSUBI : op == DIV ? R_RDIVI : R_RMODI, name(dst), name(s), t.v, 0, D | X);
+    else emit(R_ADD + (op - ADD), name(dst), name(t), name(s), 0, D | X | Y);
+    return dst;
+  };
+  // Write back memory, and put every value on the stack in its slot, before leaving the block
+  auto leave = [&]()
+  {
+    flush();
+    const int first = height - (int)vals.size() + 1;
+    for(size_t i = 0; i < vals.size(); i++)
+    {
+      Val dst = slot(first + i);
+      if(same(vals[i], dst)) continue;
+      Val val = vals[i];
+      vals[i] = dst;                            // So clobber() leaves it alone
+      clobber(dst);
+      if(val.kind == IMM) emit(R_SET, name(dst), 0, val.v, 0, D);
+      else emit(R_MOVE, name(dst), name(val), 0, 0, D | X);
+    }
+  };
+  // Branch on 'l cmp r', where 'cmp' counts from GE in the order of JSGE ... JSNE
+  auto branch = [&](uint cmp, Val l, Val r, uint taken, uint not_taken)
+  {
+    static const uint flip[] = { 2, 3, 0, 1, 4, 5 };    // l cmp r is r flip[cmp] l
+    exits.push_back(std::make_pair(ir.size(), rc->entry[start]));
+    if(l.kind == IMM && r.kind == IMM)
+    {
+      const bool results[] = { l.v >= r.v, l.v > r.v, l.v <= r.v, l.v < r.v, l.v == r.v, l.v != r.v };
+      emit(R_JUMP, results[cmp] ? taken : not_taken, 0, 0, 0, 0);
+    }
+    else if(r.kind == IMM) emit(R_BGEI + cmp, taken, name(l), r.v, not_taken, X);
+    else if(l.kind == IMM) emit(R_BGEI + flip[cmp], taken, name(r), l.v, not_taken, X);
+    else emit(R_BGE + cmp, taken, name(l), name(r), not_taken, X | Y);
+  };
+  auto jump = [&](uint target)
+  {
+    exits.push_back(std::make_pair(ir.size(), rc->entry[start]));
+    emit(R_JUMP, target, 0, 0, 0, 0);
+  };
+
+  for(start = 0; start < len; start++)
+  {
+    if(!leader[start] || size_at(start) == 0) continue;
+
+    const size_t first = ir.size();
+    int need = 0;
+    int peak = 0;
+    vals.clear();
+    cache.clear();
+    height = 0;
+    temps = 0;
+    rc->entry[start] = first;
+    emit(R_ENTER, 0, 0, 0, start, 0);
+
+    size_t at = start;
+    for(bool open = true; open; )
+    {
+      const size_t size = size_at(at);
+      if(size == 0 || (at != start && leader[at]))
+      {
+        leave();
+        jump(at);                               // Falls through into the next block, or out of the IR
+        break;
+      }
+
+      const uint op = code[at];
+      const uint a = size > 1 ? code[at + 1] : 0;
+      const uint b = size > 2 ? code[at + 2] : 0;
+      const uint next = at + size;
+      need = std::max(need, stack_need[op] - height);
+
+      switch(op)
+      {
+      case PUSH: push(imm(a)); break;
+      case POP: pop(); break;
+
+      case ADD:
+      case SUB:
+      case MUL:
+      case DIV:
+      case MOD:
+      {
+        Val t = pop();
+        Val s = pop();
+        push(binary(op, t, s, result()));
+        break;
+      }
+
+      case INC:
+      case DEC:
+      {
+        Val t = pop();
+        push(binary(op == INC ? ADD : SUB, t, imm(1), result()));
+        break;
+      }
+
+      case ADDI:
+      case SUBI:
+      case MULI:
+      case DIVI:
+      case MODI:
+      {
+        Val t = pop();
+        push(binary(ADD + (op - ADDI), t, imm(a), result()));
+        break;
+      }
+
+      case JGE:
+      case JGT:
+      case JLE:
+      case JLT:
+      case JEQ:
+      {
+        leave();
+        branch(op - JGE, peek(), imm(a), b, next);
+        open = false;
+        break;
+      }
+
+      case JSGE:
+      case JSGT:
+      case JSLE:
+      case JSLT:
+      case JSEQ:
+      case JSNE:
+      {
+        leave();                                // Before the pops, so nothing is moved into where t and s are
+        Val t = pop();
+        Val s = pop();
+        branch(op - JSGE, t, s, a, next);
+        open = false;
+        break;
+      }
+
+      case JMP:
+        leave();
+        jump(a);
+        open = false;
+        break;
+
+      case HALT:
+        leave();
+        emit(R_HALT, next, 0, 0, 0, 0);
+        open = false;
+        break;
+
+      case OUT: emit(R_OUT, 0, reg(peek()), 0, 0, X); break;
+      case DBG: emit(R_DBG, 0, reg(peek()), 0, 0, X); break;
+
+      case OUTS:
+        flush();
+        emit(R_OUTS, 0, reg(peek()), 0, 0, X);
+        break;
+
+      case IN:
+        flush();
+        cache.clear();
+        emit(R_IN, b, 0, a, 0, 0);
+        break;
+
+      case STORE: store(a, pop()); break;
+      case LOAD: push(find(a) ? find(a)->val : load(a, result())); break;
+      case INCM: store(a, binary(ADD, load(a, temp()), imm(1), temp())); break;
+      case DECM: store(a, binary(SUB, load(a, temp()), imm(1), temp())); break;
+
+      case SSTORE:
+      {
+        Val addr = pop();
+        Val val = pop();
+        if(addr.kind == IMM) store(addr.v, val);
+        else
+        {
+          flush();
+          cache.clear();
+          emit(R_SSTORE, 0, name(addr), reg(val), 0, X | Y);
+        }
+        break;
+      }
+
+      case SLOAD:
+      {
+        Val addr = pop();
+        if(addr.kind == IMM) push(find(addr.v) ? find(addr.v)->val : load(addr.v, result()));
+        else
+        {
+          flush();
+          Val dst = result();
+          emit(R_SLOAD, name(dst), name(addr), 0, 0, D | X);
+          push(dst);
+        }
+        break;
+      }
+
+      default:                                  // MEMCPY ... VCOUNT: the length on top, with one or two values under it
+      {
+        Val count = pop();
+        Val dst = pop();
+        Val src = stack_need[op] > 2 ? pop() : imm(0);
+        const uint x = reg(src);
+        const uint y = reg(dst);
+        const uint z = reg(count);
+        const bool pushes = stack_need[op] + stack_effect[op] > 0;
+        flush();
+        if(op != MEMCMP && op != VSUM && op != VCOUNT) cache.clear();  // Only these leave memory alone
+        Val out = pushes ? result() : temp();
+        emit(R_MEMCPY + (op - MEMCPY), name(out), x, y, z, D | X | Y | Z);
+        if(pushes) push(out);
+        break;
+      }
+      }
+
+      peak = std::max(peak, height);
+      at = next;
+    }
+
+    // Now the block's final height is known, turn slot numbers and temporaries into offsets from the top
+    ir[first].d = height;
+    ir[first].x = need;
+    ir[first].y = peak;
+    for(size_t i = first + 1; i < ir.size(); i++)
+    {
+      uint* regs[] = { &ir[i].d, &ir[i].x, &ir[i].y, &ir[i].z };
+      for(int f = 0; f < 4; f++)
+      {
+        if(!(fields[i] & (1 << f))) continue;
+        uint& r = *regs[f];
+        if(r >= TEMP && r < 2u * TEMP) r = peak + 1 + (r - TEMP) - height;
+        else r = (int)r - height;
+      }
+    }
+    rc->regs = std::max(rc->regs, temps);
+  }
+
+  // Point the exits at the blocks they go to, or at stubs that leave the IR. A block's ENTER is skipped if the
+  // checks of the block jumping to it already cover its own; jumps then move the top for it.
+  auto resolve = [&](uint target, const RegInstr& from, bool moves, uint& moved) -> uint
+  {
+    if(target > len || rc->entry[target] < 0)
+    {
+      RegInstr stub = { R_EXIT, target, 0, 0, 0 };
+      ir.push_back(stub);
+      return ir.size() - 1;
+    }
+    const RegInstr& to = ir[rc->entry[target]];
+    const int delta = (int)from.d;
+    if((!moves && to.d != 0) || (int)from.x + delta < (int)to.x || delta + (int)to.y > (int)from.y)
+      return rc->entry[target];
+    moved = to.d;
+    return rc->entry[target] + 1;
+  };
+  for(auto& exit : exits)
+  {
+    const RegInstr from = ir[exit.second];
+    uint moved = 0;
+    const uint taken = resolve(ir[exit.first].d, from, ir[exit.first].op == R_JUMP, moved);
+    ir[exit.first].d = taken;
+    if(ir[exit.first].op == R_JUMP) ir[exit.first].x = moved;
+    else
+    {
+      const uint not_taken = resolve(ir[exit.first].z, from, false, moved);
+      ir[exit.first].z = not_taken;
+    }
+  }
 
-  case JGE:
-    val = code[ip];		// The value to compare to
-    ip++;
-    addr = code[ip];		// The address to jump to if true
-    ip++;			// Next opcode for next round
-    if(mn_stack.top() >= val) ip = addr;	// If true, jump to the following address.
-    break;
+  reg_code = rc;
+}
 
-  case JGT:
-    val = code[ip];
-    ip++;
-    addr = code[ip];
-    ip++;
-    if(mn_stack.top() > val) ip = addr;
-    break;
+void VM::execute_register()
+{
+  const RegisterCode* rc = program->registers();
 
-  case JLE:
-    val = code[ip];
-    ip++;
-    addr = code[ip];
-    ip++;
-    if(mn_stack.top() <= val) ip = addr;
-    break;
+  // Room for the temporaries of a block at the very top of the stack, above slot 0
+  if(mn_stack.size() < stack_cap + 2 + rc->regs) mn_stack.resize(stack_cap + 2 + rc->regs);
 
-  case JLT:
-    val = code[ip];
-    ip++;
-    addr = code[ip];
-    ip++;
-    if(mn_stack.top() < val) ip = addr;
-    break;
+  bool step = false;
+  while(ip < program->code.size())
+  {
+    if(step || rc->entry[ip] < 0)
+    {
+      step = false;
+      if(!cycle()) return;
+      continue;
+    }
 
-  case JEQ:
-    val = code[ip];
-    ip++;
-    addr = code[ip];
-    ip++;
-    if(mn_stack.top() == val) ip = addr;
-    break;
+    RegStatus status = run_register();
+    if(status == REG_STOP) return;
+    step = status == REG_STEP;
+  }
+}
 
-  case JMP:
-    ip = code[ip];
-    break;
+RegStatus VM::run_register()
+{
+  const RegInstr* const ir = program->reg_code->ir.data();
+  const RegInstr* pc = ir + program->reg_code->entry[ip];
+  uint* const base = mn_stack.data();
+  uint* top = base + sp;
+  const uint cap = stack_cap;
+  OutputSink& out = *output;
 
-  case OUT:
+#define SAM_R(f)        top[(int)pc->f]
+#ifdef SAM_COMPUTED_GOTO
+#define SAM_REG(op)     reg_##op:
+#define SAM_REG_NEXT()  goto *dispatch[(++pc)->op]
+#define SAM_REG_GO(i)   { pc = ir + (i); goto *dispatch[pc->op]; }
+  // Indexed by RegOp
+  static const void* dispatch[] =
+  {
+    &&reg_R_ENTER, &&reg_R_SET, &&reg_R_MOVE, &&reg_R_LOAD, &&reg_R_STORE, &&reg_R_STOREI, &&reg_R_SLOAD,
+    &&reg_R_SSTORE, &&reg_R_ADD, &&reg_R_SUB, &&reg_R_MUL, &&reg_R_DIV, &&reg_R_MOD, &&reg_R_ADDI,
+    &&reg_R_SUBI, &&reg_R_MULI, &&reg_R_DIVI, &&reg_R_MODI, &&reg_R_RSUBI, &&reg_R_RDIVI, &&reg_R_RMODI,
+    &&reg_R_OUT, &&reg_R_DBG, &&reg_R_OUTS, &&reg_R_IN, &&reg_R_MEMCPY, &&reg_R_MEMSET, &&reg_R_MEMCMP,
+    &&reg_R_VADD, &&reg_R_VSUB, &&reg_R_VMUL, &&reg_R_VSUM, &&reg_R_VCOUNT, &&reg_R_BGE, &&reg_R_BGT,
+    &&reg_R_BLE, &&reg_R_BLT, &&reg_R_BEQ, &&reg_R_BNE, &&reg_R_BGEI, &&reg_R_BGTI, &&reg_R_BLEI,
+    &&reg_R_BLTI, &&reg_R_BEQI, &&reg_R_BNEI, &&reg_R_JUMP, &&reg_R_HALT, &&reg_R_EXIT
+  };
+
+  goto *dispatch[pc->op];
+  {
+#else
+#define SAM_REG(op)     case op:
+#define SAM_REG_NEXT()  { pc++; continue; }
+#define SAM_REG_GO(i)   { pc = ir + (i); continue; }
+  for(;;)
+  {
+    switch(pc->op)
+    {
+#endif
+  SAM_REG(R_ENTER)
   {
-    uint uint_chars = mn_stack.top();
-    for(int shift = sizeof(uint) * 8 - 8; shift >= 0; shift -= 8)
+    const uint depth = top - base;
+    if(depth < pc->x || pc->y > cap - depth)
     {
-      char ascii = (char)(uint_chars >> shift);
-      // Since a null character (0x00) signals the end of a string in C++, this will short circuit the output of standard out.
-      // If it's a null character, don't output that character.
-      if(ascii) std::cout << ascii;
+      ip = pc->z;
+      sp = depth;
+      return REG_STEP;
     }
-    break;
+    top += (int)pc->d;
+    SAM_REG_NEXT();
   }
 
-  case IN:
+  SAM_REG(R_SET) SAM_R(d) = pc->y; SAM_REG_NEXT();
+  SAM_REG(R_MOVE) SAM_R(d) = SAM_R(x); SAM_REG_NEXT();
+  SAM_REG(R_LOAD) SAM_R(d) = memory.read(pc->y); SAM_REG_NEXT();
+  SAM_REG(R_STORE) memory.write(pc->d, SAM_R(x)); SAM_REG_NEXT();
+  SAM_REG(R_STOREI) memory.write(pc->d, pc->y); SAM_REG_NEXT();
+  SAM_REG(R_SLOAD) SAM_R(d) = memory.read(SAM_R(x)); SAM_REG_NEXT();
+  SAM_REG(R_SSTORE) memory.write(SAM_R(x), SAM_R(y)); SAM_REG_NEXT();
+
+  SAM_REG(R_ADD) SAM_R(d) = SAM_R(x) + SAM_R(y); SAM_REG_NEXT();
+  SAM_REG(R_SUB) SAM_R(d) = SAM_R(x) - SAM_R(y); SAM_REG_NEXT();
+  SAM_REG(R_MUL) SAM_R(d) = SAM_R(x) * SAM_R(y); SAM_REG_NEXT();
+  SAM_REG(R_DIV) SAM_R(d) = SAM_R(x) / SAM_R(y); SAM_REG_NEXT();
+  SAM_REG(R_MOD) SAM_R(d) = SAM_R(x) % SAM_R(y); SAM_REG_NEXT();
+  SAM_REG(R_ADDI) SAM_R(d) = SAM_R(x) + pc->y; SAM_REG_NEXT();
+  SAM_REG(R_SUBI) SAM_R(d) = SAM_R(x) - pc->y; SAM_REG_NEXT();
+  SAM_REG(R_MULI) SAM_R(d) = SAM_R(x) * pc->y; SAM_REG_NEXT();
+  SAM_REG(R_DIVI) SAM_R(d) = SAM_R(x) / pc->y; SAM_REG_NEXT();
+  SAM_REG(R_MODI) SAM_R(d) = SAM_R(x) % pc->y; SAM_REG_NEXT();
+  SAM_REG(R_RSUBI) SAM_R(d) = pc->y - SAM_R(x); SAM_REG_NEXT();
+  SAM_REG(R_RDIVI) SAM_R(d) = pc->y / SAM_R(x); SAM_REG_NEXT();
+  SAM_REG(R_RMODI) SAM_R(d) = pc->y % SAM_R(x); SAM_REG_NEXT();
+
+  SAM_REG(R_OUT) out.put_chars(SAM_R(x)); SAM_REG_NEXT();
+  SAM_REG(R_DBG) out.put_hex(SAM_R(x)); SAM_REG_NEXT();
+  SAM_REG(R_OUTS) output_string(SAM_R(x)); SAM_REG_NEXT();
+  SAM_REG(R_IN) input_line(pc->y, pc->d); SAM_REG_NEXT();
+
+  SAM_REG(R_MEMCPY)
+  SAM_REG(R_MEMSET)
+  SAM_REG(R_MEMCMP)
+  SAM_REG(R_VADD)
+  SAM_REG(R_VSUB)
+  SAM_REG(R_VMUL)
+  SAM_REG(R_VSUM)
+  SAM_REG(R_VCOUNT)
   {
-    std::string str;
-    getline(std::cin, str);
-    int val = code[ip];
-    ip++;
-    addr = code[ip];
-    vec_to_mem(string_to_int(str), val, addr);
-    break;
+    const uint op = MEMCPY + (pc->op - R_MEMCPY);
+    block_memory(op, stack_need[op] > 2 ? SAM_R(x) : 0, SAM_R(y), SAM_R(z), SAM_R(d));
+    SAM_REG_NEXT();
   }
 
-  case DBG:
-    std::cout << std::hex <<  mn_stack.top() << std::dec << std::endl;
-    break;
+  SAM_REG(R_BGE) SAM_REG_GO(SAM_R(x) >= SAM_R(y) ? pc->d : pc->z);
+  SAM_REG(R_BGT) SAM_REG_GO(SAM_R(x) > SAM_R(y) ? pc->d : pc->z);
+  SAM_REG(R_BLE) SAM_REG_GO(SAM_R(x) <= SAM_R(y) ? pc->d : pc->z);
+  SAM_REG(R_BLT) SAM_REG_GO(SAM_R(x) < SAM_R(y) ? pc->d : pc->z);
+  SAM_REG(R_BEQ) SAM_REG_GO(SAM_R(x) == SAM_R(y) ? pc->d : pc->z);
+  SAM_REG(R_BNE) SAM_REG_GO(SAM_R(x) != SAM_R(y) ? pc->d : pc->z);
+  SAM_REG(R_BGEI) SAM_REG_GO(SAM_R(x) >= pc->y ? pc->d : pc->z);
+  SAM_REG(R_BGTI) SAM_REG_GO(SAM_R(x) > pc->y ? pc->d : pc->z);
+  SAM_REG(R_BLEI) SAM_REG_GO(SAM_R(x) <= pc->y ? pc->d : pc->z);
+  SAM_REG(R_BLTI) SAM_REG_GO(SAM_R(x) < pc->y ? pc->d : pc->z);
+  SAM_REG(R_BEQI) SAM_REG_GO(SAM_R(x) == pc->y ? pc->d : pc->z);
+  SAM_REG(R_BNEI) SAM_REG_GO(SAM_R(x) != pc->y ? pc->d : pc->z);
 
-  case STORE:
-    addr = code[ip];
-    ip++;
-    alloc(addr); // Make sure there is enough memory
-    memory[addr] = mn_stack.top();
-    stack_pop();
-    break;
+  SAM_REG(R_JUMP)
+    top += (int)pc->x;
+    SAM_REG_GO(pc->d);
 
-  case LOAD:
-    addr = code[ip];
-    ip++;
-    mn_stack.push(memory[addr]);
-    break;
+  SAM_REG(R_HALT)
+    ip = pc->d;
+    sp = top - base;
+    return REG_STOP;
 
-  case SSTORE:
-    addr = mn_stack.top();
-    stack_pop();
-    val = mn_stack.top();
-    stack_pop();
-    alloc(addr);
-    memory[addr] = val;
-    break;
+  SAM_REG(R_EXIT)
+    ip = pc->d;
+    sp = top - base;
+    return REG_EXIT;
+#ifndef SAM_COMPUTED_GOTO
+    }
+#endif
+  }
+#undef SAM_R
+#undef SAM_REG
+#undef SAM_REG_NEXT
+#undef SAM_REG_GO
+}
 
-  case SLOAD:
-    addr = mn_stack.top();
-    stack_pop();
-    mn_stack.push(memory[addr]);
-    break;
+#ifdef SAM_FLAT_MEMORY
+/*
+ * Run cycle() on flat memory. A SIGSEGV in the flat memory's range while it runs jumps back here, and is
+ * reported as ERR_MEMORY_BOUNDS on the instruction that faulted. Other SIGSEGVs go to whatever handled
+ * them before.
+ */
+template<bool Metered>
+void VM::execute_flat()
+{
+  static const bool installed = []
+  {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = &VM::flat_signal;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGSEGV, &action, &flat_old_action()) == 0;
+  }();
+  (void)installed;
 
-  case HALT:
-    return false;
+  FlatFault fault;
+  fault.memory = &flat;
+  FlatFault* outer = flat_fault();
+  flat_fault() = &fault;
+
+  if(sigsetjmp(fault.env, 1) == 0)
+  {
+    while(ip < program->code.size() && (Metered ? metered_cycle<true>() : cycle<true>()));
+  }
+  else
+  {
+    ip = fault_ip;
+    error_state = ERR_MEMORY_BOUNDS;
   }
 
-  return true;
+  flat_fault() = outer;
 }
 
-void VM::execute()
+FlatFault*& VM::flat_fault()
 {
-  bool cyc = true;
-  while(ip < code.size() && cyc == true)
-    cyc = cycle();
+  static thread_local FlatFault* current = nullptr;
+  return current;
 }
 
+struct sigaction& VM::flat_old_action()
+{
+  static struct sigaction old;
+  return old;
+}
+
+void VM::flat_signal(int sig, siginfo_t* info, void* context)
+{
+  FlatFault* fault = flat_fault();
+  if(fault && fault->memory->contains(info->si_addr)) siglongjmp(fault->env, 1);
+
+  struct sigaction& old = flat_old_action();
+  if(old.sa_flags & SA_SIGINFO) old.sa_sigaction(sig, info, context);
+  else if(old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN) old.sa_handler(sig);
+  else signal(sig, SIG_DFL);                    // Returning runs the faulting instruction again, which now kills us
+}
+#endif
+
 void VM::push(uint val)
 {
-  code.push_back(PUSH);
-  code.push_back(val);
+  append({ PUSH, val });
 }
 
 void VM::pop()
 {
-  code.push_back(POP);
+  append({ POP });
 }
 
 void VM::add()
 {
-  code.push_back(ADD);
+  append({ ADD });
 }
 
 void VM::sub()
 {
-  code.push_back(SUB);
+  append({ SUB });
 }
 
 void VM::mul()
 {
-  code.push_back(MUL);
+  append({ MUL });
 }
 
 void VM::div()
 {
-  code.push_back(DIV);
+  append({ DIV });
 }
 
 void VM::mod()
 {
-  code.push_back(MOD);
+  append({ MOD });
 }
 
 void VM::inc()
 {
-  code.push_back(INC);
+  append({ INC });
 }
 
 void VM::dec()
 {
-  code.push_back(DEC);
+  append({ DEC });
 }
 
 void VM::jge(uint val, uint addr)
 {
-  code.push_back(JGE);
-  code.push_back(val);
-  code.push_back(addr);
+  append({ JGE, val, addr });
 }
 
 void VM::jgt(uint val, uint addr)
 {
-  code.push_back(JGT);
-  code.push_back(val);
-  code.push_back(addr);
+  append({ JGT, val, addr });
 }
 
 void VM::jle(uint val, uint addr)
 {
-  code.push_back(JLE);
-  code.push_back(val);
-  code.push_back(addr);
+  append({ JLE, val, addr });
 }
 
 void VM::jlt(uint val, uint addr)
 {
-  code.push_back(JLT);
-  code.push_back(val);
-  code.push_back(addr);
+  append({ JLT, val, addr });
 }
 
 void VM::jeq(uint val, uint addr)
 {
-  code.push_back(JEQ);
-  code.push_back(val);
-  code.push_back(addr);
+  append({ JEQ, val, addr });
 }
 
 void VM::jmp(uint addr)
 {
-  code.push_back(JMP);
-  code.push_back(addr);
+  append({ JMP, addr });
 }
 
 void VM::out()
 {
-  code.push_back(OUT);
+  append({ OUT });
 }
 
 void VM::in(uint val, uint addr)
 {
-  code.push_back(IN);
-  code.push_back(val);
-  code.push_back(addr);
+  append({ IN, val, addr });
 }
 
 void VM::dbg()
 {
-  code.push_back(DBG);
+  append({ DBG });
 }
 
 void VM::store(uint addr)
 {
-  code.push_back(STORE);
-  code.push_back(addr);
+  append({ STORE, addr });
 }
 
 void VM::load(uint addr)
 {
-  code.push_back(LOAD);
-  code.push_back(addr);
+  append({ LOAD, addr });
 }
 
 void VM::sstore()
 {
-  code.push_back(SSTORE);
+  append({ SSTORE });
 }
 
 void VM::sload()
 {
-  code.push_back(SLOAD);
+  append({ SLOAD });
 }
 
 void VM::halt()
 {
-  code.push_back(HALT);
+  append({ HALT });
+}
+
+void VM::outs()
+{
+  append({ OUTS });
+}
+
+void VM::memcopy()
+{
+  append({ MEMCPY });
+}
+
+void VM::memfill()
+{
+  append({ MEMSET });
+}
+
+void VM::memcompare()
+{
+  append({ MEMCMP });
+}
+
+void VM::vadd()
+{
+  append({ VADD });
+}
+
+void VM::vsub()
+{
+  append({ VSUB });
+}
+
+void VM::vmul()
+{
+  append({ VMUL });
+}
+
+void VM::vsum()
+{
+  append({ VSUM });
+}
+
+void VM::vcount()
+{
+  append({ VCOUNT });
+}
+
+void VM::addi(uint val)
+{
+  append({ ADDI, val });
+}
+
+void VM::subi(uint val)
+{
+  append({ SUBI, val });
+}
+
+void VM::muli(uint val)
+{
+  append({ MULI, val });
+}
+
+void VM::divi(uint val)
+{
+  append({ DIVI, val });
+}
+
+void VM::modi(uint val)
+{
+  append({ MODI, val });
+}
+
+void VM::incm(uint addr)
+{
+  append({ INCM, addr });
+}
+
+void VM::decm(uint addr)
+{
+  append({ DECM, addr });
+}
+
+void VM::jsge(uint addr)
+{
+  append({ JSGE, addr });
+}
+
+void VM::jsgt(uint addr)
+{
+  append({ JSGT, addr });
+}
+
+void VM::jsle(uint addr)
+{
+  append({ JSLE, addr });
+}
+
+void VM::jslt(uint addr)
+{
+  append({ JSLT, addr });
+}
+
+void VM::jseq(uint addr)
+{
+  append({ JSEQ, addr });
+}
+
+void VM::jsne(uint addr)
+{
+  append({ JSNE, addr });
+}
+
+/*
+ * IN: read a line and store it packed, four characters to a word with the first in the high byte, at
+ * 'addr'. At most 'size' words are stored, and a null word goes at addr + size to end the string; words
+ * the line doesn't reach are left as they are. The line is packed straight from the input buffer into
+ * each page, or into flat memory, which is checked first so that a line that doesn't fit changes nothing.
+ */
+template<bool Flat>
+bool VM::input_line(uint size, uint addr)
+{
+  const char* line;
+  size_t length;
+  output->flush();                              // Show any prompt before waiting for input
+  input->next_line(line, length);
+  const uint64_t words = std::min<uint64_t>(size, (length + sizeof(uint) - 1) / sizeof(uint));
+
+#ifdef SAM_FLAT_MEMORY
+  const uint64_t limit = flat.size();
+  if(Flat && limit < ((uint64_t)1 << 32) && ((uint)(addr + size) >= limit || (words && addr + words > limit)))
+    return false;
+#endif
+
+  write_memory<Flat>(addr + size, 0);
+  for(uint64_t i = 0; i < words; )
+  {
+    uint at = addr + i;
+    uint* dest;
+    uint64_t count;                             // Words that can be stored contiguously from 'at'
+#ifdef SAM_FLAT_MEMORY
+    if(Flat)
+    {
+      dest = flat.data() + at;
+      count = std::min<uint64_t>(words - i, ((uint64_t)1 << 32) - at);
+    }
+    else
+#endif
+    {
+      dest = memory.writable(at >> PagedMemory::page_bits) + (at & PagedMemory::page_mask);
+      count = std::min<uint64_t>(words - i, PagedMemory::page_size - (at & PagedMemory::page_mask));
+    }
+    size_t offset = i * sizeof(uint);
+    pack_words(line + offset, std::min<size_t>(length - offset, count * sizeof(uint)), dest);
+    i += count;
+  }
+  return true;
+}
+
+/*
+ * OUTS: write the string packed at 'addr', as OUT would write each of its words, up to the first null word.
+ * Each page, or all of flat memory, is scanned and unpacked as one run.
+ */
+template<bool Flat>
+bool VM::output_string(uint addr)
+{
+  const uint64_t space = (uint64_t)1 << 32;
+  uint at = addr;
+  for(uint64_t done = 0; done < space; )        // Stop if it wraps all the way round
+  {
+    const uint* run;
+    uint64_t count;
+#ifdef SAM_FLAT_MEMORY
+    if(Flat)
+    {
+      if(at >= flat.size()) return false;
+      run = flat.data() + at;
+      count = flat.size() - at;
+    }
+    else
+#endif
+    {
+      uint page = at >> PagedMemory::page_bits;
+      if(page >= memory.pages()) return true;   // Memory that was never written reads as 0
+      run = memory.read_dir()[page] + (at & PagedMemory::page_mask);
+      count = PagedMemory::page_size - (at & PagedMemory::page_mask);
+    }
+    count = std::min(count, space - done);
+
+    const uint* end = std::find(run, run + count, 0u);
+    output->put_words(run, end - run);
+    if(end != run + count) return true;
+    at += count;
+    done += count;
+  }
+  return true;
 }
 
 /*
- * This is a convenience method that is used to turn a std C++ string into a vector of packaged integers.
- * All instructions and memory points in the virutal are represented by 32-bit integers. However, a string
- * is an array of 8-bit integers, or "chars". In order to save space and prevent an entire 32-bit integer
- * from being used only by an 8-bit number, this convenience function will pack up to four chars into a
- * single integer, and return the vector representing the array of integers.
+ * The instructions on ranges of memory, given the 'len' words at 'b' and, for some, a second value 'a':
+ *
+ *   MEMCPY   copies the words at 'a' to 'b', as if through a buffer, so the two may overlap.
+ *   MEMSET   sets the words at 'b' to 'a'.
+ *   MEMCMP   sets 'result' to 0 if the words at 'a' and 'b' are the same, or to 1 or 2 if the first word
+ *            that differs is lower or higher at 'a'.
+ *   VADD     adds each word at 'a' to the word at the same index at 'b'. Like MEMCPY, the words at 'a' are
+ *   VSUB     read as if before any are changed. VSUB subtracts and VMUL multiplies them instead, and all
+ *   VMUL     three wrap round like ADD, SUB and MUL.
+ *   VSUM     sets 'result' to the sum of the words at 'b', wrapping round like ADD.
+ *   VCOUNT   sets 'result' to how many of the words at 'b' are equal to 'a'.
  *
- * These individual integers can be outputed with the OUT instruction.
-*/
-std::vector<uint> VM::string_to_int(std::string conv)
+ * Addresses wrap round like any other. Each run that stays inside one page on both sides, or inside flat
+ * memory, takes one call to memmove, memset or a SIMD kernel, and memory that was never written is left
+ * unallocated where the result would be 0 anyway. On flat memory the ranges are checked first, so a range
+ * that runs off the end changes nothing.
+ */
+template<bool Flat>
+bool VM::block_memory(uint op, uint a, uint b, uint len, uint& result)
 {
-  int shift = sizeof(uint) * 8;
-  std::string::iterator it = conv.begin();
-  std::vector<uint> returner;
-  uint int_chars = 0;
+  const uint64_t space = (uint64_t)1 << 32;
+  const bool two_ranges = op != MEMSET && op != VSUM && op != VCOUNT;
+  result = 0;
+  if(len == 0) return true;
 
-  while(shift > 0 && it != conv.end())
+#ifdef SAM_FLAT_MEMORY
+  const uint64_t limit = flat.size();
+  if(Flat && limit < space && ((two_ranges && a + (uint64_t)len > limit) || b + (uint64_t)len > limit))
+    return false;
+#endif
+
+  // How many words are contiguous from 'at', and up to 'at'
+  auto after = [](uint at) -> uint64_t
+  {
+    return Flat ? space - at : PagedMemory::page_size - (at & PagedMemory::page_mask);
+  };
+  auto before = [](uint at) -> uint64_t
   {
-    shift -= 8;
-    int_chars = int_chars | (*it << shift);
+    return Flat ? (at ? at : space) : ((at - 1) & PagedMemory::page_mask) + 1;
+  };
+  auto source = [&](uint at) -> const uint*
+  {
+#ifdef SAM_FLAT_MEMORY
+    if(Flat) return flat.data() + at;
+#endif
+    return memory.read_page(at >> PagedMemory::page_bits) + (at & PagedMemory::page_mask);
+  };
+  auto dest = [&](uint at) -> uint*
+  {
+#ifdef SAM_FLAT_MEMORY
+    if(Flat) return flat.data() + at;
+#endif
+    return memory.writable(at >> PagedMemory::page_bits) + (at & PagedMemory::page_mask);
+  };
+  auto unwritten = [&](uint at) { return !Flat && !memory.written(at >> PagedMemory::page_bits); };
 
-    it++;
+  // The next run of at most 'most' words that is contiguous from 'from' and 'to', after 'done' words of the
+  // ranges, or before the last 'done' words if 'backward'
+  const uint start = two_ranges ? a : b;
+  auto run = [&](uint64_t done, uint64_t most, bool backward, uint& from, uint& to) -> uint64_t
+  {
+    uint64_t count;
+    if(backward)
+    {
+      uint end_from = start + (uint)(len - done), end_to = b + (uint)(len - done);
+      count = std::min<uint64_t>({ len - done, most, before(end_from), before(end_to) });
+      from = end_from - (uint)count;
+      to = end_to - (uint)count;
+    }
+    else
+    {
+      from = start + (uint)done;
+      to = b + (uint)done;
+      count = std::min<uint64_t>({ len - done, most, after(from), after(to) });
+    }
+    return count;
+  };
+  // The destination starts inside the source, so work from the end to read each word before it changes
+  const bool backward = two_ranges && a != b && (uint)(b - a) < len;
+  const VectorKernels& kernels = vector_kernels();
+  uint from, to;
 
-    if(shift == 0 || it == conv.end())          // If it reaches the end of the integer or the end of the string
+  if(op == MEMCPY)
+  {
+    for(uint64_t done = 0, count; done < len && a != b; done += count)
+    {
+      count = run(done, space, backward, from, to);
+      if(unwritten(from) && unwritten(to)) continue;
+      uint* words = dest(to);                   // Before source(), in case both are on a page it allocates
+      std::memmove(words, source(from), count * sizeof(uint));
+    }
+  }
+  else if(op == MEMSET)
+  {
+    for(uint64_t done = 0, count; done < len; done += count)
+    {
+      count = run(done, space, false, from, to);
+      if(a) std::fill_n(dest(to), count, a);
+      else if(!unwritten(to)) std::memset(dest(to), 0, count * sizeof(uint));
+    }
+  }
+  else if(op == MEMCMP)
+  {
+    for(uint64_t done = 0, count; done < len; done += count)
+    {
+      count = run(done, space, false, from, to);
+      const uint* p = source(from);
+      const uint* q = source(to);
+      size_t i = (p == q) ? count : mismatch_words(p, q, count);
+      if(i < count)
+      {
+        result = (p[i] < q[i]) ? 1 : 2;
+        return true;
+      }
+    }
+  }
+  else if(op == VADD || op == VSUB || op == VMUL)
+  {
+    // Going backward, each run of the source is copied out before the kernel writes over it
+    void (*kernel)(uint*, const uint*, size_t) = (op == VADD) ? kernels.add : (op == VSUB) ? kernels.sub : kernels.mul;
+    uint buffer[1024];
+    for(uint64_t done = 0, count; done < len; done += count)
+    {
+      count = run(done, backward ? 1024 : space, backward, from, to);
+      if(unwritten(op == VMUL ? to : from)) continue;   // Adding or subtracting 0, or multiplying 0, changes nothing
+      uint* words = dest(to);
+      const uint* with = source(from);
+      if(backward) with = (const uint*)std::memcpy(buffer, with, count * sizeof(uint));
+      kernel(words, with, count);
+    }
+  }
+  else if(op == VSUM)
+  {
+    for(uint64_t done = 0, count; done < len; done += count)
     {
-      shift = sizeof(uint) * 8;                 // Reset for next integer
-      returner.push_back(int_chars);            // It must be returned eventually;
-      int_chars = 0;
+      count = run(done, space, false, from, to);
+      if(!unwritten(to)) result += kernels.sum(source(to), count);
     }
   }
+  else
+  {
+    for(uint64_t done = 0, count; done < len; done += count)
+    {
+      count = run(done, space, false, from, to);
+      if(unwritten(to)) result += a ? 0 : (uint)count;
+      else result += kernels.count(source(to), count, a);
+    }
+  }
+  return true;
+}
+
+template<>
+uint VM::read_memory<false>(uint addr)
+{
+  return memory.read(addr);
+}
 
-  return returner;
+template<>
+void VM::write_memory<false>(uint addr, uint val)
+{
+  memory.write(addr, val);
 }
 
-void VM::vec_to_mem(std::vector<uint> str, uint size, uint addr)
+#ifdef SAM_FLAT_MEMORY
+template<>
+uint VM::read_memory<true>(uint addr)
 {
-  alloc(addr + size);       // Allow an extra integer for the null integer at the end to delimit the string
-  memory[addr + size] = 0;  // Null integer
-  for(int i = 0; i < size && i < str.size(); i++)
-  {
-    memory[addr + i] = str[i];
-  }
+  return flat.data()[addr];
 }
 
-void VM::alloc(uint addr)
+template<>
+void VM::write_memory<true>(uint addr, uint val)
 {
-  if(memory.size() <= addr) memory.resize(addr + 1);  // Resize the array to include the memory address
+  flat.data()[addr] = val;
 }
+#endif
 
+/*
+ * Bytecode files start with the bytecode version and the size of uint. Version 1 files follow that with 16
+ * reserved bytes and then the code, as big-endian words. From SAM_NATIVE_LAYOUT_VER on, the reserved bytes
+ * say how the code is stored, and the code starts at the fixed SAM_CODE_OFFSET so load() can read it in place in
+ * one call:
+ *
+ *   byte 2       byte order of the code: 1 for little-endian, 2 for big-endian
+ *   bytes 4-11   number of words of code
+ *   bytes 12-15  offset of the code from the start of the file
+ *
+ * Header fields are little-endian; the code is in the byte order of the machine that saved it.
+ */
 bool VM::save(std::string filename)
 {
   std::ofstream outfile;
-  outfile.open(filename);
+  outfile.open(filename, std::ios::binary);
 
   if(!outfile.is_open())
   {
@@ -556,29 +4632,28 @@ bool VM::save(std::string filename)
     return false;
   }                                             // Exit early on error
 
-  // The header
-  outfile.put((char)SAM_BYTECODE_VER);          // The first byte is the bytecode version
-  outfile.put((char)sizeof(uint));              // The second byte is the uint size (platform-stuff)
-  for(int i = 0; i < 16; i++) outfile.put(0);   // 16 bytes of empty space reserved for future header/file additions
+  unsigned char header[SAM_CODE_OFFSET] = { 0 };
+  header[0] = SAM_BYTECODE_VER;
+  header[1] = sizeof(uint);
+  header[2] = little_endian() ? 1 : 2;
+  for(int i = 0; i < 8; i++) header[4 + i] = (unsigned char)((uint64_t)program->code.size() >> (8 * i));
+  for(int i = 0; i < 4; i++) header[12 + i] = (unsigned char)(SAM_CODE_OFFSET >> (8 * i));
 
-  //Cycle through all integers
-  for(auto it = code.begin(); it != code.end(); it++)
+  outfile.write((const char*)header, sizeof(header));
+  outfile.write((const char*)program->code.data(), program->code.size() * sizeof(uint));
+  outfile.close();
+  if(outfile.fail())
   {
-    // Cycle through every character in the integer
-    for(int shift = sizeof(uint) * 8 - 8; shift >= 0; shift -= 8)
-    {
-      outfile.put((char)(*it >> shift));
-    }
+    error_state = ERR_READ_FAIL;
+    return false;
   }
-
-  outfile.close();
   return true;
 }
 
 bool VM::load(std::string filename)
 {
   std::ifstream infile;
-  infile.open(filename);
+  infile.open(filename, std::ios::binary);
 
   if(!infile.is_open())
   {
@@ -587,37 +4662,93 @@ bool VM::load(std::string filename)
   }
 
   // Read the header
-  if(infile.get() != SAM_BYTECODE_VER)          // Exit for incorrect bytecode version
+  unsigned char header[18] = { 0 };
+  infile.read((char*)header, sizeof(header));
+  if(infile.gcount() < 1 || header[0] < 1 || header[0] > SAM_BYTECODE_VER)     // Exit for unknown bytecode versions
   {
     error_state = ERR_BYTECODE_VER;
     return false;
   }
-  if(infile.get() != sizeof(uint))              // Incorrect int size
+  if(infile.gcount() < 2 || header[1] != sizeof(uint))                          // Incorrect int size
   {
     error_state = ERR_INT_SIZE;
     return false;
   }
-  for(int i = 0; i < 16; i++) infile.get();     // 16 dummy bytes reserved for later used
-
-  // Read the code
-  while(!infile.eof())
+  if(infile.gcount() < (std::streamsize)sizeof(header))
   {
-    uint new_int = 0;
+    error_state = ERR_READ_FAIL;
+    return false;
+  }
 
-    for(int shift = sizeof(uint) * 8 - 8; shift >= 0; shift -= 8)
+  infile.seekg(0, std::ios::end);
+  uint64_t file_size = infile.tellg();
+  uint64_t offset = sizeof(header);
+  uint64_t bytes = file_size - offset;
+  bool swap = little_endian();
+  if(header[0] >= SAM_NATIVE_LAYOUT_VER)
+  {
+    uint64_t count = 0;
+    offset = 0;
+    for(int i = 7; i >= 0; i--) count = count << 8 | header[4 + i];
+    for(int i = 3; i >= 0; i--) offset = offset << 8 | header[12 + i];
+    swap = (header[2] == 1) != little_endian();
+    if((header[2] != 1 && header[2] != 2) || offset < sizeof(header) || offset > file_size ||
+       count > (file_size - offset) / sizeof(uint))
     {
-      unsigned char read_char = infile.get();
-      if(!infile.fail())
-      {
-        new_int |= ((uint)(read_char) << shift);
-      }
+      error_state = ERR_READ_FAIL;
+      return false;
     }
+    bytes = count * sizeof(uint);
+  }
 
-    code.push_back(new_int);
+  if(!load_code(infile, offset, bytes, swap))
+  {
+    error_state = ERR_READ_FAIL;
+    return false;
   }
 
+  // The code is verified when it first runs. Code the verifier rejects still loads, and runs with every check on.
   return true;
 }
+
+/*
+ * Append the code stored in 'bytes' bytes at 'offset' in the file, swapping the byte order of each word if
+ * asked. A partial last word is padded with zero bytes. Native-layout code is read in one call.
+ */
+bool VM::load_code(std::ifstream& infile, uint64_t offset, uint64_t bytes, bool swap)
+{
+  std::vector<uint>& code = edit();
+  size_t start = code.size();
+  code.resize(start + (bytes + sizeof(uint) - 1) / sizeof(uint), 0);
+
+  infile.clear();
+  infile.seekg(offset);
+  bool ok = bytes == 0 || (bool)infile.read((char*)(code.data() + start), bytes);
+
+  if(!ok)
+  {
+    code.resize(start);
+    return false;
+  }
+  if(swap) swap_copy(code.data() + start, code.data() + start, code.size() - start);
+  return true;
+}
+
+// A partial last word is padded with nulls
+void VM::pack_words(const char* chars, size_t length, uint* words)
+{
+  const size_t whole = length / sizeof(uint);
+  if(little_endian()) swap_copy(chars, words, whole);
+  else std::memcpy(words, chars, whole * sizeof(uint));
+
+  if(length % sizeof(uint))
+  {
+    uint word = 0;
+    for(size_t c = 0; c < length % sizeof(uint); c++)
+      word |= (uint)(unsigned char)chars[whole * sizeof(uint) + c] << (8 * (sizeof(uint) - 1 - c));
+    words[whole] = word;
+  }
+}
 }
 
 #endif